@@ -189,14 +189,14 @@ int parasite_fixup_vdso(struct parasite_ctl *ctl, pid_t pid,
 		pr_debug("vdso: Droppping marked vdso at %lx\n",
 			 (long)proxy_vdso_marked->e->start);
 		list_del(&proxy_vdso_marked->list);
-		xfree(proxy_vdso_marked);
+		free_vma_area(proxy_vdso_marked);
 		vma_area_list->nr--;
 
 		if (proxy_vvar_marked) {
 			pr_debug("vdso: Droppping marked vvar at %lx\n",
 				 (long)proxy_vvar_marked->e->start);
 			list_del(&proxy_vvar_marked->list);
-			xfree(proxy_vvar_marked);
+			free_vma_area(proxy_vvar_marked);
 			vma_area_list->nr--;
 		}
 	}
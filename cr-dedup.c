@@ -4,12 +4,19 @@
 #include <unistd.h>
 
 #include "crtools.h"
+#include "cr_options.h"
+#include "servicefd.h"
 #include "page-read.h"
+#include "page-store.h"
 #include "restorer.h"
 
+#include "protobuf.h"
+#include "protobuf/pagemap.pb-c.h"
+
 #define MAX_BUNCH_SIZE 256
 
 static int cr_dedup_one_pagemap(int pid);
+static int cr_dedup_store(void);
 
 int cr_dedup(void)
 {
@@ -18,6 +25,9 @@ int cr_dedup(void)
 	DIR * dirp;
 	struct dirent *ent;
 
+	if (opts.page_store)
+		return cr_dedup_store();
+
 	dirp = opendir(CR_PARENT_LINK);
 	if (dirp == NULL) {
 		pr_perror("Can't enter previous snapshot folder, error=%d", errno);
@@ -67,7 +77,7 @@ static int cr_dedup_one_pagemap(int pid)
 	struct page_read * prp;
 	struct iovec iov;
 
-	ret = open_page_read(pid, &pr, O_RDWR, false);
+	ret = open_page_read(pid, &pr, O_RDWR, PR_TASK);
 	if (ret) {
 		ret = -1;
 		goto exit;
@@ -103,6 +113,174 @@ exit:
 	return 0;
 }
 
+static int dedup_store_iov(struct page_read *pr, int fd, struct iovec *iov)
+{
+	static char buf[PAGE_STORE_BATCH * PAGE_SIZE];
+	unsigned long vaddr = (unsigned long)iov->iov_base;
+	unsigned long nr = iov->iov_len / PAGE_SIZE;
+	u64 idx[PAGE_STORE_BATCH];
+
+	while (nr) {
+		unsigned long n = min(nr, (unsigned long)PAGE_STORE_BATCH);
+
+		if (pr->read_pages(pr, vaddr, n, buf) < 0)
+			return -1;
+		if (page_store_write(buf, n, idx))
+			return -1;
+		if (page_store_write_pagemap(fd, vaddr, idx, n))
+			return -1;
+
+		vaddr += n * PAGE_SIZE;
+		nr -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Moves pages of one pagemap into the page store. The pagemap
+ * image is re-created with entries referring to the store, the
+ * pages image is left (pagemap head refers to it), but emptied.
+ */
+static int cr_dedup_store_one(long id, bool shmem)
+{
+	int type = shmem ? CR_FD_SHMEM_PAGEMAP : CR_FD_PAGEMAP;
+	PagemapHead head = PAGEMAP_HEAD__INIT, *h;
+	struct page_read pr;
+	char path[PATH_MAX];
+	struct iovec iov;
+	int fd, ret;
+
+	fd = open_image(type, O_RSTR, id);
+	if (fd < 0)
+		return -1;
+
+	ret = pb_read_one(fd, &h, PB_PAGEMAP_HEAD);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	head.pages_id = h->pages_id;
+	pagemap_head__free_unpacked(h, NULL);
+
+	if (open_page_read(id, &pr, O_RDWR, shmem ? PR_SHMEM : PR_TASK))
+		return -1;
+
+	/* Page read keeps the old image open, new one takes its name */
+	snprintf(path, sizeof(path), fdset_template[type].fmt, id);
+	if (unlinkat(get_service_fd(IMG_FD_OFF), path, 0)) {
+		pr_perror("Can't unlink %s", path);
+		pr.close(&pr);
+		return -1;
+	}
+
+	fd = open_image(type, O_DUMP | O_BUF, id);
+	if (fd < 0) {
+		pr.close(&pr);
+		return -1;
+	}
+
+	ret = pb_write_one(fd, &head, PB_PAGEMAP_HEAD);
+	while (!ret) {
+		ret = pr.get_pagemap(&pr, &iov);
+		if (ret <= 0)
+			break;
+
+		pr_debug("store iovec base=%p, len=%zu\n", iov.iov_base, iov.iov_len);
+		if (pr.pe->in_parent || pr.pe->has_store_page)
+			ret = pb_write_one(fd, pr.pe, PB_PAGEMAP);
+		else
+			ret = dedup_store_iov(&pr, fd, &iov);
+
+		pr.put_pagemap(&pr);
+	}
+
+	if (!ret && ftruncate(pr.fd_pg, 0)) {
+		pr_perror("Can't truncate pages image");
+		ret = -1;
+	}
+
+	pr.close(&pr);
+	if (close_image(fd))
+		ret = -1;
+
+	return ret;
+}
+
+struct dedup_pagemap {
+	long	id;
+	bool	shmem;
+};
+
+static int cr_dedup_store(void)
+{
+	struct dedup_pagemap *pms = NULL, *pm;
+	int nr = 0, i, ret = -1;
+	struct dirent *ent;
+	DIR *dirp;
+
+	if (page_store_init())
+		return -1;
+
+	/*
+	 * Pagemaps are re-created while we go, so collect
+	 * them first not to meet the new ones in readdir.
+	 */
+	dirp = opendir(".");
+	if (dirp == NULL) {
+		pr_perror("Can't open images dir");
+		goto out;
+	}
+
+	while (1) {
+		long id;
+		bool shmem;
+
+		errno = 0;
+		ent = readdir(dirp);
+		if (ent == NULL) {
+			if (errno) {
+				pr_perror("Failed readdir");
+				goto out;
+			}
+			break;
+		}
+
+		if (sscanf(ent->d_name, "pagemap-shmem-%ld.img", &id) == 1)
+			shmem = true;
+		else if (sscanf(ent->d_name, "pagemap-%ld.img", &id) == 1)
+			shmem = false;
+		else
+			continue;
+
+		pm = xrealloc(pms, (nr + 1) * sizeof(*pms));
+		if (!pm)
+			goto out;
+
+		pms = pm;
+		pms[nr].id = id;
+		pms[nr].shmem = shmem;
+		nr++;
+	}
+
+	for (i = 0; i < nr; i++) {
+		pr_info("%s %ld\n", pms[i].shmem ? "shmem" : "pid", pms[i].id);
+		if (cr_dedup_store_one(pms[i].id, pms[i].shmem))
+			goto out;
+	}
+
+	ret = 0;
+out:
+	if (dirp)
+		closedir(dirp);
+	xfree(pms);
+	if (page_store_fini())
+		ret = -1;
+	if (!ret)
+		pr_info("Deduplicated into page store\n");
+	return ret;
+}
+
 static inline bool can_extend_batch(struct iovec *bunch,
 		unsigned long off, unsigned long len)
 {
@@ -170,7 +348,8 @@ int dedup_one_iovec(struct page_read *pr, struct iovec *iov)
 		pagemap2iovec(pr->pe, &piov);
 		piov_end = (unsigned long)piov.iov_base + piov.iov_len;
 		off_real = lseek(pr->fd_pg, 0, SEEK_CUR);
-		if (!pr->pe->in_parent) {
+		if (!pr->pe->in_parent && !pr->pe->has_store_page &&
+		    !pr->pe->has_compressed_size) {
 			ret = punch_hole(pr, off_real, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
@@ -18,6 +18,7 @@
 
 #include <sched.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "protobuf.h"
 #include "protobuf/fdinfo.pb-c.h"
@@ -65,6 +66,7 @@
 #include "stats.h"
 #include "mem.h"
 #include "page-pipe.h"
+#include "page-store.h"
 #include "posix-timer.h"
 #include "vdso.h"
 #include "vma.h"
@@ -135,9 +137,10 @@ void free_mappings(struct vm_area_list *vma_area_list)
 		close_vma_file(vma_area);
 		if (!vma_area->file_borrowed)
 			free(vma_area->st);
-		free(vma_area);
+		free_vma_area(vma_area);
 	}
 
+	free_vma_batches(vma_area_list);
 	INIT_LIST_HEAD(&vma_area_list->h);
 	vma_area_list->nr = 0;
 }
@@ -801,6 +804,32 @@ err:
 }
 
 static int collect_task(struct pstree_item *item);
+
+static int cmp_pid(const void *a, const void *b)
+{
+	pid_t p1 = *(const pid_t *)a, p2 = *(const pid_t *)b;
+
+	return p1 < p2 ? -1 : p1 > p2;
+}
+
+/* Tasks and threads caught from the freezer cgroup, sorted */
+static pid_t *cgroup_tasks;
+static int nr_cgroup_tasks;
+
+/*
+ * With --freeze-cgroup tasks are caught by freeze_processes() at
+ * once, so here we only wait for them to stop. Tree tasks out of
+ * the cgroup are caught the usual way.
+ */
+static int seize_tree_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid)
+{
+	if (!bsearch(&pid, cgroup_tasks, nr_cgroup_tasks, sizeof(pid_t), cmp_pid) &&
+	    seize_catch_task(pid))
+		return -1;
+
+	return seize_wait_task(pid, ppid, pgid, sid);
+}
+
 static int get_children(struct pstree_item *item)
 {
 	pid_t *ch;
@@ -833,7 +862,7 @@ static int get_children(struct pstree_item *item)
 			goto free;
 		}
 
-		ret = seize_task(pid, item->pid.real, &item->pgid, &item->sid);
+		ret = seize_tree_task(pid, item->pid.real, &item->pgid, &item->sid);
 		if (ret < 0) {
 			/*
 			 * Here is a race window between parse_children() and seize(),
@@ -898,7 +927,8 @@ static pid_t item_ppid(const struct pstree_item *item)
 static int seize_threads(struct pstree_item *item,
 				struct pid *threads, int nr_threads)
 {
-	int i = 0, ret, j, nr_inprogress, nr_stopped = 0;
+	int i = 0, ret, nr_inprogress, nr_stopped = 0, nr_seized;
+	pid_t *seized = NULL;
 
 	if ((item->state == TASK_DEAD) && (nr_threads > 1)) {
 		pr_err("Zombies with threads are not supported\n");
@@ -915,24 +945,34 @@ static int seize_threads(struct pstree_item *item,
 		item->nr_threads = 1;
 	}
 
+	/*
+	 * Threads seized on previous attempts are looked up in a sorted
+	 * copy of their pids, scanning item->threads for each of the
+	 * threads is quadratic and hurts with thousands of them.
+	 */
+	nr_seized = item->nr_threads;
+	seized = xmalloc(nr_seized * sizeof(pid_t));
+	if (seized == NULL)
+		return -1;
+
+	for (i = 0; i < nr_seized; i++)
+		seized[i] = item->threads[i].real;
+	qsort(seized, nr_seized, sizeof(pid_t), cmp_pid);
+
 	nr_inprogress = 0;
 	for (i = 0; i < nr_threads; i++) {
 		pid_t pid = threads[i].real;
 		if (item->pid.real == pid)
 			continue;
 
-		for (j = 0; j < item->nr_threads; j++)
-			if (pid == item->threads[j].real)
-				break;
-
-		if (j != item->nr_threads)
+		if (bsearch(&pid, seized, nr_seized, sizeof(pid_t), cmp_pid))
 			continue;
 		nr_inprogress++;
 
 		pr_info("\tSeizing %d's %d thread\n",
 				item->pid.real, pid);
 
-		ret = seize_task(pid, item_ppid(item), NULL, NULL);
+		ret = seize_tree_task(pid, item_ppid(item), NULL, NULL);
 		if (ret < 0) {
 			/*
 			 * Here is a race window between parse_threads() and seize(),
@@ -963,8 +1003,10 @@ static int seize_threads(struct pstree_item *item,
 		goto err;
 	}
 
+	xfree(seized);
 	return nr_inprogress;
 err:
+	xfree(seized);
 	return -1;
 }
 
@@ -1055,18 +1097,227 @@ int collect_pstree_ids(void)
 	return 0;
 }
 
+#define FREEZER_STATE_LEN	16
+#define FREEZE_ATTEMPTS		100	/* by 100ms */
+
+static int get_freezer_state(int fd, char *state)
+{
+	int ret;
+
+	ret = pread(fd, state, FREEZER_STATE_LEN - 1, 0);
+	if (ret < 0) {
+		pr_perror("Can't read freezer state");
+		return -1;
+	}
+
+	state[ret] = '\0';
+	if (ret && state[ret - 1] == '\n')
+		state[ret - 1] = '\0';
+
+	return 0;
+}
+
+static int set_freezer_state(int fd, const char *state)
+{
+	if (pwrite(fd, state, strlen(state), 0) != strlen(state)) {
+		pr_perror("Can't set freezer state to %s", state);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Child cgroups are frozen too, so their tasks are caught as well */
+static int catch_cgroup_tasks(const char *cg)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+	FILE *f;
+	pid_t pid, *t;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/tasks", cg);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	while (fscanf(f, "%d", &pid) == 1) {
+		t = xrealloc(cgroup_tasks, (nr_cgroup_tasks + 1) * sizeof(pid_t));
+		if (t == NULL) {
+			ret = -1;
+			break;
+		}
+
+		cgroup_tasks = t;
+		cgroup_tasks[nr_cgroup_tasks++] = pid;
+
+		if (seize_catch_task(pid)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	fclose(f);
+	if (ret)
+		return ret;
+
+	d = opendir(cg);
+	if (d == NULL) {
+		pr_perror("Can't open %s", cg);
+		return -1;
+	}
+
+	while ((de = readdir(d))) {
+		if (de->d_type != DT_DIR || dir_dots(de))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", cg, de->d_name);
+		ret = catch_cgroup_tasks(path);
+		if (ret)
+			break;
+	}
+
+	closedir(d);
+	return ret;
+}
+
+static bool task_in_pstree(struct pstree_item *root, pid_t pid)
+{
+	struct pstree_item *item = root;
+	int i;
+
+	for_each_pstree_item(item) {
+		if (item->pid.real == pid)
+			return true;
+
+		for (i = 0; i < item->nr_threads; i++)
+			if (item->threads[i].real == pid)
+				return true;
+	}
+
+	return false;
+}
+
+/*
+ * The cgroup may have tasks which are not in the dumped tree,
+ * they are caught as well, but only tree tasks are unseized
+ * later, so let the others go. A caught task may not have
+ * reached the stop yet, so wait for it then.
+ */
+static void release_cgroup_tasks(struct pstree_item *root)
+{
+	int i, status, sig;
+	pid_t pid;
+
+	for (i = 0; i < nr_cgroup_tasks; i++) {
+		pid = cgroup_tasks[i];
+		if (root && task_in_pstree(root, pid))
+			continue;
+
+		if (!ptrace(PTRACE_DETACH, pid, NULL, NULL))
+			continue;
+
+		if (wait4(pid, &status, __WALL, NULL) != pid || !WIFSTOPPED(status))
+			continue;
+
+		/* Don't lose a signal the task has stopped with */
+		sig = (status >> 16) == PTRACE_EVENT_STOP ? 0 : WSTOPSIG(status);
+
+		pr_debug("Releasing non-tree task %d\n", pid);
+		if (ptrace(PTRACE_DETACH, pid, NULL, (void *)(unsigned long)sig))
+			pr_perror("Can't detach from %d", pid);
+	}
+
+	xfree(cgroup_tasks);
+	cgroup_tasks = NULL;
+	nr_cgroup_tasks = 0;
+}
+
+/*
+ * Freeze the whole tree with the freezer cgroup, then SEIZE and
+ * INTERRUPT all its tasks and threads at once and thaw it back.
+ * The tasks can't fork or spawn threads while frozen and stop in
+ * ptrace right after thawing, so collecting the tree afterwards
+ * only waits for them and the attempts loops finish on the first
+ * pass regardless of the tree size.
+ */
+static int freeze_processes(void)
+{
+	char path[PATH_MAX], state[FREEZER_STATE_LEN];
+	int fd, i, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/freezer.state", opts.freeze_cgroup);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		pr_perror("Can't open %s", path);
+		return -1;
+	}
+
+	if (get_freezer_state(fd, state))
+		goto out;
+
+	if (strcmp(state, "THAWED")) {
+		pr_err("Freezer cgroup %s is in %s state\n",
+				opts.freeze_cgroup, state);
+		goto out;
+	}
+
+	pr_info("Freezing %s\n", opts.freeze_cgroup);
+	if (set_freezer_state(fd, "FROZEN"))
+		goto out;
+
+	for (i = 0; i < FREEZE_ATTEMPTS; i++) {
+		struct timespec req = { .tv_nsec = 100000000, };
+
+		if (get_freezer_state(fd, state))
+			goto thaw;
+		if (!strcmp(state, "FROZEN"))
+			break;
+
+		nanosleep(&req, NULL);
+	}
+
+	if (i == FREEZE_ATTEMPTS) {
+		pr_err("Unable to freeze %s, it's in %s state\n",
+				opts.freeze_cgroup, state);
+		goto thaw;
+	}
+
+	pr_debug("Frozen %s in %d attempts\n", opts.freeze_cgroup, i + 1);
+	ret = catch_cgroup_tasks(opts.freeze_cgroup);
+	qsort(cgroup_tasks, nr_cgroup_tasks, sizeof(pid_t), cmp_pid);
+thaw:
+	if (set_freezer_state(fd, "THAWED"))
+		ret = -1;
+out:
+	close(fd);
+	return ret;
+}
+
 static int collect_pstree(pid_t pid)
 {
+	unsigned long long ts;
 	int ret;
 
 	timing_start(TIME_FREEZING);
+	ts = trace_start();
 
 	root_item = alloc_pstree_item();
 	if (root_item == NULL)
 		return -1;
 
 	root_item->pid.real = pid;
-	ret = seize_task(pid, -1, &root_item->pgid, &root_item->sid);
+
+	if (opts.freeze_cgroup && freeze_processes()) {
+		/* None of them is waited for yet */
+		release_cgroup_tasks(NULL);
+		goto err;
+	}
+
+	ret = seize_tree_task(pid, -1, &root_item->pgid, &root_item->sid);
 	if (ret < 0)
 		goto err;
 	pr_info("Seized task %d, state %d\n", pid, ret);
@@ -1076,12 +1327,16 @@ static int collect_pstree(pid_t pid)
 	if (ret < 0)
 		goto err;
 
+	release_cgroup_tasks(root_item);
+
+	trace_stop(PHASE_SEIZE, pid, ts);
 	timing_stop(TIME_FREEZING);
 	timing_start(TIME_FROZEN);
 
 	return 0;
 err:
 	pstree_switch_state(root_item, TASK_ALIVE);
+	release_cgroup_tasks(root_item);
 	return -1;
 }
 
@@ -1119,33 +1374,21 @@ static int collect_file_locks(void)
 
 }
 
-static int dump_task_thread(struct parasite_ctl *parasite_ctl,
-				const struct pstree_item *item, int id)
+static int dump_task_thread(const struct pstree_item *item, int id)
 {
 	struct pid *tid = &item->threads[id];
 	CoreEntry *core = item->core[id];
-	pid_t pid = tid->real;
-	int ret = -1, fd_core;
+	int ret, fd_core;
 
-	pr_info("\n");
-	pr_info("Dumping core for thread (pid: %d)\n", pid);
-	pr_info("----------------------------------------\n");
-
-	ret = parasite_dump_thread_seized(parasite_ctl, id, tid, core);
-	if (ret) {
-		pr_err("Can't dump thread for pid %d\n", pid);
-		goto err;
-	}
+	pr_info("Writing core for thread (pid: %d)\n", tid->real);
 
 	fd_core = open_image(CR_FD_CORE, O_DUMP, tid->virt);
 	if (fd_core < 0)
-		goto err;
+		return -1;
 
 	ret = pb_write_one(fd_core, core, PB_CORE);
 
 	close(fd_core);
-err:
-	pr_info("----------------------------------------\n");
 	return ret;
 }
 
@@ -1281,20 +1524,30 @@ static int dump_task_signals(pid_t pid, struct pstree_item *item)
 static struct proc_pid_stat pps_buf;
 
 static int dump_task_threads(struct parasite_ctl *parasite_ctl,
-			     const struct pstree_item *item)
+			     struct pstree_item *item)
 {
 	int i;
 
+	pr_info("\n");
+	pr_info("Dumping %d threads of %d\n", item->nr_threads - 1, item->pid.real);
+	pr_info("----------------------------------------\n");
+
+	if (parasite_dump_threads_seized(parasite_ctl, item)) {
+		pr_err("Can't dump threads of %d\n", item->pid.real);
+		return -1;
+	}
+
 	for (i = 0; i < item->nr_threads; i++) {
 		/* Leader is already dumped */
 		if (item->pid.real == item->threads[i].real) {
 			item->threads[i].virt = item->pid.virt;
 			continue;
 		}
-		if (dump_task_thread(parasite_ctl, item, i))
+		if (dump_task_thread(item, i))
 			return -1;
 	}
 
+	pr_info("----------------------------------------\n");
 	return 0;
 }
 
@@ -1396,16 +1649,34 @@ err:
 	return ret;
 }
 
+/* Shmem is pre-dumped too, to get its pages and hashes into parent */
+static int predump_shmem_areas(pid_t pid, struct vm_area_list *vmas)
+{
+	struct vma_area *vma;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_entry_is(vma->e, VMA_AREA_REGULAR) ||
+		    vma_entry_is(vma->e, VMA_AREA_SYSVIPC) ||
+		    !vma_entry_is(vma->e, VMA_ANON_SHARED))
+			continue;
+
+		if (add_shmem_area(pid, vma->e))
+			return -1;
+	}
+
+	return 0;
+}
+
 static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
 {
 	pid_t pid = item->pid.real;
 	struct vm_area_list vmas;
 	struct parasite_ctl *parasite_ctl;
+	unsigned long long ts;
 	int ret = -1;
 	struct parasite_dump_misc misc;
 
-	INIT_LIST_HEAD(&vmas.h);
-	vmas.nr = 0;
+	vm_area_list_init(&vmas);
 
 	pr_info("========================================\n");
 	pr_info("Pre-dumping task (pid: %d)\n", pid);
@@ -1419,14 +1690,22 @@ static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
 	if (item->state == TASK_DEAD)
 		return 0;
 
+	ts = trace_start();
 	ret = collect_mappings(pid, &vmas);
+	trace_stop(PHASE_VMAS, pid, ts);
 	if (ret) {
 		pr_err("Collect mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
 	}
 
+	ret = predump_shmem_areas(pid, &vmas);
+	if (ret)
+		goto err_free;
+
 	ret = -1;
+	ts = trace_start();
 	parasite_ctl = parasite_infect_seized(pid, item, &vmas, NULL, 0);
+	trace_stop(PHASE_INFECT, pid, ts);
 	if (!parasite_ctl) {
 		pr_err("Can't infect (pid: %d) with parasite\n", pid);
 		goto err_free;
@@ -1475,6 +1754,7 @@ static int dump_one_task(struct pstree_item *item)
 	pid_t pid = item->pid.real;
 	struct vm_area_list vmas;
 	struct parasite_ctl *parasite_ctl;
+	unsigned long long ts;
 	int ret = -1;
 	struct parasite_dump_misc misc;
 	struct cr_fdset *cr_fdset = NULL;
@@ -1482,8 +1762,7 @@ static int dump_one_task(struct pstree_item *item)
 	struct proc_posix_timers_stat proc_args;
 	struct proc_status_creds cr;
 
-	INIT_LIST_HEAD(&vmas.h);
-	vmas.nr = 0;
+	vm_area_list_init(&vmas);
 
 	pr_info("========================================\n");
 	pr_info("Dumping task (pid: %d)\n", pid);
@@ -1510,7 +1789,9 @@ static int dump_one_task(struct pstree_item *item)
 		goto err;
 	}
 
+	ts = trace_start();
 	ret = collect_mappings(pid, &vmas);
+	trace_stop(PHASE_VMAS, pid, ts);
 	if (ret) {
 		pr_err("Collect mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
@@ -1539,7 +1820,9 @@ static int dump_one_task(struct pstree_item *item)
 	}
 
 	ret = -1;
+	ts = trace_start();
 	parasite_ctl = parasite_infect_seized(pid, item, &vmas, dfds, proc_args.timer_n);
+	trace_stop(PHASE_INFECT, pid, ts);
 	if (!parasite_ctl) {
 		pr_err("Can't infect (pid: %d) with parasite\n", pid);
 		goto err;
@@ -1598,7 +1881,9 @@ static int dump_one_task(struct pstree_item *item)
 	}
 
 	if (!shared_fdtable(item)) {
+		ts = trace_start();
 		ret = dump_task_files_seized(parasite_ctl, item, dfds);
+		trace_stop(PHASE_FILES_DUMP, pid, ts);
 		if (ret) {
 			pr_err("Dump files (pid: %d) failed with %d\n", pid, ret);
 			goto err_cure;
@@ -1672,7 +1957,7 @@ static int dump_one_task(struct pstree_item *item)
 		goto err;
 	}
 
-	close_cr_fdset(&cr_fdset);
+	ret = close_cr_fdset(&cr_fdset);
 err:
 	close_pid_proc();
 	free_mappings(&vmas);
@@ -1744,31 +2029,34 @@ err:
 
 	pr_info("Pre-dumping tasks' memory\n");
 	list_for_each_entry_safe(ctl, n, &ctls, pre_list) {
-		struct page_xfer xfer;
-
-		pr_info("\tPre-dumping %d\n", ctl->pid.virt);
-		timing_start(TIME_MEMWRITE);
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
-		if (ret < 0)
-			break;
-
-		ret = page_xfer_dump_pages(&xfer, ctl->mem_pp, 0);
-
-		xfer.close(&xfer);
-
-		if (ret)
-			break;
+		/* Over --pipe-mem-limit pages are written already */
+		if (ctl->mem_pp) {
+			pr_info("\tPre-dumping %d\n", ctl->pid.virt);
+			timing_start(TIME_MEMWRITE);
+			ret = page_xfer_dump_pages_bg(NULL, ctl->mem_pp, ctl->pid.virt);
+			if (ret)
+				break;
 
-		timing_stop(TIME_MEMWRITE);
+			timing_stop(TIME_MEMWRITE);
 
-		destroy_page_pipe(ctl->mem_pp);
+			destroy_page_pipe(ctl->mem_pp);
+		}
 		list_del(&ctl->pre_list);
 		parasite_cure_local(ctl);
 	}
 
+	if (wait_page_writers())
+		ret = -1;
+
+	if (!ret && cr_dump_shmem())
+		ret = -1;
+
 	if (irmap_predump_run())
 		ret = -1;
 
+	if (page_store_fini())
+		ret = -1;
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
@@ -1785,6 +2073,7 @@ err:
 int cr_dump_tasks(pid_t pid)
 {
 	struct pstree_item *item;
+	unsigned long long ts;
 	int post_dump_ret = 0;
 	int ret = -1;
 
@@ -1840,8 +2129,10 @@ int cr_dump_tasks(pid_t pid)
 	if (collect_mnt_namespaces() < 0)
 		goto err;
 
+	ts = trace_start();
 	if (collect_sockets(pid))
 		goto err;
+	trace_stop(PHASE_SOCKETS_DUMP, pid, ts);
 
 	glob_fdset = cr_glob_fdset_open(O_DUMP);
 	if (!glob_fdset)
@@ -1885,12 +2176,23 @@ int cr_dump_tasks(pid_t pid)
 	if (ret)
 		goto err;
 
+	ret = wait_page_writers();
+	if (ret)
+		goto err;
+
 	fd_id_show_tree();
 err:
+	if (wait_page_writers())
+		ret = -1;
+
+	if (page_store_fini())
+		ret = -1;
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
-	close_cr_fdset(&glob_fdset);
+	if (close_cr_fdset(&glob_fdset))
+		ret = -1;
 
 	cr_plugin_fini();
 
@@ -23,6 +23,7 @@
 #include <sched.h>
 
 #include <sys/sendfile.h>
+#include <pthread.h>
 
 #include "ptrace.h"
 #include "compiler.h"
@@ -71,6 +72,7 @@
 #include "cgroup.h"
 #include "timerfd.h"
 #include "file-lock.h"
+#include "lazy-pages.h"
 
 #include "parasite-syscall.h"
 
@@ -95,6 +97,112 @@ static int prepare_signals(int pid, CoreEntry *core);
 
 static int root_as_sibling;
 
+/*
+ * Core and mm images of all tasks are read and unpacked up front by
+ * a bunch of threads, so that neither forking (with ns_last_pid lock
+ * held) nor root_prepare_shared walk the whole tree reading them one
+ * by one. Workers don't log, anything they failed with is read again
+ * the regular way and reported there.
+ */
+#define PREFETCH_MAX_JOBS	32
+
+struct prefetch_job {
+	struct pstree_item	**items;
+	int			nr;
+	atomic_t		next;
+};
+
+static void *prefetch_entry(int type, int pb_type, int pid)
+{
+	char path[PATH_MAX];
+	void *buf = NULL, *ret = NULL;
+	struct stat st;
+	u32 hdr[2];	/* magic and entry size */
+	int fd;
+
+	snprintf(path, sizeof(path), fdset_template[type].fmt, pid);
+	fd = openat(get_service_fd(IMG_FD_OFF), path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr[0] != fdset_template[type].magic)
+		goto out;
+
+	if (fstat(fd, &st) || hdr[1] > st.st_size - sizeof(hdr))
+		goto out;
+
+	buf = malloc(hdr[1]);
+	if (!buf)
+		goto out;
+
+	if (read(fd, buf, hdr[1]) == hdr[1])
+		ret = cr_pb_descs[pb_type].unpack(NULL, hdr[1], buf);
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+static void *prefetch_worker(void *arg)
+{
+	struct prefetch_job *j = arg;
+	int i;
+
+	while (1) {
+		struct pstree_item *item;
+
+		i = atomic_add_return(1, &j->next) - 1;
+		if (i >= j->nr)
+			break;
+
+		item = j->items[i];
+		item->rst->core = prefetch_entry(CR_FD_CORE, PB_CORE, item->pid.virt);
+		item->rst->mm = prefetch_entry(CR_FD_MM, PB_MM, item->pid.virt);
+	}
+
+	return NULL;
+}
+
+static int prefetch_task_images(void)
+{
+	pthread_t threads[PREFETCH_MAX_JOBS];
+	struct prefetch_job j = { };
+	struct pstree_item *item;
+	int i, nr = 0, nr_threads;
+
+	for_each_pstree_item(item)
+		nr++;
+
+	j.items = xmalloc(nr * sizeof(*j.items));
+	if (!j.items)
+		return -1;
+
+	for_each_pstree_item(item)
+		if (item->state != TASK_HELPER)
+			j.items[j.nr++] = item;
+
+	atomic_set(&j.next, 0);
+
+	nr_threads = min((int)sysconf(_SC_NPROCESSORS_ONLN), j.nr);
+	nr_threads = min(nr_threads, PREFETCH_MAX_JOBS) - 1;
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, prefetch_worker, &j)) {
+			nr_threads = i;
+			break;
+		}
+	}
+
+	prefetch_worker(&j);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	pr_info("Prefetched images of %d tasks in %d threads\n", j.nr, nr_threads + 1);
+	xfree(j.items);
+	return 0;
+}
+
 static int crtools_prepare_shared(void)
 {
 	if (prepare_shared_fdinfo())
@@ -104,6 +212,9 @@ static int crtools_prepare_shared(void)
 	if (collect_inet_sockets())
 		return -1;
 
+	if (prepare_tcp_helpers())
+		return -1;
+
 	if (tty_prep_fds())
 		return -1;
 
@@ -331,6 +442,39 @@ static int map_private_vma(pid_t pid, struct vma_area *vma, void **tgt_addr,
 	return 0;
 }
 
+/*
+ * The premapped area is mremap()-ed into place by restorer as a
+ * whole, so pages image can only replace the entire VMA.
+ */
+static bool can_map_pages(struct page_read *pr, struct vma_area *vma,
+		unsigned long va, unsigned long nr)
+{
+	if (!opts.mmap_pages || !pr->map_pages)
+		return false;
+
+	if (!(vma->e->flags & MAP_ANONYMOUS) ||
+	    (vma->e->flags & MAP_GROWSDOWN))
+		return false;
+
+	return va == vma->e->start && nr * PAGE_SIZE == vma_entry_len(vma->e);
+}
+
+/*
+ * Pages of anonymous VMAs are left for the lazy pages daemon,
+ * that will feed them via userfaultfd. Parent's pages are spread
+ * over other images and compressed ones can't be fed page by page,
+ * so they are read right now.
+ */
+static bool can_lazy_pages(struct page_read *pr, struct vma_area *vma)
+{
+	if (!opts.lazy_pages || !pr->skip_pages || pr->pe->in_parent ||
+	    pr->pe->has_compressed_size)
+		return false;
+
+	return vma_area_is(vma, VMA_ANON_PRIVATE) &&
+		!(vma->e->flags & MAP_GROWSDOWN);
+}
+
 static int restore_priv_vma_content(pid_t pid)
 {
 	struct vma_area *vma;
@@ -341,13 +485,15 @@ static int restore_priv_vma_content(pid_t pid)
 	unsigned int nr_shared = 0;
 	unsigned int nr_droped = 0;
 	unsigned int nr_compared = 0;
+	unsigned int nr_mapped = 0;
+	unsigned int nr_lazy = 0;
 	unsigned long va;
 	struct page_read pr;
 
 	vma = list_first_entry(vmas, struct vma_area, list);
 
 	ret = open_page_read(pid, &pr,
-			opts.auto_dedup ? O_RDWR : O_RSTR, false);
+			opts.auto_dedup ? O_RDWR : O_RSTR, PR_TASK);
 	if (ret)
 		return -1;
 
@@ -355,7 +501,7 @@ static int restore_priv_vma_content(pid_t pid)
 	 * Read page contents.
 	 */
 	while (1) {
-		unsigned long off, i, nr_pages;;
+		unsigned long off, i, nr_pages, nr;
 		struct iovec iov;
 
 		ret = pr.get_pagemap(&pr, &iov);
@@ -365,7 +511,7 @@ static int restore_priv_vma_content(pid_t pid)
 		va = (unsigned long)iov.iov_base;
 		nr_pages = iov.iov_len / PAGE_SIZE;
 
-		for (i = 0; i < nr_pages; i++) {
+		for (i = 0; i < nr_pages; i += nr) {
 			unsigned char buf[PAGE_SIZE];
 			void *p;
 
@@ -396,11 +542,12 @@ static int restore_priv_vma_content(pid_t pid)
 			p = decode_pointer((off) * PAGE_SIZE +
 					vma->premmaped_addr);
 
-			set_bit(off, vma->page_bitmap);
 			if (vma->ppage_bitmap) { /* inherited vma */
+				nr = 1;
+				set_bit(off, vma->page_bitmap);
 				clear_bit(off, vma->ppage_bitmap);
 
-				ret = pr.read_page(&pr, va, buf);
+				ret = pr.read_pages(&pr, va, 1, buf);
 				if (ret < 0)
 					goto err_read;
 				va += PAGE_SIZE;
@@ -414,13 +561,41 @@ static int restore_priv_vma_content(pid_t pid)
 
 				memcpy(p, buf, PAGE_SIZE);
 			} else {
-				ret = pr.read_page(&pr, va, p);
-				if (ret < 0)
-					goto err_read;
-				va += PAGE_SIZE;
+				unsigned long j;
+
+				/*
+				 * Nothing to compare with, so read the
+				 * whole run that fits this VMA in one go.
+				 */
+				nr = min(nr_pages - i,
+					(unsigned long)(vma->e->end - va) / PAGE_SIZE);
+				for (j = 0; j < nr; j++)
+					set_bit(off + j, vma->page_bitmap);
+
+				ret = 0;
+				if (can_lazy_pages(&pr, vma)) {
+					pr.skip_pages(&pr, nr * PAGE_SIZE);
+					vma->e->status |= VMA_LAZY_PAGES;
+					nr_lazy += nr;
+					ret = 1;
+				} else if (can_map_pages(&pr, vma, va, nr)) {
+					ret = pr.map_pages(&pr, va, nr, p,
+							vma->e->prot | PROT_WRITE);
+					if (ret < 0)
+						goto err_read;
+					if (ret)
+						nr_mapped += nr;
+				}
+
+				if (!ret) {
+					ret = pr.read_pages(&pr, va, nr, p);
+					if (ret < 0)
+						goto err_read;
+				}
+				va += nr * PAGE_SIZE;
 			}
 
-			nr_restored++;
+			nr_restored += nr;
 		}
 
 		if (pr.put_pagemap)
@@ -464,6 +639,8 @@ err_read:
 	cnt_add(CNT_PAGES_RESTORED, nr_restored);
 
 	pr_info("nr_restored_pages: %d\n", nr_restored);
+	pr_info("nr_mapped_pages:   %d\n", nr_mapped);
+	pr_info("nr_lazy_pages:     %d\n", nr_lazy);
 	pr_info("nr_shared_pages:   %d\n", nr_shared);
 	pr_info("nr_droped_pages:   %d\n", nr_droped);
 
@@ -765,6 +942,8 @@ err:
 
 static int restore_one_alive_task(int pid, CoreEntry *core)
 {
+	unsigned long long ts;
+
 	pr_info("Restoring resources\n");
 
 	rst_mem_switch_to_private();
@@ -772,8 +951,10 @@ static int restore_one_alive_task(int pid, CoreEntry *core)
 	if (pstree_wait_helpers())
 		return -1;
 
+	ts = trace_start();
 	if (prepare_fds(current))
 		return -1;
+	trace_stop(PHASE_FILES_RESTORE, pid, ts);
 
 	if (prepare_file_locks(pid))
 		return -1;
@@ -986,17 +1167,22 @@ static inline int fork_with_pid(struct pstree_item *item)
 	int ret = -1, fd;
 	struct cr_clone_arg ca;
 	pid_t pid = item->pid.virt;
+	unsigned long long ts;
 
 	if (item->state != TASK_HELPER) {
-		fd = open_image(CR_FD_CORE, O_RSTR, pid);
-		if (fd < 0)
-			return -1;
+		ca.core = item->rst->core;
+		item->rst->core = NULL;
+		if (!ca.core) {
+			fd = open_image(CR_FD_CORE, O_RSTR, pid);
+			if (fd < 0)
+				return -1;
 
-		ret = pb_read_one(fd, &ca.core, PB_CORE);
-		close(fd);
+			ret = pb_read_one(fd, &ca.core, PB_CORE);
+			close(fd);
 
-		if (ret < 0)
-			return -1;
+			if (ret < 0)
+				return -1;
+		}
 
 		if (check_core(ca.core, item))
 			return -1;
@@ -1029,6 +1215,19 @@ static inline int fork_with_pid(struct pstree_item *item)
 
 	pr_info("Forking task with %d pid (flags 0x%lx)\n", pid, ca.clone_flags);
 
+	if (ca.clone_flags & CLONE_NEWNET)
+		/*
+		 * When restoring a net namespace we need to communicate
+		 * with the original (i.e. -- init) one. Thus, prepare for
+		 * that before we leave the existing namespaces.
+		 */
+		if (netns_pre_create())
+			goto err;
+
+	/*
+	 * The ns_last_pid lock serializes forks of all tasks, so
+	 * nothing but the write and clone is done under it.
+	 */
 	if (!(ca.clone_flags & CLONE_NEWPID)) {
 		char buf[32];
 
@@ -1052,15 +1251,7 @@ static inline int fork_with_pid(struct pstree_item *item)
 		BUG_ON(pid != INIT_PID);
 	}
 
-	if (ca.clone_flags & CLONE_NEWNET)
-		/*
-		 * When restoring a net namespace we need to communicate
-		 * with the original (i.e. -- init) one. Thus, prepare for
-		 * that before we leave the existing namespaces.
-		 */
-		if (netns_pre_create())
-			goto err_unlock;
-
+	ts = trace_start();
 	ret = clone(restore_task_with_children, ca.stack_ptr,
 			ca.clone_flags | SIGCHLD, &ca);
 
@@ -1068,22 +1259,7 @@ static inline int fork_with_pid(struct pstree_item *item)
 		pr_perror("Can't fork for %d", pid);
 		goto err_unlock;
 	}
-
-
-	if (item == root_item)
-		item->pid.real = ret;
-
-	if (opts.pidfile && root_item == item) {
-		int pid;
-
-		pid = ret;
-
-		ret = write_pidfile(pid);
-		if (ret < 0) {
-			pr_perror("Can't write pidfile");
-			kill(pid, SIGKILL);
-		}
-	}
+	trace_stop(PHASE_FORK, pid, ts);
 
 err_unlock:
 	if (ca.fd >= 0) {
@@ -1092,6 +1268,22 @@ err_unlock:
 
 		close(ca.fd);
 	}
+
+	if (ret > 0 && item == root_item) {
+		item->pid.real = ret;
+
+		if (opts.pidfile) {
+			int pid;
+
+			pid = ret;
+
+			ret = write_pidfile(pid);
+			if (ret < 0) {
+				pr_perror("Can't write pidfile");
+				kill(pid, SIGKILL);
+			}
+		}
+	}
 err:
 	if (ca.core)
 		core_entry__free_unpacked(ca.core, NULL);
@@ -1108,6 +1300,12 @@ static void sigchld_handler(int signal, siginfo_t *siginfo, void *data)
 	exit = (siginfo->si_code == CLD_EXITED);
 	status = siginfo->si_status;
 
+	if (!current && rst_tcp_helpers_failed()) {
+		pr_err("TCP helper died\n");
+		futex_abort_and_wake(&task_entries->nr_in_progress);
+		return;
+	}
+
 	/* skip scripts */
 	if (!current && root_item->pid.real != pid) {
 		pid = waitpid(root_item->pid.real, &status, WNOHANG);
@@ -1353,6 +1551,7 @@ static int create_children_and_session(void)
 static int restore_task_with_children(void *_arg)
 {
 	struct cr_clone_arg *ca = _arg;
+	unsigned long long ts;
 	pid_t pid;
 	int ret;
 
@@ -1421,8 +1620,10 @@ static int restore_task_with_children(void *_arg)
 			goto err_fini_mnt;
 	}
 
+	ts = trace_start();
 	if (prepare_mappings(pid))
 		goto err_fini_mnt;
+	trace_stop(PHASE_MEM_RESTORE, pid, ts);
 
 	if (!(ca->clone_flags & CLONE_FILES)) {
 		ret = close_old_fds(current);
@@ -1691,10 +1892,18 @@ static int restore_root_task(struct pstree_item *init)
 
 	timing_stop(TIME_FORK);
 
+	ret = rst_tcp_helpers_start();
+	if (ret < 0)
+		goto out_kill;
+
 	ret = restore_switch_stage(CR_STATE_RESTORE);
 	if (ret < 0)
 		goto out_kill;
 
+	ret = rst_tcp_helpers_stop(false);
+	if (ret < 0)
+		goto out_kill;
+
 	ret = restore_switch_stage(CR_STATE_RESTORE_SIGCHLD);
 	if (ret < 0)
 		goto out_kill;
@@ -1765,6 +1974,7 @@ out_kill:
 	}
 
 out:
+	rst_tcp_helpers_stop(true);
 	__restore_switch_stage(CR_STATE_FAIL);
 	pr_err("Restoring FAILED.\n");
 	return 1;
@@ -1818,18 +2028,25 @@ int cr_restore_tasks(void)
 	if (prepare_pstree() < 0)
 		goto err;
 
+	if (prefetch_task_images() < 0)
+		goto err;
+
 	if (crtools_prepare_shared() < 0)
 		goto err;
 
 	if (criu_signals_setup() < 0)
 		goto err;
 
+	if (opts.lazy_pages && lazy_pages_connect())
+		goto err;
+
 	if (restore_root_task(root_item) < 0)
 		goto err;
 
 	ret = prepare_cgroup_properties();
 
 err:
+	close_service_fd(LAZY_PAGES_SK_OFF);
 	fini_cgroup();
 	cr_plugin_fini();
 	return ret;
@@ -2485,6 +2702,7 @@ void __gcov_flush(void) {}
 
 static int sigreturn_restore(pid_t pid, CoreEntry *core)
 {
+	unsigned long long ts = trace_start();
 	void *mem = MAP_FAILED;
 	void *restore_thread_exec_start;
 	void *restore_task_exec_start;
@@ -2816,6 +3034,13 @@ static int sigreturn_restore(pid_t pid, CoreEntry *core)
 		goto err;
 	}
 
+	task_args->uffd = -1;
+	if (opts.lazy_pages) {
+		if (lazy_pages_setup_uffd(pid, vmas, &task_args->uffd))
+			goto err;
+		close_service_fd(LAZY_PAGES_SK_OFF);
+	}
+
 	/*
 	 * Now prepare run-time data for threads restore.
 	 */
@@ -2853,6 +3078,8 @@ static int sigreturn_restore(pid_t pid, CoreEntry *core)
 	 * and restoring core is extremely destructive.
 	 */
 
+	trace_stop(PHASE_RESTORER_JUMP, pid, ts);
+	log_flush();
 	JUMP_TO_RESTORER_BLOB(new_sp, restore_task_exec_start, task_args);
 
 err:
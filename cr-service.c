@@ -12,6 +12,8 @@
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include "crtools.h"
 #include "cr_options.h"
@@ -25,6 +27,9 @@
 #include "net.h"
 #include "mount.h"
 #include "cgroup.h"
+#include "stats.h"
+
+#include "protobuf/stats.pb-c.h"
 
 unsigned int service_sk_ino = -1;
 
@@ -102,12 +107,14 @@ int send_criu_dump_resp(int socket_fd, bool success, bool restored)
 	return send_criu_msg(socket_fd, &msg);
 }
 
-static int send_criu_pre_dump_resp(int socket_fd, bool success)
+static int send_criu_pre_dump_resp(int socket_fd, bool success,
+		CriuPredumpStats *stats)
 {
 	CriuResp msg = CRIU_RESP__INIT;
 
 	msg.type = CRIU_REQ_TYPE__PRE_DUMP;
 	msg.success = success;
+	msg.predump = stats;
 
 	return send_criu_msg(socket_fd, &msg);
 }
@@ -407,11 +414,53 @@ static int check(int sk)
 	return send_criu_msg(sk, &resp);
 }
 
-static int pre_dump_using_req(int sk, CriuOpts *req)
+/*
+ * The dirty rate is estimated from pages written by the iteration
+ * and time passed since the previous one started (i.e. since pages
+ * were last collected), so it's only known from the 2nd iteration.
+ */
+static void fill_predump_stats(CriuPredumpStats *ps, DumpStatsEntry *ds,
+		struct timeval *prev, struct timeval *now)
+{
+	ps->pages_scanned = ds->pages_scanned;
+	ps->pages_skipped_parent = ds->pages_skipped_parent;
+	ps->pages_written = ds->pages_written;
+	ps->frozen_time = ds->frozen_time;
+	ps->memdump_time = ds->memdump_time;
+	ps->memwrite_time = ds->memwrite_time;
+
+	if (prev->tv_sec || prev->tv_usec) {
+		u64 usec;
+
+		usec = (now->tv_sec - prev->tv_sec) * USEC_PER_SEC +
+			now->tv_usec - prev->tv_usec;
+		if (usec) {
+			ps->has_dirty_rate = true;
+			ps->dirty_rate = ds->pages_written * USEC_PER_SEC / usec;
+		}
+	}
+}
+
+static int pre_dump_using_req(int sk, CriuOpts *req, struct timeval *prev)
 {
+	CriuPredumpStats ps = CRIU_PREDUMP_STATS__INIT;
+	DumpStatsEntry *ds;
+	struct timeval now;
 	int pid, status;
 	bool success = false;
 
+	/* The child fills in stats of the iteration */
+	ds = mmap(NULL, sizeof(*ds), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ds == MAP_FAILED) {
+		pr_perror("Can't map pre-dump stats");
+		ds = NULL;
+		goto out;
+	}
+
+	dump_stats_entry__init(ds);
+	gettimeofday(&now, NULL);
+
 	pid = fork();
 	if (pid < 0) {
 		pr_perror("Can't fork");
@@ -427,6 +476,7 @@ static int pre_dump_using_req(int sk, CriuOpts *req)
 		if (cr_pre_dump_tasks(req->pid))
 			goto cout;
 
+		get_dump_stats(ds);
 		ret = 0;
 cout:
 		exit(ret);
@@ -438,22 +488,28 @@ cout:
 	if (WEXITSTATUS(status) != 0)
 		goto out;
 
+	fill_predump_stats(&ps, ds, prev, &now);
+	*prev = now;
 	success = true;
 out:
-	if (send_criu_pre_dump_resp(sk, success) == -1) {
+	if (send_criu_pre_dump_resp(sk, success, success ? &ps : NULL) == -1) {
 		pr_perror("Can't send pre-dump resp");
 		success = false;
 	}
 
+	if (ds)
+		munmap(ds, sizeof(*ds));
+
 	return success ? 0 : -1;
 }
 
 static int pre_dump_loop(int sk, CriuReq *msg)
 {
+	struct timeval prev = { };
 	int ret;
 
 	do {
-		ret = pre_dump_using_req(sk, msg->opts);
+		ret = pre_dump_using_req(sk, msg->opts, &prev);
 		if (ret < 0)
 			return ret;
 
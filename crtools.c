@@ -36,6 +36,8 @@
 #include "plugin.h"
 #include "mount.h"
 #include "cgroup.h"
+#include "lazy-pages.h"
+#include "page-compress.h"
 
 struct cr_options opts;
 
@@ -172,6 +174,16 @@ int main(int argc, char *argv[])
 		{ "exec-cmd", no_argument, 0, 1059},
 		{ "manage-cgroups", no_argument, 0, 1060},
 		{ "cgroup-root", required_argument, 0, 1061},
+		{ "dump-jobs", required_argument, 0, 1062},
+		{ "mmap-pages", no_argument, 0, 1063},
+		{ "lazy-pages", no_argument, 0, 1064},
+		{ "page-store", no_argument, 0, 1065},
+		{ "compress", no_argument, 0, 1066},
+		{ "compress-jobs", required_argument, 0, 1067},
+		{ "pipe-mem-limit", required_argument, 0, 1068},
+		{ "trace-file", required_argument, 0, 1069},
+		{ "freeze-cgroup", required_argument, 0, 1070},
+		{ "tcp-jobs", required_argument, 0, 1071},
 		{ },
 	};
 
@@ -379,6 +391,46 @@ int main(int argc, char *argv[])
 					return -1;
 			}
 			break;
+		case 1062:
+			opts.dump_jobs = atoi(optarg);
+			if (opts.dump_jobs <= 0)
+				goto bad_arg;
+			break;
+		case 1063:
+			opts.mmap_pages = true;
+			break;
+		case 1064:
+			opts.lazy_pages = true;
+			break;
+		case 1065:
+			opts.page_store = true;
+			break;
+		case 1066:
+			opts.compress = true;
+			break;
+		case 1067:
+			opts.compress_jobs = atoi(optarg);
+			if (opts.compress_jobs <= 0 ||
+			    opts.compress_jobs > PAGE_COMPRESS_MAX_JOBS)
+				goto bad_arg;
+			opts.compress = true;
+			break;
+		case 1068:
+			if (atoi(optarg) <= 0)
+				goto bad_arg;
+			opts.pipe_mem_limit = atoi(optarg);
+			break;
+		case 1069:
+			opts.trace_file = optarg;
+			break;
+		case 1070:
+			opts.freeze_cgroup = optarg;
+			break;
+		case 1071:
+			opts.tcp_jobs = atoi(optarg);
+			if (opts.tcp_jobs <= 0)
+				goto bad_arg;
+			break;
 		case 'M':
 			{
 				char *aux;
@@ -454,6 +506,9 @@ int main(int argc, char *argv[])
 	if (opts.img_parent)
 		pr_info("Will do snapshot from %s\n", opts.img_parent);
 
+	if (opts.compress && page_compress_init())
+		return 1;
+
 	if (!strcmp(argv[optind], "dump")) {
 		if (!tree_id)
 			goto opt_pid_missing;
@@ -505,6 +560,9 @@ int main(int argc, char *argv[])
 	if (!strcmp(argv[optind], "dedup"))
 		return cr_dedup() != 0;
 
+	if (!strcmp(argv[optind], "lazy-pages"))
+		return cr_lazy_pages(opts.restore_detach) < 0;
+
 	pr_msg("Error: unknown command: %s\n", argv[optind]);
 usage:
 	pr_msg("\n"
@@ -517,6 +575,7 @@ usage:
 "  criu page-server\n"
 "  criu service [<options>]\n"
 "  criu dedup\n"
+"  criu lazy-pages [<options>]\n"
 "\n"
 "Commands:\n"
 "  dump           checkpoint a process/tree identified by pid\n"
@@ -528,6 +587,7 @@ usage:
 "  page-server    launch page server\n"
 "  service        launch service\n"
 "  dedup          remove duplicates in memory dump\n"
+"  lazy-pages     launch daemon feeding memory to tasks restored with --lazy-pages\n"
 	);
 
 	if (usage_error) {
@@ -555,6 +615,8 @@ usage:
 "* Special resources support:\n"
 "  -x|--" USK_EXT_PARAM "      allow external unix connections\n"
 "     --" SK_EST_PARAM "  checkpoint/restore established TCP connections\n"
+"     --tcp-jobs NUM     restore established TCP connections in NUM helpers\n"
+"                        (only when restoring into a new pid namespace)\n"
 "  -r|--root PATH        change the root filesystem (when run in mount namespace)\n"
 "  --evasive-devices     use any path to a device file if the original one\n"
 "                        is inaccessible\n"
@@ -572,10 +634,14 @@ usage:
 "                        change the root cgroup the controller will be\n"
 "                        installed into. No controller means that root is the\n"
 "                        default for all controllers not specified.\n"
+"  --freeze-cgroup PATH  freeze the tree with the freezer cgroup at PATH\n"
+"                        before seizing it, all the tree should be in it\n"
 "\n"
 "* Logging:\n"
 "  -o|--log-file FILE    log file name\n"
 "     --log-pid          enable per-process logging to separate FILE.pid files\n"
+"     --trace-file FILE  write spans of dump/restore phases to FILE in Chrome\n"
+"                        trace format (they are in stats image anyway)\n"
 "  -v[NUM]               set logging level (higher level means more output):\n"
 "                          -v1|-v    - only errors and messages\n"
 "                          -v2|-vv   - also warnings (default level)\n"
@@ -590,9 +656,20 @@ usage:
 "                        pages images of previous dump\n"
 "                        when used on restore, as soon as page is restored, it\n"
 "                        will be punched from the image.\n"
+"  --dump-jobs NUM       write pages of up to NUM tasks into images in parallel\n"
+"  --mmap-pages          on restore map fully dumped anonymous mappings right\n"
+"                        from pages images instead of reading them\n"
+"  --lazy-pages          on restore let tasks run before their anonymous memory\n"
+"                        is filled, the lazy-pages daemon will feed it\n"
+"  --page-store          keep pages once per content in shared pages-store image,\n"
+"                        with dedup command move existing images into it\n"
+"  --compress            compress pages with lz4 on dump\n"
+"  --compress-jobs NUM   compress pages in NUM threads (implies --compress)\n"
+"  --pipe-mem-limit MB   pin at most MB of memory in pipes, pages of tasks\n"
+"                        over the limit are written out in chunks at once\n"
 "\n"
 "Page/Service server options:\n"
-"  --address ADDR        address of server or service\n"
+"  --address ADDR        address of server or service (or lazy pages socket)\n"
 "  --port PORT           port of page server\n"
 "  -d|--daemon           run in the background after creating socket\n"
 "\n"
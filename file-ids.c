@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -27,14 +28,13 @@ void fd_id_show_tree(void)
 	kid_show_tree(&fd_tree);
 }
 
-#define FDID_BITS	5
-#define FDID_SIZE	(1 << FDID_BITS)
-#define FDID_MASK	(FDID_SIZE - 1)
-
-static inline int fdid_hashfn(unsigned int s_dev, unsigned long i_ino)
-{
-	return (s_dev + i_ino) & FDID_MASK;
-}
+/*
+ * The cache starts with 1 << FDID_MIN_BITS chains and doubles them
+ * once they get 2 entries long on average, so lookups stay cheap
+ * for tasks with hundreds of thousands of files.
+ */
+#define FDID_MIN_BITS	5
+#define FDID_MAX_BITS	20
 
 struct fd_id {
 	int mnt_id;
@@ -44,13 +44,51 @@ struct fd_id {
 	struct fd_id *n;
 };
 
-static struct fd_id *fd_id_cache[FDID_SIZE];
+static struct fd_id **fd_id_cache;
+static unsigned int fd_id_bits, fd_id_nr;
+
+static inline unsigned int fdid_hashfn(unsigned int s_dev, unsigned long i_ino,
+		unsigned int bits)
+{
+	return ((s_dev + i_ino) * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+static int fd_id_cache_grow(void)
+{
+	unsigned int bits = fd_id_bits ? fd_id_bits + 1 : FDID_MIN_BITS, i;
+	struct fd_id **cache, *fi, *n;
+
+	cache = xzalloc(sizeof(*cache) << bits);
+	if (!cache)
+		return -1;
+
+	for (i = 0; fd_id_bits && i < (1U << fd_id_bits); i++) {
+		for (fi = fd_id_cache[i]; fi; fi = n) {
+			unsigned int hv = fdid_hashfn(fi->dev, fi->ino, bits);
+
+			n = fi->n;
+			fi->n = cache[hv];
+			cache[hv] = fi;
+		}
+	}
+
+	xfree(fd_id_cache);
+	fd_id_cache = cache;
+	fd_id_bits = bits;
+	return 0;
+}
 
 static void fd_id_cache_one(u32 id, struct fd_parms *p)
 {
 	struct fd_id *fi;
 	unsigned hv;
 
+	if (!fd_id_bits || (fd_id_nr >> fd_id_bits >= 2 &&
+				fd_id_bits < FDID_MAX_BITS))
+		/* Cache is just a hint, keep on with what we have */
+		if (fd_id_cache_grow() && !fd_id_bits)
+			return;
+
 	fi = xmalloc(sizeof(*fi));
 	if (fi) {
 		fi->dev = p->stat.st_dev;
@@ -58,9 +96,10 @@ static void fd_id_cache_one(u32 id, struct fd_parms *p)
 		fi->mnt_id = p->mnt_id;
 		fi->id = id;
 
-		hv = fdid_hashfn(p->stat.st_dev, p->stat.st_ino);
+		hv = fdid_hashfn(p->stat.st_dev, p->stat.st_ino, fd_id_bits);
 		fi->n = fd_id_cache[hv];
 		fd_id_cache[hv] = fi;
+		fd_id_nr++;
 	}
 }
 
@@ -69,7 +108,10 @@ static struct fd_id *fd_id_cache_lookup(struct fd_parms *p)
 	struct stat *st = &p->stat;
 	struct fd_id *fi;
 
-	for (fi = fd_id_cache[fdid_hashfn(st->st_dev, st->st_ino)];
+	if (!fd_id_bits)
+		return NULL;
+
+	for (fi = fd_id_cache[fdid_hashfn(st->st_dev, st->st_ino, fd_id_bits)];
 			fi; fi = fi->n)
 		if (fi->dev == st->st_dev &&
 		    fi->ino == st->st_ino &&
@@ -97,6 +139,32 @@ int fd_id_generate_special(struct fd_parms *p, u32 *id)
 	return 1;
 }
 
+/*
+ * The gen_id thing is used to optimize the comparison of shared files.
+ * If two files have different gen_ids, then they are different for sure.
+ * If it matches, we don't know it and have to call sys_kcmp().
+ *
+ * Thus gen_id mixes everything, that is the same for fds sharing one
+ * struct file, i.e. all but the per-fd O_CLOEXEC, so that kcmp is only
+ * called for files, that look the same, rather than on every hash
+ * collision of unrelated ones.
+ *
+ * The kcmp-ids.c engine does this trick, see comments in it for more info.
+ */
+
+static u64 make_gen_id(const struct fd_parms *p)
+{
+	u64 h = 0xcbf29ce484222325ULL;
+
+	h = (h ^ p->stat.st_dev) * 0x100000001b3ULL;
+	h = (h ^ p->stat.st_ino) * 0x100000001b3ULL;
+	h = (h ^ p->pos) * 0x100000001b3ULL;
+	h = (h ^ (p->flags & ~O_CLOEXEC)) * 0x100000001b3ULL;
+	h = (h ^ (u32)p->mnt_id) * 0x100000001b3ULL;
+
+	return h;
+}
+
 int fd_id_generate(pid_t pid, FdinfoEntry *fe, struct fd_parms *p)
 {
 	u32 id;
@@ -104,7 +172,7 @@ int fd_id_generate(pid_t pid, FdinfoEntry *fe, struct fd_parms *p)
 	int new_id = 0;
 
 	e.pid = pid;
-	e.genid = fe->id;
+	e.genid = make_gen_id(p);
 	e.idx = fe->fd;
 
 	id = kid_generate_gen(&fd_tree, &e, &new_id);
@@ -11,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/poll.h>
 #include <stdlib.h>
 
 #include "files.h"
@@ -100,16 +101,17 @@ static inline struct file_desc *find_file_desc(FdinfoEntry *fe)
  * 1. Prepare step.
  *    Select which task will create the file (open() one, or
  *    call any other syscall for than (socket, pipe, etc.). All
- *    the others, that share one, create unix sockets under the
- *    respective file descriptor (transport socket).
+ *    the others, that share one, reserve the respective file
+ *    descriptor with a dup of their transport socket.
  * 2. Open step.
  *    The one who creates the file (the 'master') creates one,
- *    then creates one more unix socket (transport) and sends the
- *    created file over this socket to the other recepients.
+ *    and queues the created file for the other recepients. At
+ *    the end of the step queued files are sent to each task in
+ *    as few messages as possible.
  * 3. Receive step.
  *    Those, who wait for the file to appear, receive one via
- *    the transport socket, then close the socket and dup() the
- *    received file descriptor into its place.
+ *    the transport socket and dup() the received file descriptor
+ *    into its place.
  *
  * There's the 4th step in the states[] array -- the post_open
  * one. This one is not about file-sharing resolving, but about
@@ -148,19 +150,6 @@ void show_saved_files(void)
 		}
 }
 
-/*
- * The gen_id thing is used to optimize the comparison of shared files.
- * If two files have different gen_ids, then they are different for sure.
- * If it matches, we don't know it and have to call sys_kcmp().
- *
- * The kcmp-ids.c engine does this trick, see comments in it for more info.
- */
-
-static u32 make_gen_id(const struct fd_parms *p)
-{
-	return ((u32)p->stat.st_dev) ^ ((u32)p->stat.st_ino) ^ ((u32)p->pos);
-}
-
 int do_dump_gen_file(struct fd_parms *p, int lfd,
 		const struct fdtype_ops *ops, const int fdinfo)
 {
@@ -168,7 +157,6 @@ int do_dump_gen_file(struct fd_parms *p, int lfd,
 	int ret = -1;
 
 	e.type	= ops->type;
-	e.id	= make_gen_id(p);
 	e.fd	= p->fd;
 	e.flags = p->fd_flags;
 
@@ -530,6 +518,7 @@ static int collect_fd(int pid, FdinfoEntry *e, struct rst_info *rst_info)
 		return -1;
 
 	futex_init(&new_le->real_pid);
+	new_le->received = false;
 	new_le->pid = pid;
 	new_le->fe = e;
 
@@ -679,15 +668,216 @@ static struct fd_open_state states[] = {
 #define want_recv_stage()	do { states[2].required = true; } while (0)
 #define want_post_open_stage()	do { states[3].required = true; } while (0)
 
-static void transport_name_gen(struct sockaddr_un *addr, int *len,
-		int pid, int fd)
+/*
+ * Each task has one transport socket bound to crtools-fd-<pid> and
+ * kept in TRANSPORT_FD_OFF service fd. A message on it carries a
+ * bunch of files together with the fdinfo_list_entry-s (those are
+ * in shared memory) they are sent for, so messages may come in any
+ * order and are handled by whichever of the calls below gets them.
+ */
+#define TRANSPORT_POLL_MS	10
+
+struct queued_fd {
+	pid_t			real_pid;
+	int			fd;
+	struct fdinfo_list_entry *fle;
+};
+
+static struct queued_fd *queued_fds;
+static int nr_queued_fds;
+
+static void transport_name_gen(struct sockaddr_un *addr, int *len, int pid)
 {
 	addr->sun_family = AF_UNIX;
-	snprintf(addr->sun_path, UNIX_PATH_MAX, "x/crtools-fd-%d-%d", pid, fd);
+	snprintf(addr->sun_path, UNIX_PATH_MAX, "x/crtools-fd-%d", pid);
 	*len = SUN_LEN(addr);
 	*addr->sun_path = '\0';
 }
 
+static int get_transport_sock(void)
+{
+	struct sockaddr_un saddr;
+	int sock, sfd, sun_len;
+
+	sfd = get_service_fd(TRANSPORT_FD_OFF);
+	if (sfd >= 0)
+		return sfd;
+
+	transport_name_gen(&saddr, &sun_len, getpid());
+
+	pr_info("\t\tCreate transport socket %s\n", saddr.sun_path + 1);
+
+	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		pr_perror("Can't create socket");
+		return -1;
+	}
+
+	if (bind(sock, &saddr, sun_len) < 0) {
+		pr_perror("Can't bind unix socket %s", saddr.sun_path + 1);
+		close(sock);
+		return -1;
+	}
+
+	sfd = install_service_fd(TRANSPORT_FD_OFF, sock);
+	close(sock);
+	return sfd;
+}
+
+static int transport_install(struct fdinfo_list_entry *fle, int fd)
+{
+	pr_info("\t\tReceived fd for %d\n", fle->fe->fd);
+
+	if (reopen_fd_as_nocheck(fle->fe->fd, fd) < 0)
+		return -1;
+
+	if (fcntl(fle->fe->fd, F_SETFD, fle->fe->flags) == -1) {
+		pr_perror("Unable to set file descriptor flags");
+		return -1;
+	}
+
+	fle->received = true;
+	return 0;
+}
+
+/*
+ * Receive one message and put all the files from it in place. Unless
+ * @block is set, it waits for a message for TRANSPORT_POLL_MS only.
+ */
+static int transport_recv(int sock, bool block)
+{
+	struct fdinfo_list_entry *fles[CR_SCM_MAX_FD];
+	union {
+		char			buf[CMSG_SPACE(sizeof(int) * CR_SCM_MAX_FD)];
+		struct cmsghdr		align;
+	} cbuf;
+	struct pollfd pfd = { .fd = sock, .events = POLLIN, };
+	struct iovec iov = { .iov_base = fles, .iov_len = sizeof(fles), };
+	struct msghdr hdr = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= &cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[CR_SCM_MAX_FD];
+	int i, nr, ret;
+
+	ret = poll(&pfd, 1, block ? -1 : TRANSPORT_POLL_MS);
+	if (ret <= 0) {
+		if (ret < 0 && errno != EINTR) {
+			pr_perror("Can't poll transport socket");
+			return -1;
+		}
+		return 0;
+	}
+
+	ret = recvmsg(sock, &hdr, MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		pr_perror("Can't receive fds");
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    (hdr.msg_flags & (MSG_CTRUNC | MSG_TRUNC))) {
+		pr_err("Bad message on transport socket\n");
+		return -1;
+	}
+
+	nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (nr * sizeof(fles[0]) != ret) {
+		pr_err("Got %d fds for %d entries\n", nr, ret / (int)sizeof(fles[0]));
+		return -1;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), nr * sizeof(int));
+	for (i = 0; i < nr; i++)
+		if (transport_install(fles[i], fds[i]))
+			return -1;
+
+	return 0;
+}
+
+static int transport_sendmsg(int sock, pid_t real_pid,
+		struct fdinfo_list_entry **fles, int *fds, int nr, int flags)
+{
+	union {
+		char			buf[CMSG_SPACE(sizeof(int) * CR_SCM_MAX_FD)];
+		struct cmsghdr		align;
+	} cbuf;
+	struct sockaddr_un saddr;
+	struct iovec iov = { .iov_base = fles, .iov_len = nr * sizeof(*fles), };
+	struct msghdr hdr = {
+		.msg_name	= &saddr,
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= &cbuf,
+		.msg_controllen	= CMSG_LEN(sizeof(int) * nr),
+	};
+	struct cmsghdr *cmsg;
+	int len;
+
+	BUG_ON(nr > CR_SCM_MAX_FD);
+
+	transport_name_gen(&saddr, &len, real_pid);
+	hdr.msg_namelen = len;
+
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_len = hdr.msg_controllen;
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr);
+
+	pr_info("\t\tSend %d fds to %s\n", nr, saddr.sun_path + 1);
+
+	return sendmsg(sock, &hdr, flags);
+}
+
+static int transport_send(pid_t real_pid, struct fdinfo_list_entry **fles,
+		int *fds, int nr)
+{
+	int sock;
+
+	sock = get_transport_sock();
+	if (sock < 0)
+		return -1;
+
+	while (transport_sendmsg(sock, real_pid, fles, fds, nr, MSG_DONTWAIT) < 0) {
+		if (errno != EAGAIN) {
+			pr_perror("Can't send fds to %d", real_pid);
+			return -1;
+		}
+
+		/*
+		 * The peer's queue is full. It may be sending files
+		 * to us in turn, so keep ours drained meanwhile.
+		 */
+		if (transport_recv(sock, false))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * For those who send files, but don't get any, e.g. the tcp helpers.
+ * The @sock is any unbound datagram socket in the tasks' netns, and
+ * sending blocks till the peer takes the files.
+ */
+int send_fds_to_peer(int sock, pid_t real_pid,
+		struct fdinfo_list_entry **fles, int *fds, int nr)
+{
+	if (transport_sendmsg(sock, real_pid, fles, fds, nr, 0) < 0) {
+		pr_perror("Can't send fds to %d", real_pid);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int should_open_transport(FdinfoEntry *fe, struct file_desc *fd)
 {
 	if (fd->ops->want_transport)
@@ -699,9 +889,7 @@ static int should_open_transport(FdinfoEntry *fe, struct file_desc *fd)
 static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 {
 	struct fdinfo_list_entry *flem;
-	struct sockaddr_un saddr;
-	int sock;
-	int ret, sun_len;
+	int sock, tmp;
 
 	flem = file_master(fle->desc);
 
@@ -720,26 +908,22 @@ static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 		 */
 	}
 
-	transport_name_gen(&saddr, &sun_len, getpid(), fle->fe->fd);
-
-	pr_info("\t\tCreate transport fd %s\n", saddr.sun_path + 1);
-
-
-	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		pr_perror("Can't create socket");
+	sock = get_transport_sock();
+	if (sock < 0)
 		return -1;
-	}
-	ret = bind(sock, &saddr, sun_len);
-	if (ret < 0) {
-		pr_perror("Can't bind unix socket %s", saddr.sun_path + 1);
+
+	/* Keep the descriptor busy till the file arrives */
+	tmp = dup(sock);
+	if (tmp < 0) {
+		pr_perror("Can't dup transport socket");
 		return -1;
 	}
 
-	ret = reopen_fd_as(fle->fe->fd, sock);
-	if (ret < 0)
+	if (reopen_fd_as(fle->fe->fd, tmp) < 0)
 		return -1;
 
+	fle->received = false;
+
 	pr_info("\t\tWake up fdinfo pid=%d fd=%d\n", fle->pid, fle->fe->fd);
 	futex_set_and_wake(&fle->real_pid, getpid());
 	want_recv_stage();
@@ -747,20 +931,112 @@ static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 	return 0;
 }
 
-int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle, int sock)
+int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle)
 {
-	struct sockaddr_un saddr;
-	int len;
-
 	pr_info("\t\tWait fdinfo pid=%d fd=%d\n", fle->pid, fle->fe->fd);
 	futex_wait_while(&fle->real_pid, 0);
-	transport_name_gen(&saddr, &len,
-			futex_get(&fle->real_pid), fle->fe->fd);
-	pr_info("\t\tSend fd %d to %s\n", fd, saddr.sun_path + 1);
-	return send_fd(sock, &saddr, len, fd);
+
+	return transport_send(futex_get(&fle->real_pid), &fle, &fd, 1);
+}
+
+/*
+ * Returns the file sent for @fle, freeing its descriptor, for
+ * the masters wanting a transport to open() it into place.
+ */
+int recv_fd_from_peer(struct fdinfo_list_entry *fle)
+{
+	int sock, fd;
+
+	pr_info("\tWaiting fd for %d\n", fle->fe->fd);
+
+	sock = get_service_fd(TRANSPORT_FD_OFF);
+	BUG_ON(sock < 0);
+
+	while (!fle->received)
+		if (transport_recv(sock, true))
+			return -1;
+
+	fd = dup(fle->fe->fd);
+	if (fd < 0) {
+		pr_perror("Can't dup received fd %d", fle->fe->fd);
+		return -1;
+	}
+	close(fle->fe->fd);
+
+	return fd;
+}
+
+static int queue_fd_to_peer(int fd, struct fdinfo_list_entry *fle)
+{
+	struct queued_fd *q;
+
+	if (nr_queued_fds % 64 == 0) {
+		q = xrealloc(queued_fds, (nr_queued_fds + 64) * sizeof(*q));
+		if (!q)
+			return -1;
+		queued_fds = q;
+	}
+
+	q = &queued_fds[nr_queued_fds++];
+	q->fd = fd;
+	q->fle = fle;
+
+	return 0;
 }
 
-static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle, int *sock)
+static int cmp_queued_fd(const void *a, const void *b)
+{
+	const struct queued_fd *q1 = a, *q2 = b;
+
+	return q1->real_pid - q2->real_pid;
+}
+
+static void free_queued_fds(void)
+{
+	xfree(queued_fds);
+	queued_fds = NULL;
+	nr_queued_fds = 0;
+}
+
+/*
+ * Send the files queued by masters in the create stage, packing
+ * the ones for the same task in as few messages as possible.
+ */
+static int send_queued_fds(void)
+{
+	struct fdinfo_list_entry *fles[CR_SCM_MAX_FD];
+	int fds[CR_SCM_MAX_FD];
+	int i, nr = 0, ret = 0;
+
+	for (i = 0; i < nr_queued_fds; i++) {
+		struct fdinfo_list_entry *fle = queued_fds[i].fle;
+
+		pr_info("\t\tWait fdinfo pid=%d fd=%d\n", fle->pid, fle->fe->fd);
+		futex_wait_while(&fle->real_pid, 0);
+		queued_fds[i].real_pid = futex_get(&fle->real_pid);
+	}
+
+	qsort(queued_fds, nr_queued_fds, sizeof(*queued_fds), cmp_queued_fd);
+
+	for (i = 0; i < nr_queued_fds; i++) {
+		fles[nr] = queued_fds[i].fle;
+		fds[nr] = queued_fds[i].fd;
+		nr++;
+
+		if (nr == CR_SCM_MAX_FD || i + 1 == nr_queued_fds ||
+		    queued_fds[i + 1].real_pid != queued_fds[i].real_pid) {
+			ret = transport_send(queued_fds[i].real_pid, fles, fds, nr);
+			if (ret)
+				break;
+			nr = 0;
+		}
+	}
+
+	free_queued_fds();
+	return ret;
+}
+
+static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle)
 {
 	int dfd = fle->fe->fd;
 
@@ -768,9 +1044,6 @@ static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle, int *sock)
 		return 0;
 
 	pr_info("\t\t\tGoing to dup %d into %d\n", fd, dfd);
-	if (move_img_fd(sock, dfd))
-		return -1;
-
 	if (dup2(fd, dfd) != dfd) {
 		pr_perror("Can't dup local fd %d -> %d", fd, dfd);
 		return -1;
@@ -803,22 +1076,16 @@ static int post_open_fd(int pid, struct fdinfo_list_entry *fle)
 
 static int serve_out_fd(int pid, int fd, struct file_desc *d)
 {
-	int sock, ret;
+	int ret;
 	struct fdinfo_list_entry *fle;
 
-	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		pr_perror("Can't create socket");
-		return -1;
-	}
-
 	pr_info("\t\tCreate fd for %d\n", fd);
 
 	list_for_each_entry(fle, &d->fd_info_head, desc_list) {
 		if (pid == fle->pid)
-			ret = send_fd_to_self(fd, fle, &sock);
+			ret = send_fd_to_self(fd, fle);
 		else
-			ret = send_fd_to_peer(fd, fle, sock);
+			ret = queue_fd_to_peer(fd, fle);
 
 		if (ret) {
 			pr_err("Can't sent fd %d to %d\n", fd, fle->pid);
@@ -826,7 +1093,6 @@ static int serve_out_fd(int pid, int fd, struct file_desc *d)
 		}
 	}
 
-	close(sock);
 	return 0;
 }
 
@@ -858,8 +1124,8 @@ static int open_fd(int pid, struct fdinfo_list_entry *fle)
 
 static int receive_fd(int pid, struct fdinfo_list_entry *fle)
 {
-	int tmp;
 	struct fdinfo_list_entry *flem;
+	int sock;
 
 	flem = file_master(fle->desc);
 	if (flem->pid == pid)
@@ -867,20 +1133,13 @@ static int receive_fd(int pid, struct fdinfo_list_entry *fle)
 
 	pr_info("\tReceive fd for %d\n", fle->fe->fd);
 
-	tmp = recv_fd(fle->fe->fd);
-	if (tmp < 0) {
-		pr_err("Can't get fd %d\n", tmp);
-		return -1;
-	}
-	close(fle->fe->fd);
-
-	if (reopen_fd_as(fle->fe->fd, tmp) < 0)
-		return -1;
+	sock = get_service_fd(TRANSPORT_FD_OFF);
+	BUG_ON(sock < 0);
 
-	if (fcntl(fle->fe->fd, F_SETFD, fle->fe->flags) == -1) {
-		pr_perror("Unable to set file descriptor flags");
-		return -1;
-	}
+	/* It might have come already along with some other one */
+	while (!fle->received)
+		if (transport_recv(sock, true))
+			return -1;
 
 	return 0;
 }
@@ -987,11 +1246,19 @@ int prepare_fds(struct pstree_item *me)
 		ret = open_fdinfos(me->pid.virt, &me->rst->eventpoll, state);
 		if (ret)
 			break;
+
+		if (states[state].cb == open_fd) {
+			ret = send_queued_fds();
+			if (ret)
+				break;
+		}
 	}
 
 	if (me->rst->fdt)
 		futex_inc_and_wake(&me->rst->fdt->fdt_lock);
 out:
+	free_queued_fds();
+	close_service_fd(TRANSPORT_FD_OFF);
 	close_service_fd(CR_PROC_FD_OFF);
 	tty_fini_fds();
 	return ret;
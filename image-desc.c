@@ -22,6 +22,7 @@ struct cr_fd_desc_tmpl fdset_template[CR_FD_MAX] = {
 	FD_ENTRY(FDINFO,	"fdinfo-%d"),
 	FD_ENTRY(PAGEMAP,	"pagemap-%ld"),
 	FD_ENTRY(SHMEM_PAGEMAP,	"pagemap-shmem-%ld"),
+	FD_ENTRY(SYSV_SHMEM_PAGEMAP, "pagemap-sysvshm-%ld"),
 	FD_ENTRY(REG_FILES,	"reg-files"),
 	FD_ENTRY(EXT_FILES,	"ext-files"),
 	FD_ENTRY(NS_FILES,	"ns-files"),
@@ -67,11 +68,16 @@ struct cr_fd_desc_tmpl fdset_template[CR_FD_MAX] = {
 	FD_ENTRY(IPTABLES,	"iptables-%d"),
 	FD_ENTRY(TMPFS_IMG,	"tmpfs-%d.tar.gz"),
 	FD_ENTRY(TMPFS_DEV,	"tmpfs-dev-%d.tar.gz"),
+	FD_ENTRY(TMPFS_ENTRIES,	"tmpfs-entries-dev-%d"),
+	FD_ENTRY(TMPFS_DATA,	"tmpfs-data-dev-%d"),
 	FD_ENTRY(TTY_FILES,	"tty"),
 	FD_ENTRY(TTY_INFO,	"tty-info"),
 	FD_ENTRY(FILE_LOCKS,	"filelocks"),
 	FD_ENTRY(RLIMIT,	"rlimit-%d"),
 	FD_ENTRY(PAGES,		"pages-%u"),
+	FD_ENTRY(PAGES_STORE,	"pages-store"),
+	FD_ENTRY(PAGES_STORE_INDEX, "pages-store-index"),
+	FD_ENTRY(SHMEM_HASHES,	"shmem-hashes-%ld"),
 	FD_ENTRY(PAGES_OLD,	"pages-%d"),
 	FD_ENTRY(SHM_PAGES_OLD, "pages-shmem-%ld"),
 	FD_ENTRY(SIGNAL,	"signal-s-%d"),
@@ -1,6 +1,8 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include "asm/atomic.h"
 #include "crtools.h"
 #include "cr_options.h"
 #include "fdset.h"
@@ -17,6 +19,8 @@ bool ns_per_id = false;
 TaskKobjIdsEntry *root_ids;
 u32 root_cg_set;
 
+static int init_page_ids(void);
+
 int check_img_inventory(void)
 {
 	int fd, ret = -1;
@@ -128,31 +132,38 @@ static struct cr_fdset *alloc_cr_fdset(int nr)
 	return cr_fdset;
 }
 
-static void __close_cr_fdset(struct cr_fdset *cr_fdset)
+static int __close_cr_fdset(struct cr_fdset *cr_fdset)
 {
 	unsigned int i;
+	int ret = 0;
 
 	if (!cr_fdset)
-		return;
+		return 0;
 
 	for (i = 0; i < cr_fdset->fd_nr; i++) {
 		if (cr_fdset->_fds[i] == -1)
 			continue;
-		close_safe(&cr_fdset->_fds[i]);
+		if (close_image(cr_fdset->_fds[i]))
+			ret = -1;
 		cr_fdset->_fds[i] = -1;
 	}
+
+	return ret;
 }
 
-void close_cr_fdset(struct cr_fdset **cr_fdset)
+int close_cr_fdset(struct cr_fdset **cr_fdset)
 {
+	int ret;
+
 	if (!cr_fdset || !*cr_fdset)
-		return;
+		return 0;
 
-	__close_cr_fdset(*cr_fdset);
+	ret = __close_cr_fdset(*cr_fdset);
 
 	xfree((*cr_fdset)->_fds);
 	xfree(*cr_fdset);
 	*cr_fdset = NULL;
+	return ret;
 }
 
 struct cr_fdset *cr_fdset_open_range(int pid, int from, int to,
@@ -169,7 +180,16 @@ struct cr_fdset *cr_fdset_open_range(int pid, int from, int to,
 	from++;
 	fdset->fd_off = from;
 	for (i = from; i < to; i++) {
-		ret = open_image(i, flags, pid);
+		unsigned long f = flags;
+
+		/*
+		 * Dumping fdsets are written with pb records only
+		 * (or flushed before anything else), so buffer them.
+		 */
+		if (flags & O_CREAT)
+			f |= O_BUF;
+
+		ret = open_image(i, f, pid);
 		if (ret < 0) {
 			if (!(flags & O_CREAT))
 				/* caller should check himself */
@@ -197,14 +217,235 @@ struct cr_fdset *cr_glob_fdset_open(int mode)
 	return cr_fdset_open(-1 /* ignored */, GLOB, mode);
 }
 
+/*
+ * Images are mostly streams of small pb records and reading or
+ * writing each record header and body with its own syscall costs
+ * way more than the data itself. Images opened with O_BUF get a
+ * read-ahead or a write-combining buffer, keyed by the fd, which
+ * the pb_* engine and the read_img/write_img helpers go through.
+ *
+ * Raw images (pages, ip tool dumps) are never buffered, they are
+ * spliced or written by others directly. Buffered images must be
+ * closed with close_image() and flushed with img_buf_flush() before
+ * anybody touches the fd bypassing the helpers above.
+ */
+
+#define IMG_BUF_SIZE	(4 * PAGE_SIZE)
+
+struct img_buf {
+	int		mode;	/* O_RDONLY or O_WRONLY */
+	char		*data;
+	unsigned int	pos;	/* next byte to read or to fill */
+	unsigned int	len;	/* bytes read-ahead into data */
+};
+
+static struct img_buf **img_bufs;
+static int nr_img_bufs;
+
+static inline struct img_buf *img_buf(int fd)
+{
+	if (fd < 0 || fd >= nr_img_bufs)
+		return NULL;
+
+	return img_bufs[fd];
+}
+
+static int img_buf_attach(int fd, unsigned long flags)
+{
+	struct img_buf *ib;
+
+	if (fd >= nr_img_bufs) {
+		struct img_buf **n;
+		int nr = max(fd + 1, nr_img_bufs * 2);
+
+		n = xrealloc(img_bufs, nr * sizeof(*n));
+		if (!n)
+			return -1;
+
+		memset(n + nr_img_bufs, 0, (nr - nr_img_bufs) * sizeof(*n));
+		img_bufs = n;
+		nr_img_bufs = nr;
+	}
+
+	if (img_bufs[fd]) {
+		/* Somebody closed a buffered image with plain close() */
+		pr_warn("Stale image buffer on fd %d\n", fd);
+		xfree(img_bufs[fd]->data);
+		xfree(img_bufs[fd]);
+	}
+
+	ib = xzalloc(sizeof(*ib));
+	if (!ib)
+		return -1;
+
+	ib->mode = (flags == O_RDONLY ? O_RDONLY : O_WRONLY);
+	img_bufs[fd] = ib;
+	return 0;
+}
+
+static int img_buf_data(struct img_buf *ib)
+{
+	if (!ib->data) {
+		ib->data = xmalloc(IMG_BUF_SIZE);
+		if (!ib->data)
+			return -1;
+	}
+
+	return 0;
+}
+
+int img_buf_flush(int fd)
+{
+	struct img_buf *ib = img_buf(fd);
+	unsigned int off = 0;
+
+	if (!ib)
+		return 0;
+
+	if (ib->mode == O_RDONLY) {
+		/* Give the read-ahead back to the file */
+		if (ib->pos < ib->len &&
+		    lseek(fd, -(off_t)(ib->len - ib->pos), SEEK_CUR) < 0) {
+			pr_perror("Can't rewind image buffer");
+			return -1;
+		}
+
+		ib->pos = ib->len = 0;
+		return 0;
+	}
+
+	while (off < ib->pos) {
+		ssize_t ret;
+
+		ret = write(fd, ib->data + off, ib->pos - off);
+		if (ret <= 0) {
+			pr_perror("Can't flush %u bytes into image", ib->pos - off);
+			return -1;
+		}
+
+		off += ret;
+	}
+
+	ib->pos = 0;
+	return 0;
+}
+
+ssize_t img_read(int fd, void *ptr, size_t size)
+{
+	struct img_buf *ib = img_buf(fd);
+	size_t done = 0;
+
+	if (!ib)
+		return read(fd, ptr, size);
+
+	while (done < size) {
+		size_t chunk;
+
+		if (ib->pos == ib->len) {
+			ssize_t ret;
+
+			if (size - done >= IMG_BUF_SIZE) {
+				/* Big payload, no need to bounce it */
+				ret = read(fd, ptr + done, size - done);
+				if (ret < 0)
+					return -1;
+				if (ret == 0)
+					break;
+
+				done += ret;
+				continue;
+			}
+
+			if (img_buf_data(ib))
+				return -1;
+
+			ret = read(fd, ib->data, IMG_BUF_SIZE);
+			if (ret < 0)
+				return -1;
+			if (ret == 0)
+				break;
+
+			ib->pos = 0;
+			ib->len = ret;
+		}
+
+		chunk = min(size - done, (size_t)(ib->len - ib->pos));
+		memcpy(ptr + done, ib->data + ib->pos, chunk);
+		ib->pos += chunk;
+		done += chunk;
+	}
+
+	return done;
+}
+
+ssize_t img_write(int fd, const void *ptr, size_t size)
+{
+	struct img_buf *ib = img_buf(fd);
+
+	if (!ib)
+		return write(fd, ptr, size);
+
+	if (ib->pos + size > IMG_BUF_SIZE) {
+		if (img_buf_flush(fd))
+			return -1;
+		if (size >= IMG_BUF_SIZE)
+			return write(fd, ptr, size);
+	}
+
+	if (img_buf_data(ib))
+		return -1;
+
+	memcpy(ib->data + ib->pos, ptr, size);
+	ib->pos += size;
+	return size;
+}
+
+ssize_t img_writev(int fd, const struct iovec *iov, int nr)
+{
+	ssize_t ret, done = 0;
+	int i;
+
+	if (!img_buf(fd))
+		return writev(fd, iov, nr);
+
+	for (i = 0; i < nr; i++) {
+		ret = img_write(fd, iov[i].iov_base, iov[i].iov_len);
+		if (ret != iov[i].iov_len)
+			return ret < 0 ? ret : done + ret;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+int close_image(int fd)
+{
+	struct img_buf *ib = img_buf(fd);
+	int ret = 0;
+
+	if (ib) {
+		if (ib->mode == O_WRONLY)
+			ret = img_buf_flush(fd);
+
+		xfree(ib->data);
+		xfree(ib);
+		img_bufs[fd] = NULL;
+	}
+
+	close(fd);
+	return ret;
+}
+
 int open_image_at(int dfd, int type, unsigned long flags, ...)
 {
 	bool optional = !!(flags & O_OPT);
+	bool buffered = !!(flags & O_BUF);
 	char path[PATH_MAX];
 	va_list args;
 	int ret;
 
-	flags &= ~O_OPT;
+	flags &= ~(O_OPT | O_BUF);
 
 	va_start(args, flags);
 	vsnprintf(path, PATH_MAX, fdset_template[type].fmt, args);
@@ -221,6 +462,9 @@ int open_image_at(int dfd, int type, unsigned long flags, ...)
 	if (fdset_template[type].magic == RAW_IMAGE_MAGIC)
 		goto skip_magic;
 
+	if (buffered && img_buf_attach(ret, flags))
+		goto err;
+
 	if (flags == O_RDONLY) {
 		u32 magic;
 
@@ -255,6 +499,9 @@ int open_image_dir(char *dir)
 	close(fd);
 	fd = ret;
 
+	if (init_page_ids())
+		goto err;
+
 	if (opts.img_parent) {
 		ret = symlinkat(opts.img_parent, fd, CR_PARENT_LINK);
 		if (ret < 0 && errno != EEXIST) {
@@ -275,7 +522,30 @@ void close_image_dir(void)
 	close_service_fd(IMG_FD_OFF);
 }
 
-static unsigned long page_ids = 1;
+/*
+ * Pages images are also created by forked processes, i.e. page
+ * server streams and namespaces dumper, so their ids come from
+ * a counter shared by all of them. It's mapped before any fork,
+ * together with the images dir.
+ */
+static atomic_t *page_ids;
+
+static int init_page_ids(void)
+{
+	if (page_ids)
+		return 0;
+
+	page_ids = mmap(NULL, sizeof(*page_ids), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (page_ids == MAP_FAILED) {
+		pr_perror("Can't map pages ids counter");
+		page_ids = NULL;
+		return -1;
+	}
+
+	atomic_set(page_ids, 1);
+	return 0;
+}
 
 void up_page_ids_base(void)
 {
@@ -287,8 +557,8 @@ void up_page_ids_base(void)
 	 * higher IDs.
 	 */
 
-	BUG_ON(page_ids != 1);
-	page_ids += 0x10000;
+	BUG_ON(atomic_read(page_ids) != 1);
+	atomic_add(0x10000, page_ids);
 }
 
 int open_pages_image_at(int dfd, unsigned long flags, int pm_fd)
@@ -303,7 +573,7 @@ int open_pages_image_at(int dfd, unsigned long flags, int pm_fd)
 		pagemap_head__free_unpacked(h, NULL);
 	} else {
 		PagemapHead h = PAGEMAP_HEAD__INIT;
-		id = h.pages_id = page_ids++;
+		id = h.pages_id = atomic_inc_return(page_ids) - 1;
 		if (pb_write_one(pm_fd, &h, PB_PAGEMAP_HEAD) < 0)
 			return -1;
 	}
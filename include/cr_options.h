@@ -54,6 +54,16 @@ struct cr_options {
 	bool			track_mem;
 	char			*img_parent;
 	bool			auto_dedup;
+	int			dump_jobs;
+	bool			mmap_pages;
+	bool			lazy_pages;
+	bool			page_store;
+	bool			compress;
+	int			compress_jobs;
+	unsigned long		pipe_mem_limit;	/* MiB */
+	char			*trace_file;
+	char			*freeze_cgroup;
+	int			tcp_jobs;
 	unsigned int		cpu_cap;
 	bool			force_irmap;
 	char			**exec_cmd;
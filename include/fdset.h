@@ -31,6 +31,6 @@ extern struct cr_fdset *cr_fdset_open_range(int pid, int from, int to,
 		_CR_FD_##type##_FROM, _CR_FD_##type##_TO, flags)
 extern struct cr_fdset *cr_glob_fdset_open(int mode);
 
-extern void close_cr_fdset(struct cr_fdset **cr_fdset);
+extern int close_cr_fdset(struct cr_fdset **cr_fdset);
 
 #endif /* __CR_FDSET_H__ */
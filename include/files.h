@@ -69,6 +69,7 @@ struct fdinfo_list_entry {
 	struct list_head	ps_list;	/* To chain  per-task files */
 	int			pid;
 	futex_t			real_pid;
+	bool			received;	/* got from transport socket */
 	FdinfoEntry		*fe;
 };
 
@@ -137,7 +138,10 @@ extern int file_desc_add(struct file_desc *d, u32 id, struct file_desc_ops *ops)
 extern struct fdinfo_list_entry *file_master(struct file_desc *d);
 extern struct file_desc *find_file_desc_raw(int type, u32 id);
 
-extern int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle, int sock);
+extern int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle);
+extern int send_fds_to_peer(int sock, pid_t real_pid,
+		struct fdinfo_list_entry **fles, int *fds, int nr);
+extern int recv_fd_from_peer(struct fdinfo_list_entry *fle);
 extern int restore_fown(int fd, FownEntry *fown);
 extern int rst_file_params(int fd, FownEntry *fown, int flags);
 
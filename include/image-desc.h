@@ -43,6 +43,7 @@ enum {
 
 	CR_FD_PSTREE,
 	CR_FD_SHMEM_PAGEMAP,
+	CR_FD_SYSV_SHMEM_PAGEMAP,
 	CR_FD_GHOST_FILE,
 	CR_FD_TCP_STREAM,
 	CR_FD_FDINFO,
@@ -79,7 +80,12 @@ enum {
 
 	CR_FD_TMPFS_IMG,
 	CR_FD_TMPFS_DEV,
+	CR_FD_TMPFS_ENTRIES,
+	CR_FD_TMPFS_DATA,
 	CR_FD_PAGES,
+	CR_FD_PAGES_STORE,
+	CR_FD_PAGES_STORE_INDEX,
+	CR_FD_SHMEM_HASHES,
 
 	CR_FD_VMAS,
 	CR_FD_PAGES_OLD,
@@ -2,6 +2,7 @@
 #define __CR_IMAGE_H__
 
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #include "compiler.h"
 #include "servicefd.h"
@@ -53,6 +54,7 @@
 #define VMA_AREA_SOCKET		(1 <<  11)
 #define VMA_AREA_VVAR		(1 <<  12)
 
+#define VMA_LAZY_PAGES		(1 <<  30)	/* Restore only, pages go via userfaultfd */
 #define VMA_UNSUPP		(1 <<  31)	/* Unsupported VMA */
 
 #define CR_CAP_SIZE	2
@@ -73,11 +75,15 @@ extern bool ns_per_id;
 #define O_SHOW	(O_RDONLY)
 #define O_RSTR	(O_RDONLY)
 #define O_OPT	(O_PATH)
+#define O_BUF	(O_NOCTTY)	/* buffered pb image, see img_buf_attach() */
 
 extern int open_image_dir(char *dir);
 extern void close_image_dir(void);
 
 extern int open_image_at(int dfd, int type, unsigned long flags, ...);
+extern int close_image(int fd);
+extern int img_buf_flush(int fd);
+extern ssize_t img_writev(int fd, const struct iovec *iov, int nr);
 #define open_image(typ, flags, ...) open_image_at(get_service_fd(IMG_FD_OFF), typ, flags, ##__VA_ARGS__)
 extern int open_pages_image(unsigned long flags, int pm_fd);
 extern int open_pages_image_at(int dfd, unsigned long flags, int pm_fd);
@@ -19,7 +19,7 @@ struct kid_tree {
 
 struct kid_elem {
 	int pid;
-	unsigned genid;
+	u64 genid;
 	unsigned idx;
 };
 
@@ -0,0 +1,13 @@
+#ifndef __CR_LAZY_PAGES_H__
+#define __CR_LAZY_PAGES_H__
+
+#include <stdbool.h>
+
+struct vm_area_list;
+
+extern int cr_lazy_pages(bool daemon_mode);
+
+extern int lazy_pages_connect(void);
+extern int lazy_pages_setup_uffd(int pid, struct vm_area_list *vmas, int *uffd);
+
+#endif /* __CR_LAZY_PAGES_H__ */
@@ -25,7 +25,11 @@
 #define FDINFO_MAGIC		0x56213732 /* Dmitrov */
 #define PAGEMAP_MAGIC		0x56084025 /* Vladimir */
 #define SHMEM_PAGEMAP_MAGIC	PAGEMAP_MAGIC
+#define SYSV_SHMEM_PAGEMAP_MAGIC	PAGEMAP_MAGIC
 #define PAGES_MAGIC		RAW_IMAGE_MAGIC
+#define PAGES_STORE_MAGIC	RAW_IMAGE_MAGIC
+#define PAGES_STORE_INDEX_MAGIC	RAW_IMAGE_MAGIC
+#define SHMEM_HASHES_MAGIC	RAW_IMAGE_MAGIC
 #define CORE_MAGIC		0x55053847 /* Kolomna */
 #define IDS_MAGIC		0x54432030 /* Konigsberg */
 #define VMAS_MAGIC		0x54123737 /* Tula */
@@ -74,11 +78,13 @@
 #define TUNFILE_MAGIC		0x57143751 /* Kalyazin */
 #define CGROUP_MAGIC		0x59383330 /* Tikhvin */
 #define TIMERFD_MAGIC		0x50493712 /* Korocha */
+#define TMPFS_ENTRIES_MAGIC	0x56293427 /* Zvenigorod */
 
 #define IFADDR_MAGIC		RAW_IMAGE_MAGIC
 #define ROUTE_MAGIC		RAW_IMAGE_MAGIC
 #define TMPFS_IMG_MAGIC		RAW_IMAGE_MAGIC
 #define TMPFS_DEV_MAGIC		RAW_IMAGE_MAGIC
+#define TMPFS_DATA_MAGIC	RAW_IMAGE_MAGIC
 #define IPTABLES_MAGIC		RAW_IMAGE_MAGIC
 
 #define PAGES_OLD_MAGIC		PAGEMAP_MAGIC
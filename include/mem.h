@@ -5,6 +5,7 @@ struct parasite_ctl;
 struct vm_area_list;
 struct page_pipe;
 struct pstree_item;
+struct page_xfer;
 
 extern int prepare_mm_pid(struct pstree_item *i);
 extern int do_task_reset_dirty_track(int pid);
@@ -12,6 +13,8 @@ extern unsigned int dump_pages_args_size(struct vm_area_list *vmas);
 extern int parasite_dump_pages_seized(struct parasite_ctl *ctl,
 				      struct vm_area_list *vma_area_list,
 				      struct page_pipe **pp);
+extern int page_xfer_dump_pages_bg(struct page_xfer *xfer, struct page_pipe *pp, long id);
+extern int wait_page_writers(void);
 
 #define PME_PRESENT		(1ULL << 63)
 #define PME_SWAP		(1ULL << 62)
@@ -0,0 +1,27 @@
+#ifndef __CR_PAGE_COMPRESS_H__
+#define __CR_PAGE_COMPRESS_H__
+
+/*
+ * With --compress pages are written in chunks of up to
+ * PAGE_COMPRESS_CHUNK pages compressed with lz4. Each chunk
+ * gets its own pagemap entry with compressed_size set and is
+ * decompressed as a whole on read.
+ */
+#define PAGE_COMPRESS_CHUNK	16
+
+/* Max number of --compress-jobs threads */
+#define PAGE_COMPRESS_MAX_JOBS	64
+
+struct page_zchunk {
+	void		*src;		/* nr_pages of raw pages */
+	unsigned int	nr_pages;
+	void		*dst;		/* page_compress_bound() bytes */
+	unsigned int	size;		/* of compressed data in dst */
+};
+
+extern int page_compress_init(void);
+extern unsigned int page_compress_bound(unsigned int len);
+extern int page_compress_chunks(struct page_zchunk *c, int nr);
+extern int page_decompress(void *src, unsigned int size, void *dst, unsigned int len);
+
+#endif /* __CR_PAGE_COMPRESS_H__ */
@@ -95,6 +95,16 @@ struct page_pipe {
 				   and dump memory for a few iterations */
 };
 
+/*
+ * Chunk mode page-pipes reuse iovs from the beginning after
+ * page_pipe_reinit(). Any page-pipe returns -EAGAIN when iovs
+ * are over or (not in chunk mode) when pages pinned in all the
+ * page-pipes are over --pipe-mem-limit. The caller is then to
+ * flush the page-pipe and switch it into chunk mode. Thus the
+ * iovs array needn't be bigger than this.
+ */
+#define PAGE_PIPE_MAX_IOVS	(1 << 16)
+
 extern struct page_pipe *create_page_pipe(unsigned int nr,
 					  struct iovec *, bool chunk_mode);
 extern void destroy_page_pipe(struct page_pipe *p);
@@ -104,4 +114,9 @@ extern int page_pipe_add_hole(struct page_pipe *p, unsigned long addr);
 extern void debug_show_page_pipe(struct page_pipe *pp);
 void page_pipe_reinit(struct page_pipe *pp);
 
+static inline struct iovec *page_pipe_first_hole(struct page_pipe *pp)
+{
+	return pp->free_hole ? &pp->holes[0] : NULL;
+}
+
 #endif /* __CR_PAGE_PIPE_H__ */
@@ -38,6 +38,12 @@
  * skip pages from pages.img where appropriate.
  *
  * All this is implemented in read_pagemap_page.
+ *
+ * With --page-store pages are in pages-store.img instead, and
+ * entries refer to them with store_page, so such entries have
+ * no data in pages.img.
+ *
+ * With --compress entries have compressed_size bytes of pages.img.
  */
 
 struct page_read {
@@ -46,8 +52,12 @@ struct page_read {
 	 * Pagemap entries should be returned in sorted order.
 	 */
 	int (*get_pagemap)(struct page_read *, struct iovec *iov);
-	/* reads page from current pagemap */
-	int (*read_page)(struct page_read *, unsigned long vaddr, void *);
+	/* reads nr consequent pages from current pagemap */
+	int (*read_pages)(struct page_read *, unsigned long vaddr, int nr, void *);
+	/* maps nr consequent pages at addr, 0 means they should be read */
+	int (*map_pages)(struct page_read *, unsigned long vaddr, int nr, void *addr, int prot);
+	/* skips len bytes of pages in current pagemap */
+	void (*skip_pages)(struct page_read *, unsigned long len);
 	/* stop working on current pagemap */
 	void (*put_pagemap)(struct page_read *);
 	void (*close)(struct page_read *);
@@ -55,6 +65,10 @@ struct page_read {
 	/* Private data of reader */
 	int fd;
 	int fd_pg;
+	int fd_store;			/* pages-store.img, -1 if none */
+	off_t zoff;			/* compressed pages of current pagemap */
+	void *zpages;			/* and them decompressed, if zvalid */
+	bool zvalid;
 
 	PagemapEntry *pe;		/* current pagemap we are on */
 	struct page_read *parent;	/* parent pagemap (if ->in_parent
@@ -63,13 +77,24 @@ struct page_read {
 					   read_pagemap_page */
 	unsigned long cvaddr;		/* vaddr we are on */
 
+	bool auto_dedup;		/* punch pages out once read, only
+					   for images opened O_RDWR */
 	struct iovec bunch;		/* record consequent neighbour
 					   iovecs to punch together */
 	unsigned id; /* for logging */
 };
 
-extern int open_page_read(int pid, struct page_read *, int flags, bool shmem);
-extern int open_page_read_at(int dfd, int pid, struct page_read *pr, int flags, bool shmem);
+/* Whose pages a page_read reads */
+#define PR_TASK		0
+#define PR_SHMEM	1	/* anon shared memory */
+#define PR_SYSV_SHMEM	2	/* SysV IPC shared memory segment */
+
+extern int open_page_read(int pid, struct page_read *, int flags, int pr_type);
+extern int open_page_read_at(int dfd, int pid, struct page_read *pr, int flags, int pr_type);
+/* Max number of iovecs page_read_all reads with one call */
+#define PR_READV_BATCH	256
+
+extern int page_read_all(struct page_read *pr, void *base, unsigned long size);
 extern void pagemap2iovec(PagemapEntry *pe, struct iovec *iov);
 extern void iovec2pagemap(struct iovec *iov, PagemapEntry *pe);
 extern int seek_pagemap_page(struct page_read *pr, unsigned long vaddr, bool warn);
@@ -0,0 +1,21 @@
+#ifndef __CR_PAGE_STORE_H__
+#define __CR_PAGE_STORE_H__
+
+#include "asm/types.h"
+
+/*
+ * page store -- pages-store.img, where pages are kept once per
+ * content and are referred to from pagemap entries by index
+ * (see --page-store). The store is only appended to and is shared
+ * between snapshots by hard-linking it into the new images dir.
+ */
+
+/* Max number of pages page_store_write() accepts at once */
+#define PAGE_STORE_BATCH	64
+
+extern int page_store_init(void);
+extern int page_store_write(void *pages, unsigned long nr, u64 *idx);
+extern int page_store_write_pagemap(int fd, unsigned long vaddr, u64 *idx, unsigned long nr);
+extern int page_store_fini(void);
+
+#endif /* __CR_PAGE_STORE_H__ */
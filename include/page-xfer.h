@@ -15,9 +15,14 @@ struct page_xfer {
 	int (*write_pagemap)(struct page_xfer *self, struct iovec *iov);
 	/* transfers pages related to previous pagemap */
 	int (*write_pages)(struct page_xfer *self, int pipe, unsigned long len);
+	/* transfers nr vaddr:len entries and all their pages */
+	int (*write_iovs)(struct page_xfer *self, struct iovec *iov, int nr, int pipe);
 	/* transfers one hole -- vaddr:len entry w/o pages */
 	int (*write_hole)(struct page_xfer *self, struct iovec *iov);
-	void (*close)(struct page_xfer *self);
+	/* transfers one vaddr:len entry with its pages compressed into buf */
+	int (*write_compressed)(struct page_xfer *self, struct iovec *iov,
+			void *buf, unsigned int size);
+	int (*close)(struct page_xfer *self);
 
 	/* private data for every page-xfer engine */
 	int fd;
@@ -26,13 +31,21 @@ struct page_xfer {
 		u64 dst_id;
 	};
 	struct page_read *parent;
+	struct iovec store_iov;		/* pages to come with --page-store */
 };
 
 extern int open_page_xfer(struct page_xfer *xfer, int fd_type, long id);
 struct page_pipe;
+struct page_pipe_buf;
 extern int page_xfer_dump_pages(struct page_xfer *, struct page_pipe *,
 				unsigned long off);
+extern int page_xfer_dump_ppb(struct page_xfer *, struct page_pipe *,
+			      struct page_pipe_buf *, struct iovec **hole,
+			      unsigned long off);
+extern int page_xfer_dump_holes(struct page_xfer *, struct page_pipe *,
+				struct iovec **hole);
 extern int connect_to_page_server(void);
+extern int connect_to_page_server_stream(void);
 extern int disconnect_from_page_server(void);
 
 #endif /* __CR_PAGE_XFER__H__ */
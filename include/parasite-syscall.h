@@ -41,7 +41,8 @@ struct parasite_ctl {
 	struct rt_sigframe	*sigframe;
 	struct rt_sigframe	*rsigframe;				/* address in a parasite */
 
-	void			*r_thread_stack;			/* stack for non-leader threads */
+	void			*r_thread_stacks;			/* stacks for non-leader threads */
+	int			nr_thread_stacks;
 
 	unsigned long		parasite_ip;				/* service routine start ip */
 	unsigned long		syscall_ip;				/* entry point of infection */
@@ -84,8 +85,7 @@ extern int __parasite_wait_daemon_ack(unsigned int cmd,
 
 extern int parasite_dump_misc_seized(struct parasite_ctl *ctl, struct parasite_dump_misc *misc);
 extern int parasite_dump_creds(struct parasite_ctl *ctl, struct _CredsEntry *ce);
-extern int parasite_dump_thread_seized(struct parasite_ctl *ctl, int id,
-					struct pid *tid, struct _CoreEntry *core);
+extern int parasite_dump_threads_seized(struct parasite_ctl *ctl, struct pstree_item *item);
 extern int dump_thread_core(int pid, CoreEntry *core, const struct parasite_dump_thread *dt);
 
 extern int parasite_drain_fds_seized(struct parasite_ctl *ctl,
@@ -144,6 +144,19 @@ struct parasite_dump_thread {
 	int			pdeath_sig;
 };
 
+/*
+ * Non-leader threads are run in parasite in batches of up to
+ * PARASITE_THREADS_BATCH at once, each on its own stack of the
+ * PARASITE_STACK_SIZE ones starting at @stacks. A thread finds
+ * its slot in ti[] by the stack it runs on.
+ */
+#define PARASITE_THREADS_BATCH	32
+
+struct parasite_dump_threads {
+	unsigned long			stacks;
+	struct parasite_dump_thread	ti[PARASITE_THREADS_BATCH];
+};
+
 /*
  * Misc sfuff, that is too small for separate file, but cannot
  * be read w/o using parasite
@@ -52,6 +52,7 @@ enum {
 	PB_IRMAP_CACHE,
 	PB_CGROUP,
 	PB_TIMERFD,
+	PB_TMPFS,
 
 	/* PB_AUTOGEN_STOP */
 
@@ -63,6 +63,8 @@ struct ptrace_peeksiginfo_args {
 #define SI_EVENT(_si_code)	(((_si_code) & 0xFFFF) >> 8)
 
 extern int seize_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid);
+extern int seize_catch_task(pid_t pid);
+extern int seize_wait_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid);
 extern int unseize_task(pid_t pid, int orig_state, int state);
 extern int ptrace_peek_area(pid_t pid, void *dst, void *addr, long bytes);
 extern int ptrace_poke_area(pid_t pid, void *src, void *addr, long bytes);
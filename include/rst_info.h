@@ -23,6 +23,7 @@ struct fdt {
 };
 
 struct _MmEntry;
+struct _CoreEntry;
 
 struct rst_info {
 	struct list_head	fds;
@@ -42,6 +43,7 @@ struct rst_info {
 
 	struct vm_area_list	vmas;
 	struct _MmEntry		*mm;
+	struct _CoreEntry	*core;	/* prefetched, see prefetch_task_images */
 
 	u32			cg_set;
 
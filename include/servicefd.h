@@ -17,6 +17,8 @@ enum sfd_type {
 			 */
 	ROOT_FD_OFF,	/* Root of the namespace we dump/restore */
 	CGROUP_YARD,
+	LAZY_PAGES_SK_OFF,	/* connection to lazy pages daemon */
+	TRANSPORT_FD_OFF,	/* socket to receive shared files on restore */
 
 	SERVICE_FD_MAX
 };
@@ -32,6 +32,8 @@ extern unsigned long rst_shmems;
 
 extern int cr_dump_shmem(void);
 extern int add_shmem_area(pid_t pid, VmaEntry *vma);
+extern int dump_one_sysv_shmem(void *addr, unsigned long size, unsigned long shmid);
+extern int restore_sysv_shmem_content(void *addr, unsigned long size, unsigned long shmid);
 
 static always_inline struct shmem_info *
 find_shmem(struct shmem_info *shmems, int nr, unsigned long shmid)
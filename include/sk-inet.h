@@ -35,14 +35,28 @@ struct inet_sk_desc {
 	struct list_head rlist;
 };
 
+/*
+ * A connection put into repair state by a tcp helper (see --tcp-jobs).
+ * The task owning it publishes itself here when it waits for it.
+ */
+struct tcp_helper_ring;
+struct tcp_prebuilt {
+	struct tcp_helper_ring		*ring;
+	int				idx;	/* in the ring helper's range */
+	pid_t				owner;
+	struct fdinfo_list_entry	*fle;
+};
+
 struct inet_port;
 struct inet_sk_info {
 	InetSkEntry *ie;
 	struct file_desc d;
 	struct inet_port *port;
 	struct list_head rlist;
+	struct tcp_prebuilt *prebuilt;
 };
 
+extern int create_inet_sk(struct inet_sk_info *);
 extern int inet_bind(int sk, struct inet_sk_info *);
 extern int inet_connect(int sk, struct inet_sk_info *);
 
@@ -68,12 +82,18 @@ static inline void tcp_repair_off(int fd)
 		pr_perror("Failed to turn off repair mode on socket (%d)", ret);
 }
 
-extern void tcp_locked_conn_add(struct inet_sk_info *);
+extern int tcp_locked_conn_add(struct inet_sk_info *);
 extern void rst_unlock_tcp_connections(void);
 extern void cpt_unlock_tcp_connections(void);
 
 extern int dump_one_tcp(int sk, struct inet_sk_desc *sd);
 extern int restore_one_tcp(int sk, struct inet_sk_info *si);
+extern int recv_prebuilt_tcp(struct inet_sk_info *ii);
+
+extern int prepare_tcp_helpers(void);
+extern int rst_tcp_helpers_start(void);
+extern int rst_tcp_helpers_stop(bool kill);
+extern bool rst_tcp_helpers_failed(void);
 
 #define SK_EST_PARAM	"tcp-established"
 
@@ -2,6 +2,7 @@
 #define __CR_SOCKETS_H__
 
 #include <stdbool.h>
+#include <sys/socket.h>
 
 #include "asm/types.h"
 
@@ -15,10 +16,30 @@ struct fd_parms;
 struct cr_fdset;
 struct nlmsghdr;
 
+/*
+ * Hash of socket-related objects by inode. It starts small and is
+ * grown as entries are added, so that lookups stay O(1) with tens
+ * of thousands of sockets.
+ */
+struct sk_hash_node {
+	unsigned int		ino;
+	struct sk_hash_node	*next;
+};
+
+struct sk_hash {
+	struct sk_hash_node	**chains;
+	unsigned int		bits;
+	unsigned int		nr;
+};
+
+extern int sk_hash_add(struct sk_hash *h, struct sk_hash_node *n, unsigned int ino);
+extern struct sk_hash_node *sk_hash_lookup(struct sk_hash *h, unsigned int ino);
+extern void sk_hash_get_stats(unsigned long *lookups, unsigned long *steps);
+
 struct socket_desc {
 	unsigned int		family;
 	unsigned int		ino;
-	struct socket_desc	*next;
+	struct sk_hash_node	hash;
 	int			already_dumped;
 };
 
@@ -21,6 +21,31 @@ enum {
 extern void timing_start(int t);
 extern void timing_stop(int t);
 
+/*
+ * Spans of phases per task, pid is the one of the task the phase is
+ * about. Start is got with trace_start() and passed to trace_stop().
+ */
+enum {
+	PHASE_SEIZE,
+	PHASE_INFECT,
+	PHASE_VMAS,
+	PHASE_PAGEMAP_SCAN,
+	PHASE_PAGE_SPLICE,
+	PHASE_FILES_DUMP,
+	PHASE_SOCKETS_DUMP,
+	PHASE_FORK,
+	PHASE_FILES_RESTORE,
+	PHASE_MEM_RESTORE,
+	PHASE_RESTORER_JUMP,
+
+	TRACE_NR_PHASES,
+};
+
+#define TRACE_MAX_SPANS	4096
+
+extern unsigned long long trace_start(void);
+extern void trace_stop(int phase, int pid, unsigned long long start);
+
 enum {
 	CNT_PAGES_SCANNED,
 	CNT_PAGES_SKIPPED_PARENT,
@@ -45,4 +70,7 @@ extern void cnt_add(int c, unsigned long val);
 extern int init_stats(int what);
 extern void write_stats(int what);
 
+struct _DumpStatsEntry;
+extern void get_dump_stats(struct _DumpStatsEntry *);
+
 #endif /* __CR_STATS_H__ */
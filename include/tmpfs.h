@@ -0,0 +1,8 @@
+#ifndef __CR_TMPFS_H__
+#define __CR_TMPFS_H__
+
+extern int tmpfs_dump_tree(int mnt_fd, unsigned int s_dev);
+/* Returns -ENOENT if there's no native image for s_dev */
+extern int tmpfs_restore_tree(const char *mountpoint, unsigned int s_dev);
+
+#endif /* __CR_TMPFS_H__ */
@@ -34,6 +34,9 @@
 #define MEGA(size)	PREF_SHIFT_OP(K, <<, size)
 #define GIGA(size)	PREF_SHIFT_OP(K, <<, size)
 
+extern ssize_t img_read(int fd, void *ptr, size_t size);
+extern ssize_t img_write(int fd, const void *ptr, size_t size);
+
 /*
  * Write buffer @ptr of @size bytes into @fd file
  * Returns
@@ -43,7 +46,7 @@
 static inline int write_img_buf(int fd, const void *ptr, int size)
 {
 	int ret;
-	ret = write(fd, ptr, size);
+	ret = img_write(fd, ptr, size);
 	if (ret == size)
 		return 0;
 
@@ -66,7 +69,7 @@ static inline int write_img_buf(int fd, const void *ptr, int size)
 static inline int read_img_buf_eof(int fd, void *ptr, int size)
 {
 	int ret;
-	ret = read(fd, ptr, size);
+	ret = img_read(fd, ptr, size);
 	if (ret == size)
 		return 1;
 	if (ret == 0)
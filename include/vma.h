@@ -4,11 +4,14 @@
 #include "list.h"
 #include "protobuf/vma.pb-c.h"
 
+struct vma_area_batch;
+
 struct vm_area_list {
 	struct list_head	h;
 	unsigned		nr;
 	unsigned long		priv_size; /* nr of pages in private VMAs */
 	unsigned long		longest; /* nr of pages in longest VMA */
+	struct vma_area_batch	*batch; /* see alloc_vma_area_in */
 };
 
 #define VM_AREA_LIST(name)	struct vm_area_list name = { .h = LIST_HEAD_INIT(name.h), .nr = 0, }
@@ -19,6 +22,7 @@ static inline void vm_area_list_init(struct vm_area_list *vml)
 	vml->nr = 0;
 	vml->priv_size = 0;
 	vml->longest = 0;
+	vml->batch = NULL;
 }
 
 struct file_desc;
@@ -44,11 +48,15 @@ struct vma_area {
 	unsigned long		premmaped_addr;
 
 	bool			file_borrowed;
+	bool			in_batch;
 
 	struct stat		*st;
 };
 
 extern struct vma_area *alloc_vma_area(void);
+extern struct vma_area *alloc_vma_area_in(struct vm_area_list *vml);
+extern void free_vma_area(struct vma_area *vma);
+extern void free_vma_batches(struct vm_area_list *vml);
 extern int collect_mappings(pid_t pid, struct vm_area_list *vma_area_list);
 extern void free_mappings(struct vm_area_list *vma_area_list);
 extern bool privately_dump_vma(struct vma_area *vma);
@@ -14,6 +14,7 @@
 #include "namespaces.h"
 #include "sysctl.h"
 #include "ipc_ns.h"
+#include "shmem.h"
 
 #include "protobuf.h"
 #include "protobuf/ipc-var.pb-c.h"
@@ -328,11 +329,7 @@ static int ipc_sysctl_req(IpcVarEntry *e, int op)
 	return sysctl_op(req_mq, op);
 }
 
-/*
- * TODO: Function below should be later improved to locate and dump only dirty
- * pages via updated sys_mincore().
- */
-static int dump_ipc_shm_pages(int fd, const IpcShmEntry *shm)
+static int dump_ipc_shm_pages(const IpcShmEntry *shm)
 {
 	void *data;
 	int ret;
@@ -342,9 +339,9 @@ static int dump_ipc_shm_pages(int fd, const IpcShmEntry *shm)
 		pr_perror("Failed to attach IPC shared memory");
 		return -errno;
 	}
-	ret = write_img_buf(fd, data, round_up(shm->size, sizeof(u32)));
+	ret = dump_one_sysv_shmem(data, round_up(shm->size, PAGE_SIZE), shm->desc->id);
 	if (ret < 0) {
-		pr_err("Failed to write IPC shared memory data\n");
+		pr_err("Failed to dump IPC shared memory data\n");
 		return ret;
 	}
 	if (shmdt(data)) {
@@ -362,6 +359,8 @@ static int dump_ipc_shm_seg(int fd, int id, const struct shmid_ds *ds)
 
 	shm.desc = &desc;
 	shm.size = ds->shm_segsz;
+	shm.has_in_pagemaps = true;
+	shm.in_pagemaps = true;
 	fill_ipc_desc(id, shm.desc, &ds->shm_perm);
 	pr_info_ipc_shm(&shm);
 
@@ -370,7 +369,7 @@ static int dump_ipc_shm_seg(int fd, int id, const struct shmid_ds *ds)
 		pr_err("Failed to write IPC shared memory segment\n");
 		return ret;
 	}
-	return dump_ipc_shm_pages(fd, &shm);
+	return dump_ipc_shm_pages(&shm);
 }
 
 static int dump_ipc_shm(int fd)
@@ -476,7 +475,8 @@ int dump_ipc_ns(int ns_pid, int ns_id)
 	}
 
 err:
-	close_cr_fdset(&fdset);
+	if (close_cr_fdset(&fdset))
+		ret = -1;
 	return ret < 0 ? -1 : 0;
 }
 
@@ -518,6 +518,9 @@ void ipc_msg_handler(int fd, void *obj)
 void ipc_shm_handler(int fd, void *obj)
 {
 	IpcShmEntry *e = obj;
+
+	if (e->in_pagemaps)
+		return;
 	print_image_data(fd, round_up(e->size, sizeof(u32)), opts.show_pages_content);
 }
 
@@ -784,7 +787,10 @@ static int prepare_ipc_shm_pages(int fd, const IpcShmEntry *shm)
 		pr_perror("Failed to attach IPC shared memory");
 		return -errno;
 	}
-	ret = read_img_buf(fd, data, round_up(shm->size, sizeof(u32)));
+	if (shm->in_pagemaps)
+		ret = restore_sysv_shmem_content(data, round_up(shm->size, PAGE_SIZE), shm->desc->id);
+	else
+		ret = read_img_buf(fd, data, round_up(shm->size, sizeof(u32)));
 	if (ret < 0) {
 		pr_err("Failed to read IPC shared memory data\n");
 		return ret;
@@ -0,0 +1,926 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/userfaultfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "cr_options.h"
+#include "servicefd.h"
+#include "image.h"
+#include "util.h"
+#include "syscall.h"
+#include "list.h"
+#include "vma.h"
+#include "page-read.h"
+#include "lazy-pages.h"
+
+/*
+ * Lazy pages -- restored tasks start running before their anonymous
+ * memory is filled. The restorer registers such VMAs with userfaultfd,
+ * which is sent by restore to the lazy pages daemon. The daemon serves
+ * page faults from pagemap/pages images and pushes the rest of pages
+ * in background when there are no faults to serve.
+ */
+
+#define LAZY_PAGES_SOCK		"lazy-pages.socket"
+#define LAZY_PAGES_MAX_VMAS	4096
+#define LAZY_PAGES_CHUNK	64	/* pages pushed in background in one go */
+#define LAZY_PAGES_RETRY	10	/* ms to wait for VMAs to get registered */
+
+/*
+ * Without these events the daemon would feed stale or zero pages
+ * after the task forks, remaps, madvise-s or unmaps lazy memory.
+ */
+#define LAZY_PAGES_FEATURES	(UFFD_FEATURE_EVENT_FORK | UFFD_FEATURE_EVENT_REMAP | \
+				 UFFD_FEATURE_EVENT_REMOVE | UFFD_FEATURE_EVENT_UNMAP)
+
+/*
+ * One request per task, the userfaultfd is attached to it
+ * and nr_vmas lazy_pages_range-s follow it.
+ */
+struct lazy_pages_req {
+	u32	pid;
+	u32	nr_vmas;
+};
+
+struct lazy_pages_range {
+	u64	start;
+	u64	end;
+};
+
+static int lazy_pages_addr(struct sockaddr_un *addr)
+{
+	char *path = opts.addr ? : LAZY_PAGES_SOCK;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		pr_err("Too long lazy pages socket path %s\n", path);
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int uffd_open(unsigned long long features)
+{
+	struct uffdio_api api = { .api = UFFD_API, .features = features, };
+	int fd;
+
+	fd = sys_userfaultfd(O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0) {
+		pr_err("Can't create userfaultfd: %d\n", fd);
+		return -1;
+	}
+
+	if (ioctl(fd, UFFDIO_API, &api)) {
+		pr_perror("Can't init userfaultfd");
+		close(fd);
+		return -1;
+	}
+
+	if ((api.features & LAZY_PAGES_FEATURES) != LAZY_PAGES_FEATURES) {
+		pr_err("Kernel lacks userfaultfd events (%llx of %llx) "
+				"required by lazy pages\n",
+				(unsigned long long)api.features & LAZY_PAGES_FEATURES,
+				(unsigned long long)LAZY_PAGES_FEATURES);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int lazy_pages_connect(void)
+{
+	struct sockaddr_un addr;
+	int sk, ret;
+
+	/* Probe with no features asked to get all supported ones */
+	sk = uffd_open(0);
+	if (sk < 0)
+		return -1;
+	close(sk);
+
+	if (lazy_pages_addr(&addr))
+		return -1;
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		pr_perror("Can't create lazy pages socket");
+		return -1;
+	}
+
+	if (connect(sk, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_perror("Can't connect to lazy pages daemon at %s", addr.sun_path);
+		close(sk);
+		return -1;
+	}
+
+	ret = install_service_fd(LAZY_PAGES_SK_OFF, sk);
+	close(sk);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Called by the restored task itself, the userfaultfd is bound
+ * to the mm of the caller. The VMAs are registered by restorer,
+ * after they are moved into their places.
+ */
+int lazy_pages_setup_uffd(int pid, struct vm_area_list *vmas, int *uffd)
+{
+	struct lazy_pages_req req = { .pid = pid, };
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct lazy_pages_range *r;
+	struct msghdr mh = { };
+	struct iovec iov[2];
+	struct cmsghdr *ch;
+	struct vma_area *vma;
+	int fd, i = 0, ret = -1;
+
+	*uffd = -1;
+
+	list_for_each_entry(vma, &vmas->h, list)
+		if (vma->e->status & VMA_LAZY_PAGES)
+			req.nr_vmas++;
+
+	if (!req.nr_vmas)
+		return 0;
+
+	if (req.nr_vmas > LAZY_PAGES_MAX_VMAS) {
+		pr_err("Too many lazy VMAs %u\n", req.nr_vmas);
+		return -1;
+	}
+
+	r = xmalloc(req.nr_vmas * sizeof(*r));
+	if (!r)
+		return -1;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!(vma->e->status & VMA_LAZY_PAGES))
+			continue;
+
+		r[i].start = vma->e->start;
+		r[i].end = vma->e->end;
+		i++;
+	}
+
+	fd = uffd_open(LAZY_PAGES_FEATURES);
+	if (fd < 0)
+		goto out;
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = r;
+	iov[1].iov_len = req.nr_vmas * sizeof(*r);
+
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	ch = CMSG_FIRSTHDR(&mh);
+	ch->cmsg_len = CMSG_LEN(sizeof(int));
+	ch->cmsg_level = SOL_SOCKET;
+	ch->cmsg_type = SCM_RIGHTS;
+	*(int *)CMSG_DATA(ch) = fd;
+
+	if (sendmsg(get_service_fd(LAZY_PAGES_SK_OFF), &mh, 0) < 0) {
+		pr_perror("Can't send userfaultfd to lazy pages daemon");
+		goto out_close;
+	}
+
+	pr_info("Sent %u lazy VMAs of %d\n", req.nr_vmas, pid);
+	*uffd = fd;
+	ret = 0;
+out:
+	xfree(r);
+	return ret;
+
+out_close:
+	close(fd);
+	goto out;
+}
+
+/* A run of pages in pages image, that is to be fed via userfaultfd */
+struct lazy_iov {
+	unsigned long	start;
+	unsigned long	end;
+	int		fd;		/* pages or store image */
+	off_t		off;
+};
+
+struct lazy_task {
+	int			pid;
+	int			uffd;
+	struct page_read	pr;
+
+	struct lazy_iov		*iovs;
+	int			nr_iovs;
+	int			max_iovs;
+
+	int			push;		/* iov being pushed in background */
+	unsigned long		push_addr;
+	bool			registered;	/* restorer has registered VMAs */
+	bool			stale;		/* push failed, events are awaited */
+
+	struct list_head	l;
+};
+
+static LIST_HEAD(lazy_tasks);
+static int nr_lazy_tasks;
+
+static int lazy_task_add_iov(struct lazy_task *t, unsigned long start,
+		unsigned long end, int fd, off_t off)
+{
+	struct lazy_iov *li;
+
+	if (t->nr_iovs == t->max_iovs) {
+		int nr = t->max_iovs ? t->max_iovs * 2 : 16;
+
+		li = xrealloc(t->iovs, nr * sizeof(*li));
+		if (!li)
+			return -1;
+
+		t->iovs = li;
+		t->max_iovs = nr;
+	}
+
+	li = &t->iovs[t->nr_iovs++];
+	li->start = start;
+	li->end = end;
+	li->fd = fd;
+	li->off = off;
+	return 0;
+}
+
+/*
+ * Pages from parent images and those of non-lazy VMAs have been
+ * restored already, collect only the ones lazy VMAs miss. Both
+ * pagemap and VMAs are sorted.
+ */
+static int lazy_task_collect(struct lazy_task *t, struct lazy_pages_range *r, int nr)
+{
+	struct page_read *pr = &t->pr;
+	struct iovec iov;
+	off_t off = 0;
+	int i = 0, j, ret;
+
+	while (1) {
+		unsigned long start, end;
+
+		ret = pr->get_pagemap(pr, &iov);
+		if (ret <= 0)
+			break;
+
+		start = (unsigned long)iov.iov_base;
+		end = start + iov.iov_len;
+
+		if (pr->pe->has_compressed_size)
+			/* Restored eagerly, see can_lazy_pages() */
+			off += pr->pe->compressed_size;
+		else if (!pr->pe->in_parent) {
+			int fd = pr->fd_pg;
+			off_t base = off;
+
+			if (pr->pe->has_store_page) {
+				fd = pr->fd_store;
+				base = pr->pe->store_page * PAGE_SIZE;
+			} else
+				off += iov.iov_len;
+
+			while (i < nr && r[i].end <= start)
+				i++;
+
+			for (j = i; j < nr && r[j].start < end; j++) {
+				unsigned long s, e;
+
+				s = max(start, (unsigned long)r[j].start);
+				e = min(end, (unsigned long)r[j].end);
+
+				ret = lazy_task_add_iov(t, s, e, fd, base + s - start);
+				if (ret)
+					break;
+			}
+		}
+
+		pr->put_pagemap(pr);
+		if (ret)
+			break;
+	}
+
+	if (t->nr_iovs)
+		t->push_addr = t->iovs[0].start;
+
+	return ret;
+}
+
+static struct lazy_iov *lazy_task_find_iov(struct lazy_task *t, unsigned long addr)
+{
+	int l = 0, r = t->nr_iovs - 1;
+
+	while (l <= r) {
+		int m = (l + r) / 2;
+
+		if (addr < t->iovs[m].start)
+			r = m - 1;
+		else if (addr >= t->iovs[m].end)
+			l = m + 1;
+		else
+			return &t->iovs[m];
+	}
+
+	return NULL;
+}
+
+static int cmp_lazy_iov(const void *a, const void *b)
+{
+	const struct lazy_iov *x = a, *y = b;
+
+	if (x->start == y->start)
+		return 0;
+
+	return x->start < y->start ? -1 : 1;
+}
+
+/*
+ * Pages behind the push cursor are in memory already and go with
+ * it on fork or remap, so only the rest is to be moved or cut.
+ */
+static void lazy_task_trim_pushed(struct lazy_task *t)
+{
+	if (t->push == t->nr_iovs) {
+		t->nr_iovs = t->push = 0;
+		return;
+	}
+
+	t->nr_iovs -= t->push;
+	memmove(t->iovs, t->iovs + t->push, t->nr_iovs * sizeof(*t->iovs));
+	t->push = 0;
+
+	t->iovs[0].off += t->push_addr - t->iovs[0].start;
+	t->iovs[0].start = t->push_addr;
+}
+
+static void lazy_task_reset_push(struct lazy_task *t)
+{
+	t->push = 0;
+	if (t->nr_iovs)
+		t->push_addr = t->iovs[0].start;
+}
+
+/* Cuts [start, end) out of iovs, the pieces cut go to @cut if it's set */
+static int lazy_task_cut(struct lazy_task *t, unsigned long start,
+		unsigned long end, struct lazy_task *cut)
+{
+	struct lazy_iov *old = t->iovs;
+	int i, nr = t->nr_iovs, ret = 0;
+
+	t->iovs = NULL;
+	t->nr_iovs = t->max_iovs = 0;
+
+	for (i = 0; i < nr && !ret; i++) {
+		struct lazy_iov *li = &old[i];
+		unsigned long s, e;
+
+		s = max(li->start, start);
+		e = min(li->end, end);
+		if (s >= e) {
+			ret = lazy_task_add_iov(t, li->start, li->end, li->fd, li->off);
+			continue;
+		}
+
+		if (li->start < s)
+			ret = lazy_task_add_iov(t, li->start, s, li->fd, li->off);
+		if (!ret && e < li->end)
+			ret = lazy_task_add_iov(t, e, li->end, li->fd, li->off + e - li->start);
+		if (!ret && cut)
+			ret = lazy_task_add_iov(cut, s, e, li->fd, li->off + s - li->start);
+	}
+
+	xfree(old);
+	return ret;
+}
+
+/* The range was MADV_DONTNEED-ed or unmapped, its pages are zero or gone */
+static int lazy_task_remove(struct lazy_task *t, unsigned long start, unsigned long end)
+{
+	int ret;
+
+	pr_debug("Dropping lazy pages %lx-%lx of %d\n", start, end, t->pid);
+
+	lazy_task_trim_pushed(t);
+	ret = lazy_task_cut(t, start, end, NULL);
+	lazy_task_reset_push(t);
+
+	return ret;
+}
+
+static int lazy_task_remap(struct lazy_task *t, unsigned long from,
+		unsigned long to, unsigned long len)
+{
+	struct lazy_task moved = { };
+	int i, ret;
+
+	pr_debug("Moving lazy pages %lx-%lx of %d to %lx\n",
+			from, from + len, t->pid, to);
+
+	lazy_task_trim_pushed(t);
+	ret = lazy_task_cut(t, from, from + len, &moved);
+	if (!ret)
+		ret = lazy_task_cut(t, to, to + len, NULL);
+
+	for (i = 0; !ret && i < moved.nr_iovs; i++) {
+		struct lazy_iov *li = &moved.iovs[i];
+
+		ret = lazy_task_add_iov(t, li->start - from + to,
+				li->end - from + to, li->fd, li->off);
+	}
+
+	xfree(moved.iovs);
+	qsort(t->iovs, t->nr_iovs, sizeof(*t->iovs), cmp_lazy_iov);
+	lazy_task_reset_push(t);
+
+	return ret;
+}
+
+/*
+ * The child's copy of lazy VMAs is registered with a new userfaultfd
+ * and misses the same pages as the parent, so it's served the same
+ * way. Its pid is not reported, it's logged as the parent.
+ */
+static int lazy_task_fork(struct lazy_task *t, int uffd)
+{
+	struct lazy_task *c;
+	int i;
+
+	c = xzalloc(sizeof(*c));
+	if (!c)
+		goto err;
+
+	c->pid = t->pid;
+	c->uffd = uffd;
+	c->registered = true;
+
+	if (open_page_read(t->pid, &c->pr, O_RSTR, PR_TASK))
+		goto err_free;
+
+	lazy_task_trim_pushed(t);
+	for (i = 0; i < t->nr_iovs; i++) {
+		struct lazy_iov *li = &t->iovs[i];
+		int fd = li->fd == t->pr.fd_pg ? c->pr.fd_pg : c->pr.fd_store;
+
+		if (lazy_task_add_iov(c, li->start, li->end, fd, li->off)) {
+			c->pr.close(&c->pr);
+			xfree(c->iovs);
+			goto err_free;
+		}
+	}
+	lazy_task_reset_push(c);
+
+	/* Not to meet it in the current walk over tasks */
+	list_add(&c->l, &lazy_tasks);
+	nr_lazy_tasks++;
+
+	pr_info("Adopted userfaultfd of a child of %d with %d lazy iovs\n",
+			t->pid, c->nr_iovs);
+	return 0;
+
+err_free:
+	xfree(c);
+err:
+	close(uffd);
+	return -1;
+}
+
+/* Returns 0 on success or negative errno from userfaultfd */
+static int uffd_copy(struct lazy_task *t, unsigned long addr,
+		unsigned long nr, int fd, off_t off)
+{
+	static char buf[LAZY_PAGES_CHUNK * PAGE_SIZE];
+	unsigned long len = nr * PAGE_SIZE;
+	struct uffdio_copy uc;
+
+	BUG_ON(nr > LAZY_PAGES_CHUNK);
+
+	if (pread(fd, buf, len, off) != len) {
+		pr_perror("Can't read %lu lazy pages of %d", nr, t->pid);
+		return -EIO;
+	}
+
+	uc.dst = addr;
+	uc.src = (unsigned long)buf;
+	uc.len = len;
+	uc.mode = 0;
+	uc.copy = 0;
+
+	if (ioctl(t->uffd, UFFDIO_COPY, &uc))
+		return -errno;
+
+	return 0;
+}
+
+static int uffd_zero(struct lazy_task *t, unsigned long addr)
+{
+	struct uffdio_zeropage uz;
+
+	uz.range.start = addr;
+	uz.range.len = PAGE_SIZE;
+	uz.mode = 0;
+
+	if (ioctl(t->uffd, UFFDIO_ZEROPAGE, &uz))
+		return -errno;
+
+	return 0;
+}
+
+static int lazy_task_fault(struct lazy_task *t, unsigned long addr)
+{
+	struct lazy_iov *li;
+	int ret;
+
+	addr &= PAGE_MASK;
+
+	li = lazy_task_find_iov(t, addr);
+	if (li)
+		ret = uffd_copy(t, addr, 1, li->fd, li->off + addr - li->start);
+	else
+		/* Page wasn't dumped, so it's zero */
+		ret = uffd_zero(t, addr);
+
+	/*
+	 * Pushed in background meanwhile, or the mm is changing
+	 * under us, or the range is gone. Wake the task up, it
+	 * either finds the page or faults again.
+	 */
+	if (ret == -EEXIST || ret == -EAGAIN || ret == -ENOENT) {
+		if (ret != -EEXIST)
+			pr_debug("Refault at %lx of %d: %d\n", addr, t->pid, ret);
+
+		struct uffdio_range range = { .start = addr, .len = PAGE_SIZE, };
+
+		if (ioctl(t->uffd, UFFDIO_WAKE, &range))
+			ret = -errno;
+		else
+			ret = 0;
+	}
+
+	if (ret) {
+		pr_err("Can't serve fault at %lx of %d: %d\n", addr, t->pid, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lazy_task_events(struct lazy_task *t)
+{
+	struct uffd_msg msg;
+	int ret;
+
+	while (1) {
+		ret = read(t->uffd, &msg, sizeof(msg));
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+
+			pr_perror("Can't read userfaultfd of %d", t->pid);
+			return -1;
+		}
+
+		if (ret != sizeof(msg)) {
+			pr_err("Short read (%d) from userfaultfd of %d\n", ret, t->pid);
+			return -1;
+		}
+
+		switch (msg.event) {
+		case UFFD_EVENT_PAGEFAULT:
+			t->registered = true;
+			ret = lazy_task_fault(t, msg.arg.pagefault.address);
+			break;
+		case UFFD_EVENT_FORK:
+			ret = lazy_task_fork(t, msg.arg.fork.ufd);
+			break;
+		case UFFD_EVENT_REMAP:
+			ret = lazy_task_remap(t, msg.arg.remap.from,
+					msg.arg.remap.to, msg.arg.remap.len);
+			break;
+		case UFFD_EVENT_REMOVE:
+		case UFFD_EVENT_UNMAP:
+			ret = lazy_task_remove(t, msg.arg.remove.start,
+					msg.arg.remove.end);
+			break;
+		default:
+			pr_err("Unexpected userfaultfd event %u from %d\n",
+					msg.event, t->pid);
+			return -1;
+		}
+
+		if (ret)
+			return -1;
+
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			t->stale = false;
+	}
+}
+
+/*
+ * Pushes next chunk of pages in background. Returns 1 if there
+ * are more pages to push, 0 when all is done and -1 on error.
+ */
+static int lazy_task_push(struct lazy_task *t)
+{
+	struct lazy_iov *li;
+	unsigned long nr, i;
+	off_t off;
+	int ret;
+
+	if (t->push == t->nr_iovs)
+		return 0;
+
+	li = &t->iovs[t->push];
+	nr = min((unsigned long)LAZY_PAGES_CHUNK, (li->end - t->push_addr) / PAGE_SIZE);
+	off = li->off + t->push_addr - li->start;
+
+	ret = uffd_copy(t, t->push_addr, nr, li->fd, off);
+	if (ret == -EEXIST) {
+		/* Some pages were faulted in already, go one by one */
+		for (i = 0; i < nr; i++) {
+			ret = uffd_copy(t, t->push_addr + i * PAGE_SIZE, 1,
+					li->fd, off + i * PAGE_SIZE);
+			if (ret && ret != -EEXIST)
+				break;
+			ret = 0;
+		}
+	}
+
+	if (ret == -ENOENT && !t->registered)
+		/* Restorer hasn't got to VMAs registration yet */
+		return 1;
+	if (ret == -ESRCH) {
+		pr_info("Task %d exited with lazy pages pending\n", t->pid);
+		return 0;
+	}
+	if (ret == -EAGAIN)
+		/* The mm is changing, events about it are on their way */
+		return 1;
+	if (ret == -ENOENT) {
+		/*
+		 * The range is gone, so an unmap or remap event is queued
+		 * already. Retry after reading it, failing again means we
+		 * have lost track of the task's memory.
+		 */
+		if (t->stale) {
+			pr_err("Lazy pages at %lx of %d are not mapped\n",
+					t->push_addr, t->pid);
+			return -1;
+		}
+
+		t->stale = true;
+		return 1;
+	}
+	if (ret) {
+		pr_err("Can't push lazy pages at %lx of %d: %d\n",
+				t->push_addr, t->pid, ret);
+		return -1;
+	}
+
+	t->registered = true;
+	t->push_addr += nr * PAGE_SIZE;
+	if (t->push_addr == li->end && ++t->push < t->nr_iovs)
+		t->push_addr = t->iovs[t->push].start;
+
+	return t->push < t->nr_iovs;
+}
+
+static void lazy_task_fini(struct lazy_task *t)
+{
+	pr_info("Done with lazy pages of %d\n", t->pid);
+
+	list_del(&t->l);
+	nr_lazy_tasks--;
+
+	t->pr.close(&t->pr);
+	close(t->uffd);
+	xfree(t->iovs);
+	xfree(t);
+}
+
+static int lazy_pages_recv(int sk)
+{
+	static char buf[sizeof(struct lazy_pages_req) +
+			LAZY_PAGES_MAX_VMAS * sizeof(struct lazy_pages_range)];
+	struct lazy_pages_req *req = (struct lazy_pages_req *)buf;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh = { };
+	struct lazy_task *t;
+	struct cmsghdr *ch;
+	struct iovec iov;
+	int ret, uffd;
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(sk, &mh, 0);
+	if (ret <= 0) {
+		if (ret < 0)
+			pr_perror("Can't receive lazy pages request");
+		return ret;
+	}
+
+	ch = CMSG_FIRSTHDR(&mh);
+	if (!ch || ch->cmsg_type != SCM_RIGHTS ||
+	    ch->cmsg_len != CMSG_LEN(sizeof(int))) {
+		pr_err("No userfaultfd in lazy pages request\n");
+		return -1;
+	}
+
+	uffd = *(int *)CMSG_DATA(ch);
+
+	if (ret < sizeof(*req) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+	    ret != sizeof(*req) + req->nr_vmas * sizeof(struct lazy_pages_range)) {
+		pr_err("Malformed lazy pages request (%d bytes)\n", ret);
+		goto err;
+	}
+
+	t = xzalloc(sizeof(*t));
+	if (!t)
+		goto err;
+
+	t->pid = req->pid;
+	t->uffd = uffd;
+
+	if (open_page_read(t->pid, &t->pr, O_RSTR, PR_TASK)) {
+		xfree(t);
+		goto err;
+	}
+
+	list_add_tail(&t->l, &lazy_tasks);
+	nr_lazy_tasks++;
+
+	if (lazy_task_collect(t, (struct lazy_pages_range *)(req + 1), req->nr_vmas)) {
+		lazy_task_fini(t);
+		return -1;
+	}
+
+	pr_info("Serving %d lazy iovs of %d\n", t->nr_iovs, t->pid);
+	return 1;
+
+err:
+	close(uffd);
+	return -1;
+}
+
+static int lazy_pages_serve(int sk)
+{
+	struct pollfd *pfd = NULL;
+	struct lazy_task *t, *tmp;
+	int ret = 0;
+
+	while (sk >= 0 || nr_lazy_tasks) {
+		int i, timeout = -1;
+		bool busy = false;
+
+		xfree(pfd);
+		pfd = xmalloc((nr_lazy_tasks + 1) * sizeof(*pfd));
+		if (!pfd)
+			return -1;
+
+		pfd[0].fd = sk;
+		pfd[0].events = POLLIN;
+		i = 1;
+		list_for_each_entry(t, &lazy_tasks, l) {
+			pfd[i].fd = t->uffd;
+			pfd[i].events = POLLIN;
+			i++;
+
+			if (t->push == t->nr_iovs)
+				continue;
+			if (t->registered)
+				timeout = 0;
+			else if (timeout)
+				timeout = LAZY_PAGES_RETRY;
+		}
+
+		ret = poll(pfd, nr_lazy_tasks + 1, timeout);
+		if (ret < 0) {
+			pr_perror("Can't poll lazy pages fds");
+			break;
+		}
+
+		/* Faults go first */
+		i = 1;
+		list_for_each_entry_safe(t, tmp, &lazy_tasks, l) {
+			short revents = pfd[i++].revents;
+
+			if (revents & POLLIN) {
+				ret = lazy_task_events(t);
+				if (ret)
+					goto out;
+				busy = true;
+			} else if (revents & (POLLHUP | POLLERR))
+				lazy_task_fini(t);
+		}
+
+		if (pfd[0].revents) {
+			ret = lazy_pages_recv(sk);
+			if (ret < 0)
+				break;
+			if (ret == 0) {
+				pr_info("Restore has finished\n");
+				close_safe(&sk);
+			}
+			busy = true;
+		}
+
+		if (busy)
+			continue;
+
+		list_for_each_entry_safe(t, tmp, &lazy_tasks, l) {
+			ret = lazy_task_push(t);
+			if (ret < 0)
+				goto out;
+			if (ret == 0)
+				lazy_task_fini(t);
+		}
+	}
+out:
+	xfree(pfd);
+	close_safe(&sk);
+
+	list_for_each_entry_safe(t, tmp, &lazy_tasks, l)
+		lazy_task_fini(t);
+
+	return ret < 0 ? -1 : 0;
+}
+
+int cr_lazy_pages(bool daemon_mode)
+{
+	struct sockaddr_un addr;
+	int sk, ask, ret;
+
+	if (lazy_pages_addr(&addr))
+		return -1;
+
+	pr_info("Starting lazy pages daemon at %s\n", addr.sun_path);
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		pr_perror("Can't create lazy pages socket");
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	if (bind(sk, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_perror("Can't bind lazy pages socket");
+		goto out;
+	}
+
+	if (listen(sk, 1)) {
+		pr_perror("Can't listen on lazy pages socket");
+		goto out;
+	}
+
+	if (daemon_mode) {
+		ret = cr_daemon(1, 0);
+		if (ret == -1) {
+			pr_perror("Can't run in the background");
+			goto out;
+		}
+		if (ret > 0) /* parent task, daemon started */
+			return ret;
+	}
+
+	if (opts.pidfile) {
+		if (write_pidfile(getpid()) == -1) {
+			pr_perror("Can't write pidfile");
+			return -1;
+		}
+	}
+
+	ask = accept(sk, NULL, NULL);
+	if (ask < 0)
+		pr_perror("Can't accept lazy pages connection");
+
+	close(sk);
+	unlink(addr.sun_path);
+
+	ret = ask < 0 ? -1 : lazy_pages_serve(ask);
+
+	if (daemon_mode)
+		exit(ret);
+
+	return ret;
+
+out:
+	close(sk);
+	return -1;
+}
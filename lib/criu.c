@@ -22,6 +22,9 @@ static CriuOpts *opts;
 static int (*notify)(char *action, criu_notify_arg_t na);
 static int saved_errno;
 
+static unsigned int predump_downtime;	/* msec */
+static unsigned long predump_prev_written;
+
 void criu_set_service_address(char *path)
 {
 	if (path)
@@ -526,6 +529,68 @@ exit:
 	return ret;
 }
 
+unsigned long criu_predump_pages_scanned(criu_predump_info pi)
+{
+	return pi ? pi->pages_scanned : 0;
+}
+
+unsigned long criu_predump_pages_skipped(criu_predump_info pi)
+{
+	return pi ? pi->pages_skipped_parent : 0;
+}
+
+unsigned long criu_predump_pages_written(criu_predump_info pi)
+{
+	return pi ? pi->pages_written : 0;
+}
+
+unsigned int criu_predump_frozen_time(criu_predump_info pi)
+{
+	return pi ? pi->frozen_time : 0;
+}
+
+unsigned int criu_predump_memwrite_time(criu_predump_info pi)
+{
+	return pi ? pi->memwrite_time : 0;
+}
+
+unsigned long criu_predump_dirty_rate(criu_predump_info pi)
+{
+	return (pi && pi->has_dirty_rate) ? pi->dirty_rate : 0;
+}
+
+void criu_set_predump_downtime(unsigned int msec)
+{
+	predump_downtime = msec;
+}
+
+/* Dirty set is considered not shrinking if it goes down by less than 1/8 */
+#define PREDUMP_SHRINK_SHIFT	3
+
+bool criu_predump_converged(criu_predump_info pi)
+{
+	unsigned long written, prev = predump_prev_written;
+
+	if (!pi)
+		return false;
+
+	written = pi->pages_written;
+	predump_prev_written = written;
+
+	/*
+	 * The final dump freezes tasks for about the same time the
+	 * iteration did and writes a similar or smaller dirty set.
+	 */
+	if (predump_downtime &&
+	    pi->frozen_time + pi->memwrite_time <= predump_downtime * 1000ULL)
+		return true;
+
+	if (prev && written > prev - (prev >> PREDUMP_SHRINK_SHIFT))
+		return true;
+
+	return false;
+}
+
 int criu_dump_iters(int (*more)(criu_predump_info pi))
 {
 	int ret = -1, fd = -1, uret;
@@ -553,6 +618,7 @@ int criu_dump_iters(int (*more)(criu_predump_info pi))
 	if (fd < 0)
 		goto exit;
 
+	predump_prev_written = 0;
 	while (1) {
 		ret = send_req_and_recv_resp_sk(fd, &req, &resp);
 		if (ret)
@@ -563,7 +629,7 @@ int criu_dump_iters(int (*more)(criu_predump_info pi))
 			goto exit;
 		}
 
-		uret = more(NULL);
+		uret = more(resp->predump);
 		if (uret < 0) {
 			ret = uret;
 			goto exit;
@@ -103,9 +103,29 @@ int criu_restore_child(void);
  *     back from criu_dump_iters
  *
  * The @pi argument is an opaque value that caller may
- * use to request pre-dump statistics (not yet implemented).
+ * pass into criu_predump_xxx() calls to fetch statistics
+ * of the iteration just finished.
  */
-typedef void *criu_predump_info;
+typedef struct _CriuPredumpStats *criu_predump_info;
 int criu_dump_iters(int (*more)(criu_predump_info pi));
 
+unsigned long criu_predump_pages_scanned(criu_predump_info pi);
+unsigned long criu_predump_pages_skipped(criu_predump_info pi);
+unsigned long criu_predump_pages_written(criu_predump_info pi);
+/* Time tasks were frozen for and time of pages writing, in usec */
+unsigned int criu_predump_frozen_time(criu_predump_info pi);
+unsigned int criu_predump_memwrite_time(criu_predump_info pi);
+/* Pages dirtied per second, 0 if not known (first iteration) */
+unsigned long criu_predump_dirty_rate(criu_predump_info pi);
+
+/*
+ * Auto-converge helper for the ->more callback. Returns true when
+ * further iterations are not worth it, i.e. when the set of pages
+ * written has stopped shrinking or when it looks like the final
+ * dump fits the downtime budget set by criu_set_predump_downtime
+ * (in msec, 0 means no budget).
+ */
+void criu_set_predump_downtime(unsigned int msec);
+bool criu_predump_converged(criu_predump_info pi);
+
 #endif /* __CRIU_LIB_H__ */
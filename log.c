@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -27,6 +28,21 @@ static unsigned int current_loglevel = DEFAULT_LOGLEVEL;
 static char buffer[PAGE_SIZE];
 static char buf_off = 0;
 
+/*
+ * Messages are collected in log_buf and written with one call when
+ * it gets full, so that debug lines in hot loops don't cost us a
+ * syscall each. Warnings and errors flush it at once, so does exit.
+ *
+ * After fork or clone the child inherits whatever parent has not yet
+ * written, so the buffer is marked with the pid it belongs to and
+ * is dropped by anyone else (the parent writes it itself).
+ */
+#define LOG_BUF_SIZE	(256 * PAGE_SIZE)
+
+static char log_buf[LOG_BUF_SIZE];
+static unsigned int log_buf_len;
+static pid_t log_buf_pid;
+
 static struct timeval start;
 /*
  * Manual buf len as sprintf will _always_ put '\0' at the end,
@@ -63,6 +79,34 @@ int log_get_fd(void)
 	return fd < 0 ? DEFAULT_LOGFD : fd;
 }
 
+static void log_buf_own(void)
+{
+	pid_t pid = getpid();
+
+	if (log_buf_pid != pid) {
+		log_buf_pid = pid;
+		log_buf_len = 0;
+	}
+}
+
+void log_flush(void)
+{
+	unsigned int off = 0;
+	int fd, ret;
+
+	log_buf_own();
+
+	fd = log_get_fd();
+	while (off < log_buf_len) {
+		ret = write(fd, log_buf + off, log_buf_len - off);
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+
+	log_buf_len = 0;
+}
+
 static void reset_buf_off(void)
 {
 	if (current_loglevel >= LOG_TIMESTAMP)
@@ -74,11 +118,19 @@ static void reset_buf_off(void)
 
 int log_init(const char *output)
 {
+	static bool flush_at_exit;
 	int new_logfd, fd;
 
 	gettimeofday(&start, NULL);
 	reset_buf_off();
 
+	/* What's collected so far goes to the old log */
+	log_flush();
+	if (!flush_at_exit) {
+		atexit(log_flush);
+		flush_at_exit = true;
+	}
+
 	if (output) {
 		new_logfd = open(output, O_CREAT|O_TRUNC|O_WRONLY|O_APPEND, 0600);
 		if (new_logfd < 0) {
@@ -130,6 +182,7 @@ int log_init_by_pid(void)
 
 void log_fini(void)
 {
+	log_flush();
 	close_service_fd(LOG_FD_OFF);
 }
 
@@ -148,28 +201,48 @@ unsigned int log_get_loglevel(void)
 
 static void __print_on_level(unsigned int loglevel, const char *format, va_list params)
 {
-	int fd, size, ret, off = 0;
+	int fd, size, ret, off;
+	char *msg;
 
 	if (unlikely(loglevel == LOG_MSG)) {
 		fd = STDOUT_FILENO;
 		off = buf_off; /* skip dangling timestamp */
-	} else {
-		if (loglevel > current_loglevel)
-			return;
-		fd = log_get_fd();
-		if (current_loglevel >= LOG_TIMESTAMP)
-			print_ts();
-	}
 
-	size  = vsnprintf(buffer + buf_off, PAGE_SIZE - buf_off, format, params);
-	size += buf_off;
+		size  = vsnprintf(buffer + buf_off, PAGE_SIZE - buf_off, format, params);
+		size += buf_off;
 
-	while (off < size) {
-		ret = write(fd, buffer + off, size - off);
-		if (ret <= 0)
-			break;
-		off += ret;
+		while (off < size) {
+			ret = write(fd, buffer + off, size - off);
+			if (ret <= 0)
+				break;
+			off += ret;
+		}
+
+		return;
 	}
+
+	if (loglevel > current_loglevel)
+		return;
+
+	log_buf_own();
+	if (log_buf_len + PAGE_SIZE > LOG_BUF_SIZE)
+		log_flush();
+
+	if (current_loglevel >= LOG_TIMESTAMP)
+		print_ts();
+
+	/* Timestamp and pid prefix are kept in buffer */
+	msg = log_buf + log_buf_len;
+	memcpy(msg, buffer, buf_off);
+
+	size = vsnprintf(msg + buf_off, PAGE_SIZE - buf_off, format, params);
+	if (size >= PAGE_SIZE - buf_off)
+		size = PAGE_SIZE - buf_off - 1;
+	if (size > 0)
+		log_buf_len += buf_off + size;
+
+	if (loglevel <= LOG_WARN)
+		log_flush();
 }
 
 void print_on_level(unsigned int loglevel, const char *format, ...)
@@ -1,6 +1,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
 
@@ -57,12 +58,21 @@ int do_task_reset_dirty_track(int pid)
 	return 0;
 }
 
+static unsigned long dump_pages_nr_iovs(struct vm_area_list *vmas)
+{
+	return min(vmas->priv_size + 1, (unsigned long)PAGE_PIPE_MAX_IOVS);
+}
+
 unsigned int dump_pages_args_size(struct vm_area_list *vmas)
 {
-	/* In the worst case I need one iovec for each page */
+	/*
+	 * In the worst case I need one iovec for each page, but
+	 * page-pipe reuses them (see PAGE_PIPE_MAX_IOVS), so the
+	 * area isn't bigger, than this, even for huge tasks.
+	 */
 	return sizeof(struct parasite_dump_pages_args) +
 		vmas->nr * sizeof(struct parasite_vma_entry) +
-		(vmas->priv_size + 1) * sizeof(struct iovec);
+		dump_pages_nr_iovs(vmas) * sizeof(struct iovec);
 }
 
 static inline bool should_dump_page(VmaEntry *vmae, u64 pme)
@@ -194,42 +204,230 @@ static struct parasite_dump_pages_args *prep_dump_pages_args(struct parasite_ctl
 	return args;
 }
 
+/*
+ * With --dump-jobs the pages collected into a page-pipe are written
+ * into images by a forked writer, while criu goes on with the rest
+ * of the tree. Pipes are inherited by the writer, so the pages stay
+ * pinned there till they hit the image. The caller should destroy
+ * the page-pipe and close the xfer after this, as it would do after
+ * the synchronous page_xfer_dump_pages().
+ *
+ * If the xfer is NULL, the pagemap-<id> one is opened by the writer
+ * itself. With page server this is the only option, as each writer
+ * sends pages via its own connection.
+ */
+
+static pid_t *page_writers;
+static int nr_page_writers;
+
+static bool use_page_writers(void)
+{
+	/* Forked writers would share page store file and its flock() */
+	return opts.dump_jobs > 1 && !opts.page_store;
+}
+
+static int wait_page_writer(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) != pid) {
+		pr_perror("Can't wait page writer %d", pid);
+		return -1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_err("Page writer %d failed (status %#x)\n", pid, status);
+		return -1;
+	}
+
+	return 0;
+}
+
+int wait_page_writers(void)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < nr_page_writers; i++)
+		if (wait_page_writer(page_writers[i]))
+			ret = -1;
+
+	xfree(page_writers);
+	page_writers = NULL;
+	nr_page_writers = 0;
+
+	return ret;
+}
+
+static int page_xfer_dump_pages_to(struct page_xfer *xfer,
+		struct page_pipe *pp, long id)
+{
+	struct page_xfer own;
+	int ret;
+
+	if (!xfer) {
+		xfer = &own;
+		if (open_page_xfer(xfer, CR_FD_PAGEMAP, id) < 0)
+			return -1;
+	}
+
+	ret = page_xfer_dump_pages(xfer, pp, 0);
+
+	if (xfer == &own && xfer->close(xfer))
+		ret = -1;
+
+	return ret;
+}
+
+int page_xfer_dump_pages_bg(struct page_xfer *xfer, struct page_pipe *pp, long id)
+{
+	struct page_pipe_buf *ppb;
+	struct iovec *iovs;
+	pid_t pid;
+	int ret;
+
+	if (!use_page_writers())
+		return page_xfer_dump_pages_to(xfer, pp, id);
+
+	BUG_ON(xfer && opts.use_page_server);
+
+	if (nr_page_writers == opts.dump_jobs) {
+		/* Wait for the oldest one to free the slot */
+		ret = wait_page_writer(page_writers[0]);
+		nr_page_writers--;
+		memmove(page_writers, page_writers + 1,
+				nr_page_writers * sizeof(pid_t));
+		if (ret)
+			return -1;
+	} else if (xrealloc_safe(&page_writers,
+				(nr_page_writers + 1) * sizeof(pid_t)))
+		return -1;
+
+	/*
+	 * The pagemap head may still sit in our write buffer, both
+	 * the writer and we would flush it into the shared offset.
+	 */
+	if (xfer && img_buf_flush(xfer->fd))
+		return -1;
+
+	/*
+	 * The iovs live in the parasite args area, which is
+	 * shared with the dumpee and will be overwritten by
+	 * the next parasite commands. Give the writer its
+	 * own copy of them.
+	 */
+	iovs = xmalloc(pp->free_iov * sizeof(struct iovec));
+	if (!iovs)
+		return -1;
+
+	memcpy(iovs, pp->iovs, pp->free_iov * sizeof(struct iovec));
+	list_for_each_entry(ppb, &pp->bufs, l)
+		ppb->iov = iovs + (ppb->iov - pp->iovs);
+	pp->iovs = iovs;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork page writer");
+		xfree(iovs);
+		return -1;
+	}
+
+	if (pid == 0) {
+		if (connect_to_page_server_stream())
+			exit(1);
+
+		ret = page_xfer_dump_pages_to(xfer, pp, id);
+		if (xfer && xfer->close(xfer))
+			ret = -1;
+
+		if (disconnect_from_page_server())
+			ret = -1;
+
+		exit(ret ? 1 : 0);
+	}
+
+	pr_info("Started page writer %d (%d running)\n", pid, nr_page_writers + 1);
+	page_writers[nr_page_writers++] = pid;
+	xfree(iovs);
+	return 0;
+}
+
+/* Asks parasite to splice pages of ppb into its pipe */
+static int start_drain_ppb(struct page_pipe_buf *ppb, struct parasite_ctl *ctl,
+			struct parasite_dump_pages_args *args)
+{
+	args->nr_segs = ppb->nr_segs;
+	args->nr_pages = ppb->pages_in;
+	pr_debug("PPB: %d pages %d segs %u pipe %d off\n",
+			args->nr_pages, args->nr_segs, ppb->pipe_size, args->off);
+
+	if (__parasite_execute_daemon(PARASITE_CMD_DUMPPAGES, ctl) < 0)
+		return -1;
+
+	return parasite_send_fd(ctl, ppb->p[1]);
+}
+
+static int wait_drain_ppb(struct parasite_ctl *ctl,
+			struct parasite_dump_pages_args *args)
+{
+	if (__parasite_wait_daemon_ack(PARASITE_CMD_DUMPPAGES, ctl) < 0)
+		return -1;
+
+	/* Parasite is done with args, can prepare the next ppb */
+	args->off += args->nr_segs;
+	return 0;
+}
+
+static int write_ppb(struct page_xfer *xfer, struct page_pipe *pp,
+			struct page_pipe_buf *ppb, struct iovec **hole)
+{
+	int ret;
+
+	timing_start(TIME_MEMWRITE);
+	ret = page_xfer_dump_ppb(xfer, pp, ppb, hole, 0);
+	timing_stop(TIME_MEMWRITE);
+
+	return ret;
+}
+
 static int dump_pages(struct page_pipe *pp, struct parasite_ctl *ctl,
 			struct parasite_dump_pages_args *args, struct page_xfer *xfer)
 {
-	struct page_pipe_buf *ppb;
+	struct page_pipe_buf *ppb, *prev = NULL;
+	struct iovec *hole = page_pipe_first_hole(pp);
 	int ret = 0;
 
 	debug_show_page_pipe(pp);
 
-	/* Step 2 -- grab pages into page-pipe */
+	/*
+	 * Step 2 -- grab pages into page-pipe and write them into
+	 *           image (or delay writing for pre-dump action, see
+	 *           pre_dump_one_task). The previous ppb is written
+	 *           while the parasite splices pages into the next one.
+	 */
 	list_for_each_entry(ppb, &pp->bufs, l) {
-		args->nr_segs = ppb->nr_segs;
-		args->nr_pages = ppb->pages_in;
-		pr_debug("PPB: %d pages %d segs %u pipe %d off\n",
-				args->nr_pages, args->nr_segs, ppb->pipe_size, args->off);
-
-		ret = __parasite_execute_daemon(PARASITE_CMD_DUMPPAGES, ctl);
-		if (ret < 0)
+		if (start_drain_ppb(ppb, ctl, args))
 			return -1;
-		ret = parasite_send_fd(ctl, ppb->p[1]);
-		if (ret)
+
+		if (prev && write_ppb(xfer, pp, prev, &hole)) {
+			/* Don't leave parasite with the command in flight */
+			wait_drain_ppb(ctl, args);
 			return -1;
+		}
 
-		ret = __parasite_wait_daemon_ack(PARASITE_CMD_DUMPPAGES, ctl);
-		if (ret < 0)
+		if (wait_drain_ppb(ctl, args))
 			return -1;
 
-		args->off += args->nr_segs;
+		if (xfer)
+			prev = ppb;
 	}
 
-	/*
-	 * Step 3 -- write pages into image (or delay writing for
-	 *           pre-dump action (see pre_dump_one_task)
-	 */
+	/* Step 3 -- write what's left */
 	if (xfer) {
+		if (prev && write_ppb(xfer, pp, prev, &hole))
+			return -1;
+
 		timing_start(TIME_MEMWRITE);
-		ret = page_xfer_dump_pages(xfer, pp, 0);
+		ret = page_xfer_dump_holes(xfer, pp, &hole);
 		timing_stop(TIME_MEMWRITE);
 	}
 
@@ -245,6 +443,10 @@ static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 	struct page_pipe *pp;
 	struct vma_area *vma_area;
 	struct page_xfer xfer;
+	bool bg = !pp_ret && use_page_writers();
+	bool has_parent = true, own_xfer;
+	unsigned long long ts;
+	bool keep_pp = false;
 	int ret = -1;
 
 	pr_info("\n");
@@ -267,20 +469,33 @@ static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 		return -1;
 
 	ret = -1;
-	pp = create_page_pipe(vma_area_list->priv_size,
-			      pargs_iovs(args), pp_ret == NULL);
+	pp = create_page_pipe(dump_pages_nr_iovs(vma_area_list),
+			      pargs_iovs(args), pp_ret == NULL && !bg);
 	if (!pp)
 		goto out;
 
-	if (pp_ret == NULL) {
+	/*
+	 * Page writers talk to the page server via their own
+	 * connections, so the xfer is opened by them.
+	 */
+	own_xfer = pp_ret == NULL && !(bg && opts.use_page_server);
+	if (own_xfer) {
 		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
 		if (ret < 0)
 			goto out_pp;
+
+		/*
+		 * With page server (as well as for pre-dump) the
+		 * parent is checked when the holes are written.
+		 */
+		if (!opts.use_page_server)
+			has_parent = xfer.parent != NULL;
 	}
 
 	/*
 	 * Step 1 -- generate the pagemap
 	 */
+	ts = trace_start();
 	args->off = 0;
 	list_for_each_entry(vma_area, &vma_area_list->h, list) {
 		u64 off = 0;
@@ -293,28 +508,58 @@ static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 		if (!map)
 			goto out_xfer;
 again:
-		ret = generate_iovs(vma_area, pp, map, &off, xfer.parent);
+		ret = generate_iovs(vma_area, pp, map, &off, has_parent);
 		if (ret == -EAGAIN) {
-			BUG_ON(pp_ret);
+			/*
+			 * Pages kept for later writing are over the limits,
+			 * write them right now and go on in chunks.
+			 */
+			if (!pp->chunk_mode) {
+				pr_info("Page pipe is full, dumping pages in chunks\n");
+				pp->chunk_mode = true;
+			}
+
+			if (!own_xfer) {
+				ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
+				if (ret < 0)
+					goto out_xfer;
+				own_xfer = true;
+			}
 
 			ret = dump_pages(pp, ctl, args, &xfer);
 			if (ret)
 				goto out_xfer;
 			page_pipe_reinit(pp);
+			args->off = 0;
 			goto again;
 		}
 		if (ret < 0)
 			goto out_xfer;
 	}
 
-	ret = dump_pages(pp, ctl, args, pp_ret ? NULL : &xfer);
+	trace_stop(PHASE_PAGEMAP_SCAN, ctl->pid.real, ts);
+
+	/* Page-pipe not in chunk mode is written later */
+	ts = trace_start();
+	ret = dump_pages(pp, ctl, args, pp->chunk_mode ? &xfer : NULL);
+	trace_stop(PHASE_PAGE_SPLICE, ctl->pid.real, ts);
 	if (ret)
 		goto out_xfer;
 
+	if (bg && !pp->chunk_mode) {
+		ret = page_xfer_dump_pages_bg(own_xfer ? &xfer : NULL,
+				pp, ctl->pid.virt);
+		if (ret)
+			goto out_xfer;
+	}
+
 	timing_stop(TIME_MEMDUMP);
 
-	if (pp_ret)
-		*pp_ret = pp;
+	if (pp_ret) {
+		/* Pages are all written already if it went into chunks */
+		keep_pp = !pp->chunk_mode;
+		*pp_ret = keep_pp ? pp : NULL;
+	}
 
 	/*
 	 * Step 4 -- clean up
@@ -322,10 +567,10 @@ again:
 
 	ret = task_reset_dirty_track(ctl->pid.real);
 out_xfer:
-	if (pp_ret == NULL)
-		xfer.close(&xfer);
+	if (own_xfer && xfer.close(&xfer))
+		ret = -1;
 out_pp:
-	if (ret || !pp_ret)
+	if (ret || !keep_pp)
 		destroy_page_pipe(pp);
 out:
 	pmc_fini(&pmc);
@@ -387,17 +632,20 @@ int prepare_mm_pid(struct pstree_item *i)
 	int fd, ret = -1, vn = 0;
 	struct rst_info *ri = i->rst;
 
-	fd = open_image(CR_FD_MM, O_RSTR | O_OPT, pid);
-	if (fd < 0) {
-		if (fd == -ENOENT)
-			return 0;
-		return -1;
-	}
+	/* May be prefetched already */
+	if (!ri->mm) {
+		fd = open_image(CR_FD_MM, O_RSTR | O_OPT, pid);
+		if (fd < 0) {
+			if (fd == -ENOENT)
+				return 0;
+			return -1;
+		}
 
-	ret = pb_read_one(fd, &ri->mm, PB_MM);
-	close(fd);
-	if (ret < 0)
-		return -1;
+		ret = pb_read_one(fd, &ri->mm, PB_MM);
+		close(fd);
+		if (ret < 0)
+			return -1;
+	}
 
 	if (collect_special_file(ri->mm->exe_file_id) == NULL)
 		return -1;
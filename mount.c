@@ -27,6 +27,7 @@
 #include "kerndat.h"
 #include "fs-magic.h"
 #include "sysfs_parse.h"
+#include "tmpfs.h"
 
 #include "protobuf/mnt.pb-c.h"
 
@@ -686,41 +687,18 @@ static int devpts_parse(struct mount_info *pm)
 
 static int tmpfs_dump(struct mount_info *pm)
 {
-	int ret = -1;
-	char tmpfs_path[PSFDS];
-	int fd = -1, fd_img = -1;
+	int ret;
+	int fd;
 
 	fd = open_mountpoint(pm);
 	if (fd < 0)
 		return -1;
 
-	if (fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC) == -1) {
-		pr_perror("Can not drop FD_CLOEXEC");
-		goto out;
-	}
-
-	fd_img = open_image(CR_FD_TMPFS_DEV, O_DUMP, pm->s_dev);
-	if (fd_img < 0)
-		goto out;
-
-	sprintf(tmpfs_path, "/proc/self/fd/%d", fd);
-
-	ret = cr_system(-1, fd_img, -1, "tar", (char *[])
-			{ "tar", "--create",
-			"--gzip",
-			"--one-file-system",
-			"--check-links",
-			"--preserve-permissions",
-			"--sparse",
-			"--numeric-owner",
-			"--directory", tmpfs_path, ".", NULL });
-
+	ret = tmpfs_dump_tree(fd, pm->s_dev);
 	if (ret)
 		pr_err("Can't dump tmpfs content\n");
 
-out:
-	close_safe(&fd_img);
-	close_safe(&fd);
+	close(fd);
 	return ret;
 }
 
@@ -729,6 +707,11 @@ static int tmpfs_restore(struct mount_info *pm)
 	int ret;
 	int fd_img;
 
+	ret = tmpfs_restore_tree(pm->mountpoint, pm->s_dev);
+	if (ret != -ENOENT)
+		return ret;
+
+	/* Images of older versions are tarballs */
 	fd_img = open_image(CR_FD_TMPFS_DEV, O_RSTR, pm->s_dev);
 	if (fd_img < 0 && errno == ENOENT)
 		fd_img = open_image(CR_FD_TMPFS_IMG, O_RSTR, pm->mnt_id);
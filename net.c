@@ -550,7 +550,8 @@ int dump_net_ns(int pid, int ns_id)
 	close(ns_sysfs_fd);
 	ns_sysfs_fd = -1;
 
-	close_cr_fdset(&fds);
+	if (close_cr_fdset(&fds))
+		ret = -1;
 	return ret;
 }
 
@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <string.h>
+
+#ifdef CONFIG_HAS_LZ4
+#include <lz4.h>
+#endif
+
+#include "asm/types.h"
+#include "asm/atomic.h"
+#include "cr_options.h"
+#include "log.h"
+#include "page-compress.h"
+
+#ifdef CONFIG_HAS_LZ4
+int page_compress_init(void)
+{
+	return 0;
+}
+
+unsigned int page_compress_bound(unsigned int len)
+{
+	return LZ4_compressBound(len);
+}
+
+static int compress_chunk(struct page_zchunk *c)
+{
+	unsigned int len = c->nr_pages * PAGE_SIZE;
+	int ret;
+
+	ret = LZ4_compress_default(c->src, c->dst, len, page_compress_bound(len));
+	if (ret <= 0)
+		return -1;
+
+	c->size = ret;
+	return 0;
+}
+
+int page_decompress(void *src, unsigned int size, void *dst, unsigned int len)
+{
+	int ret;
+
+	ret = LZ4_decompress_safe(src, dst, size, len);
+	if (ret != len) {
+		pr_err("Can't decompress %u bytes into %u ones (%d)\n", size, len, ret);
+		return -1;
+	}
+
+	return 0;
+}
+#else
+int page_compress_init(void)
+{
+	pr_err("CRIU is built without lz4, pages can't be compressed\n");
+	return -1;
+}
+
+unsigned int page_compress_bound(unsigned int len)
+{
+	return len;
+}
+
+static int compress_chunk(struct page_zchunk *c)
+{
+	return -1;
+}
+
+int page_decompress(void *src, unsigned int size, void *dst, unsigned int len)
+{
+	pr_err("CRIU is built without lz4, can't decompress pages\n");
+	return -1;
+}
+#endif
+
+struct compress_job {
+	struct page_zchunk	*c;
+	int			nr;
+	atomic_t		next;
+	atomic_t		failed;
+};
+
+/* Runs in threads, so no logging here */
+static void *compress_worker(void *arg)
+{
+	struct compress_job *j = arg;
+	int i;
+
+	while (!atomic_read(&j->failed)) {
+		i = atomic_add_return(1, &j->next) - 1;
+		if (i >= j->nr)
+			break;
+
+		if (compress_chunk(&j->c[i]))
+			atomic_set(&j->failed, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * Chunks are independent, so they are compressed by --compress-jobs
+ * threads in parallel (the caller being one of them). Threads are
+ * only started for the call, the page-pipe buffer a call is made for
+ * is big enough for that not to matter.
+ */
+int page_compress_chunks(struct page_zchunk *c, int nr)
+{
+	pthread_t threads[PAGE_COMPRESS_MAX_JOBS];
+	struct compress_job j = { .c = c, .nr = nr, };
+	int i, nr_threads;
+
+	atomic_set(&j.next, 0);
+	atomic_set(&j.failed, 0);
+
+	nr_threads = min(opts.compress_jobs, nr) - 1;
+	for (i = 0; i < nr_threads; i++) {
+		int ret;
+
+		ret = pthread_create(&threads[i], NULL, compress_worker, &j);
+		if (ret) {
+			pr_warn("Can't start compressing thread: %d\n", ret);
+			nr_threads = i;
+			break;
+		}
+	}
+
+	compress_worker(&j);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (atomic_read(&j.failed)) {
+		pr_err("Can't compress pages\n");
+		return -1;
+	}
+
+	return 0;
+}
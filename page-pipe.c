@@ -6,8 +6,20 @@
 
 #include "config.h"
 #include "util.h"
+#include "cr_options.h"
 #include "page-pipe.h"
 
+/* Pages pinned in all page-pipes */
+static unsigned long pipe_pages;
+
+static bool page_pipe_over_limit(struct page_pipe *pp)
+{
+	if (pp->chunk_mode || !opts.pipe_mem_limit)
+		return false;
+
+	return pipe_pages >= (opts.pipe_mem_limit << 20) / PAGE_SIZE;
+}
+
 /* can existing iov accumulate the page? */
 static inline bool iov_grow_page(struct iovec *iov, unsigned long addr)
 {
@@ -97,6 +109,9 @@ void destroy_page_pipe(struct page_pipe *pp)
 
 	pr_debug("Killing page pipe\n");
 
+	list_for_each_entry(ppb, &pp->bufs, l)
+		pipe_pages -= ppb->pages_in;
+
 	list_splice(&pp->free_bufs, &pp->bufs);
 	list_for_each_entry_safe(ppb, n, &pp->bufs, l) {
 		close(ppb->p[0]);
@@ -115,9 +130,12 @@ void page_pipe_reinit(struct page_pipe *pp)
 
 	pr_debug("Clean up page pipe\n");
 
-	list_for_each_entry_safe(ppb, n, &pp->bufs, l)
+	list_for_each_entry_safe(ppb, n, &pp->bufs, l) {
+		pipe_pages -= ppb->pages_in;
 		list_move(&ppb->l, &pp->free_bufs);
+	}
 
+	pp->free_iov = 0;
 	pp->free_hole = 0;
 
 	if (page_pipe_grow(pp))
@@ -154,13 +172,16 @@ static inline int try_add_page_to(struct page_pipe *pp, struct page_pipe_buf *pp
 			return 1;
 	}
 
+	if (pp->free_iov == pp->nr_iovs)
+		return -EAGAIN;
+
 	pr_debug("Add iov to page pipe (%u iovs, %u/%u total)\n",
 			ppb->nr_segs, pp->free_iov, pp->nr_iovs);
 	iov_init(&ppb->iov[ppb->nr_segs++], addr);
 	pp->free_iov++;
-	BUG_ON(pp->free_iov > pp->nr_iovs);
 out:
 	ppb->pages_in++;
+	pipe_pages++;
 	return 0;
 }
 
@@ -174,6 +195,9 @@ int page_pipe_add_page(struct page_pipe *pp, unsigned long addr)
 {
 	int ret;
 
+	if (page_pipe_over_limit(pp))
+		return -EAGAIN;
+
 	ret = try_add_page(pp, addr);
 	if (ret <= 0)
 		return ret;
@@ -1,11 +1,14 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "image.h"
 #include "cr_options.h"
 #include "servicefd.h"
 #include "page-read.h"
+#include "page-compress.h"
 
 #include "protobuf.h"
 #include "protobuf/pagemap.pb-c.h"
@@ -30,10 +33,12 @@ static int get_page_vaddr(struct page_read *pr, struct iovec *iov)
 	return 1;
 }
 
-static int read_page(struct page_read *pr, unsigned long vaddr, void *buf)
+static int read_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf)
 {
 	int ret;
 
+	BUG_ON(nr != 1);
+
 	ret = read(pr->fd_pg, buf, PAGE_SIZE);
 	if (ret != PAGE_SIZE) {
 		pr_err("Can't read mapping page %d\n", ret);
@@ -74,6 +79,27 @@ static int get_pagemap(struct page_read *pr, struct iovec *iov)
 		return -1;
 	}
 
+	if (pe->has_store_page && pr->fd_store < 0) {
+		pr_err("No page store for pagemap\n");
+		return -1;
+	}
+
+	pr->zvalid = false;
+	if (pe->has_compressed_size) {
+		if (pe->nr_pages > PAGE_COMPRESS_CHUNK) {
+			pr_err("Too many compressed pages %u\n", pe->nr_pages);
+			return -1;
+		}
+
+		/* Pages are decompressed on read, see read_compressed_pages */
+		pr->zoff = lseek(pr->fd_pg, pe->compressed_size, SEEK_CUR);
+		if (pr->zoff < 0) {
+			pr_perror("Can't skip compressed pages");
+			return -1;
+		}
+		pr->zoff -= pe->compressed_size;
+	}
+
 	return 1;
 }
 
@@ -82,7 +108,7 @@ static void put_pagemap(struct page_read *pr)
 	pagemap_entry__free_unpacked(pr->pe, NULL);
 }
 
-static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, void *buf);
+static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf);
 
 static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 {
@@ -90,7 +116,8 @@ static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 		return;
 
 	pr_debug("\tpr%u Skip %lx bytes from page-dump\n", pr->id, len);
-	if (!pr->pe->in_parent)
+	if (!pr->pe->in_parent && !pr->pe->has_store_page &&
+	    !pr->pe->has_compressed_size)
 		lseek(pr->fd_pg, len, SEEK_CUR);
 	pr->cvaddr += len;
 }
@@ -132,38 +159,193 @@ new_pagemap:
 	}
 }
 
-static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, void *buf)
+static int read_parent_page(struct page_read *ppr, unsigned long vaddr,
+		int nr, void *buf)
 {
 	int ret;
 
-	if (pr->pe->in_parent) {
-		pr_debug("\tpr%u Read page %lx from parent\n", pr->id, vaddr);
-		ret = seek_pagemap_page(pr->parent, vaddr, true);
+	/*
+	 * The run we're asked for can be split between several
+	 * pagemap entries in parent, read them one by one.
+	 */
+	while (nr) {
+		unsigned long pend;
+		int p_nr;
+
+		ret = seek_pagemap_page(ppr, vaddr, true);
 		if (ret <= 0)
 			return -1;
-		ret = read_pagemap_page(pr->parent, vaddr, buf);
+
+		pend = ppr->pe->vaddr + ppr->pe->nr_pages * PAGE_SIZE;
+		p_nr = min((unsigned long)nr, (pend - vaddr) / PAGE_SIZE);
+
+		ret = read_pagemap_page(ppr, vaddr, p_nr, buf);
 		if (ret == -1)
 			return ret;
-	} else {
-		off_t current_vaddr = lseek(pr->fd_pg, 0, SEEK_CUR);
-		pr_debug("\tpr%u Read page %lx from self %lx/%"PRIx64"\n", pr->id,
-				vaddr, pr->cvaddr, current_vaddr);
-		ret = read(pr->fd_pg, buf, PAGE_SIZE);
-		if (ret != PAGE_SIZE) {
-			pr_perror("Can't read mapping page %d", ret);
+
+		nr -= p_nr;
+		vaddr += p_nr * PAGE_SIZE;
+		buf += p_nr * PAGE_SIZE;
+	}
+
+	return 1;
+}
+
+static int read_compressed_pages(struct page_read *pr)
+{
+	unsigned int size = pr->pe->compressed_size;
+	void *buf;
+	int ret = -1;
+
+	if (pr->zvalid)
+		return 0;
+
+	if (!pr->zpages) {
+		pr->zpages = xmalloc(PAGE_COMPRESS_CHUNK * PAGE_SIZE);
+		if (!pr->zpages)
+			return -1;
+	}
+
+	buf = xmalloc(size);
+	if (!buf)
+		return -1;
+
+	if (pread(pr->fd_pg, buf, size, pr->zoff) != size) {
+		pr_perror("Can't read %u bytes of compressed pages", size);
+		goto out;
+	}
+
+	if (page_decompress(buf, size, pr->zpages, pr->pe->nr_pages * PAGE_SIZE))
+		goto out;
+
+	pr->zvalid = true;
+	ret = 0;
+out:
+	xfree(buf);
+	return ret;
+}
+
+static off_t store_offset(struct page_read *pr)
+{
+	return pr->pe->store_page * PAGE_SIZE + pr->cvaddr - pr->pe->vaddr;
+}
+
+static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr, void *buf)
+{
+	unsigned long len = nr * PAGE_SIZE;
+	int ret;
+
+	if (pr->pe->in_parent) {
+		pr_debug("\tpr%u Read %d pages %lx from parent\n", pr->id, nr, vaddr);
+		ret = read_parent_page(pr->parent, vaddr, nr, buf);
+		if (ret == -1)
+			return ret;
+	} else if (pr->pe->has_compressed_size) {
+		/* Pages are not punched out of compressed chunks */
+		pr_debug("\tpr%u Read %d compressed pages %lx\n", pr->id, nr, vaddr);
+		if (read_compressed_pages(pr))
+			return -1;
+		memcpy(buf, pr->zpages + pr->cvaddr - pr->pe->vaddr, len);
+	} else if (pr->pe->has_store_page) {
+		/* Store is shared, nothing is punched out of it */
+		pr_debug("\tpr%u Read %d pages %lx from store\n", pr->id, nr, vaddr);
+		if (pread(pr->fd_store, buf, len, store_offset(pr)) != len) {
+			pr_perror("Can't read %d pages from store", nr);
 			return -1;
 		}
+	} else {
+		off_t current_vaddr = 0;
+		unsigned long done = 0;
+
+		if (pr->auto_dedup)
+			current_vaddr = lseek(pr->fd_pg, 0, SEEK_CUR);
+
+		pr_debug("\tpr%u Read %d pages %lx from self %lx\n", pr->id,
+				nr, vaddr, pr->cvaddr);
+		while (done < len) {
+			ssize_t r;
+
+			r = read(pr->fd_pg, buf + done, len - done);
+			if (r < 0) {
+				pr_perror("Can't read mapping pages");
+				return -1;
+			}
+			if (r == 0) {
+				pr_err("Pages image is truncated, %lu of %lu bytes read\n",
+						done, len);
+				return -1;
+			}
 
-		if (opts.auto_dedup) {
-			ret = punch_hole(pr, current_vaddr, (unsigned int)PAGE_SIZE, false);
+			done += r;
+		}
+
+		if (pr->auto_dedup) {
+			ret = punch_hole(pr, current_vaddr, len, false);
 			if (ret == -1) {
 				return -1;
 			}
 		}
 	}
 
-	pr->cvaddr += PAGE_SIZE;
+	pr->cvaddr += len;
+
+	return 1;
+}
+
+static int map_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
+		void *addr, int prot)
+{
+	unsigned long len = nr * PAGE_SIZE;
+	void *ret;
+	off_t off;
+	int fd;
+
+	/*
+	 * Pages from parent are split between images and the
+	 * dedup-ed ones will be punched out of the file soon.
+	 */
+	if (pr->pe->in_parent || pr->pe->has_compressed_size)
+		return 0;
+
+	if (pr->pe->has_store_page) {
+		fd = pr->fd_store;
+		off = store_offset(pr);
+	} else {
+		if (pr->auto_dedup)
+			return 0;
+
+		fd = pr->fd_pg;
+		off = lseek(fd, 0, SEEK_CUR);
+		if (off < 0) {
+			pr_perror("Can't get pages image position");
+			return -1;
+		}
+	}
+
+	if (off & ~PAGE_MASK)
+		return 0;
+
+	ret = mmap(addr, len, prot, MAP_PRIVATE | MAP_FIXED, fd, off);
+	if (ret == MAP_FAILED) {
+		/* These are checked before touching the old mapping */
+		if (errno == ENODEV || errno == EACCES) {
+			pr_debug("\tpr%u Can't map pages image, reading\n", pr->id);
+			return 0;
+		}
+
+		pr_perror("Can't map %d pages at %p", nr, addr);
+		return -1;
+	}
+
+	pr_debug("\tpr%u Map %d pages %lx from self %lx\n", pr->id,
+			nr, vaddr, pr->cvaddr);
+
+	if (fd == pr->fd_pg && lseek(fd, len, SEEK_CUR) < 0) {
+		pr_perror("Can't skip mapped pages");
+		return -1;
+	}
 
+	pr->cvaddr += len;
 	return 1;
 }
 
@@ -185,10 +367,12 @@ static void close_page_read(struct page_read *pr)
 	}
 
 	close(pr->fd_pg);
-	close(pr->fd);
+	close_safe(&pr->fd_store);
+	xfree(pr->zpages);
+	close_image(pr->fd);
 }
 
-static int try_open_parent(int dfd, int pid, struct page_read *pr, int flags)
+static int try_open_parent(int dfd, int pid, struct page_read *pr, int flags, int pr_type)
 {
 	int pfd;
 	struct page_read *parent = NULL;
@@ -201,7 +385,7 @@ static int try_open_parent(int dfd, int pid, struct page_read *pr, int flags)
 	if (!parent)
 		goto err_cl;
 
-	if (open_page_read_at(pfd, pid, parent, flags, false)) {
+	if (open_page_read_at(pfd, pid, parent, flags, pr_type)) {
 		if (errno != ENOENT)
 			goto err_free;
 		xfree(parent);
@@ -220,27 +404,46 @@ err_cl:
 	return -1;
 }
 
-int open_page_read_at(int dfd, int pid, struct page_read *pr, int flags, bool shmem)
+static const struct {
+	int pagemap;
+	int pages_old;
+} pr_images[] = {
+	[PR_TASK]	= { CR_FD_PAGEMAP,		CR_FD_PAGES_OLD, },
+	[PR_SHMEM]	= { CR_FD_SHMEM_PAGEMAP,	CR_FD_SHM_PAGES_OLD, },
+	[PR_SYSV_SHMEM]	= { CR_FD_SYSV_SHMEM_PAGEMAP,	-1, },
+};
+
+int open_page_read_at(int dfd, int pid, struct page_read *pr, int flags, int pr_type)
 {
 	pr->pe = NULL;
 	pr->parent = NULL;
+	pr->auto_dedup = opts.auto_dedup && (flags & O_ACCMODE) == O_RDWR;
+	pr->fd_store = -1;
+	pr->zpages = NULL;
+	pr->zvalid = false;
 	pr->bunch.iov_len = 0;
 	pr->bunch.iov_base = NULL;
 
-	pr->fd = open_image_at(dfd, shmem ? CR_FD_SHMEM_PAGEMAP : CR_FD_PAGEMAP, O_RSTR, (long)pid);
+	pr->fd = open_image_at(dfd, pr_images[pr_type].pagemap,
+			O_RSTR | O_BUF, (long)pid);
 	if (pr->fd < 0) {
-		pr->fd_pg = open_image_at(dfd, shmem ? CR_FD_SHM_PAGES_OLD : CR_FD_PAGES_OLD, flags, pid);
+		if (pr_images[pr_type].pages_old < 0)
+			return -1;
+
+		pr->fd_pg = open_image_at(dfd, pr_images[pr_type].pages_old, flags, pid);
 		if (pr->fd_pg < 0)
 			return -1;
 
 		pr->get_pagemap = get_page_vaddr;
 		pr->put_pagemap = NULL;
-		pr->read_page = read_page;
+		pr->read_pages = read_page;
+		pr->map_pages = NULL;
+		pr->skip_pages = NULL;
 	} else {
 		static unsigned ids = 1;
 
-		if (!shmem && try_open_parent(dfd, pid, pr, flags)) {
-			close(pr->fd);
+		if (try_open_parent(dfd, pid, pr, flags, pr_type)) {
+			close_image(pr->fd);
 			return -1;
 		}
 
@@ -250,9 +453,21 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int flags, bool sh
 			return -1;
 		}
 
+		pr->fd_store = open_image_at(dfd, CR_FD_PAGES_STORE, O_RSTR | O_OPT);
+		if (pr->fd_store < 0) {
+			if (pr->fd_store != -ENOENT) {
+				pr->fd_store = -1;
+				close_page_read(pr);
+				return -1;
+			}
+			pr->fd_store = -1;
+		}
+
 		pr->get_pagemap = get_pagemap;
 		pr->put_pagemap = put_pagemap;
-		pr->read_page = read_pagemap_page;
+		pr->read_pages = read_pagemap_page;
+		pr->map_pages = map_pagemap_page;
+		pr->skip_pages = skip_pagemap_pages;
 		pr->id = ids++;
 
 		pr_debug("Opened page read %u (parent %u)\n",
@@ -264,7 +479,109 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int flags, bool sh
 	return 0;
 }
 
-int open_page_read(int pid, struct page_read *pr, int flags, bool shmem)
+static int readv_pages(int fd, struct iovec *iov, int nr, off_t off)
+{
+	while (nr) {
+		ssize_t r;
+
+		r = preadv(fd, iov, nr, off);
+		if (r <= 0) {
+			pr_perror("Can't read pages %zd", r);
+			return -1;
+		}
+
+		off += r;
+		while (nr && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+
+		if (nr) {
+			iov->iov_base += r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+static inline bool pages_in_self(struct page_read *pr)
+{
+	return pr->get_pagemap == get_pagemap && !pr->auto_dedup &&
+		!pr->pe->in_parent && !pr->pe->has_store_page &&
+		!pr->pe->has_compressed_size;
+}
+
+/*
+ * Reads all pages of pr into the area of size bytes at base, pagemap
+ * vaddr-s being offsets in it. Pages of consequent pagemaps lie in
+ * pages.img one after another, so they are skipped over while being
+ * collected into iovecs, and are then read with one preadv. The rest
+ * go the read_pages way.
+ */
+int page_read_all(struct page_read *pr, void *base, unsigned long size)
+{
+	struct iovec iovs[PR_READV_BATCH];
+	off_t off = 0, len = 0;
+	int nr = 0, ret;
+
+	while (1) {
+		unsigned long vaddr;
+		struct iovec iov;
+
+		ret = pr->get_pagemap(pr, &iov);
+		if (ret <= 0)
+			break;
+
+		vaddr = (unsigned long)iov.iov_base;
+		if (vaddr + iov.iov_len > size) {
+			if (pr->put_pagemap)
+				pr->put_pagemap(pr);
+			break;
+		}
+
+		if (pages_in_self(pr)) {
+			off_t cur;
+
+			cur = lseek(pr->fd_pg, 0, SEEK_CUR);
+			if (cur < 0) {
+				pr_perror("Can't get pages position");
+				ret = -1;
+			} else if (nr && (nr == PR_READV_BATCH || off + len != cur)) {
+				ret = readv_pages(pr->fd_pg, iovs, nr, off);
+				nr = 0;
+			}
+
+			if (ret >= 0) {
+				if (!nr) {
+					off = cur;
+					len = 0;
+				}
+
+				iovs[nr].iov_base = base + vaddr;
+				iovs[nr].iov_len = iov.iov_len;
+				len += iov.iov_len;
+				nr++;
+
+				pr->skip_pages(pr, iov.iov_len);
+			}
+		} else
+			ret = pr->read_pages(pr, vaddr, iov.iov_len / PAGE_SIZE, base + vaddr);
+
+		if (pr->put_pagemap)
+			pr->put_pagemap(pr);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (ret >= 0 && nr)
+		ret = readv_pages(pr->fd_pg, iovs, nr, off);
+
+	return ret;
+}
+
+int open_page_read(int pid, struct page_read *pr, int flags, int pr_type)
 {
-	return open_page_read_at(get_service_fd(IMG_FD_OFF), pid, pr, flags, shmem);
+	return open_page_read_at(get_service_fd(IMG_FD_OFF), pid, pr, flags, pr_type);
 }
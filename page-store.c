@@ -0,0 +1,433 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cr_options.h"
+#include "servicefd.h"
+#include "image.h"
+#include "page-store.h"
+
+#include "protobuf.h"
+#include "protobuf/pagemap.pb-c.h"
+
+/*
+ * Pages are found in the store by hash of their contents, the
+ * hash only picks the candidates, the contents are always compared.
+ * Thus the pages-store-index image with hashes of stored pages is
+ * merely a hint, that saves us from reading the whole store on
+ * every dump.
+ */
+
+#define STORE_HASH_BITS		16
+#define STORE_HASH_SIZE		(1 << STORE_HASH_BITS)
+
+struct store_page {
+	u64			hash;
+	u64			idx;
+	void			*data;	/* page isn't in the store file yet */
+	struct store_page	*next;
+};
+
+static struct store_page *store_hash[STORE_HASH_SIZE];
+static int store_fd = -1;
+
+static unsigned long nr_stored, nr_found;
+
+static u64 page_hash(void *page)
+{
+	u64 *w = page, h = 0xcbf29ce484222325ULL;
+	int i;
+
+	/* FNV-1a over 64-bit words */
+	for (i = 0; i < PAGE_SIZE / sizeof(*w); i++) {
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static inline struct store_page **store_bucket(u64 hash)
+{
+	/* Upper bits are mixed better */
+	return &store_hash[hash >> (64 - STORE_HASH_BITS)];
+}
+
+static struct store_page *store_add(u64 hash, u64 idx)
+{
+	struct store_page *sp, **b;
+
+	sp = xmalloc(sizeof(*sp));
+	if (!sp)
+		return NULL;
+
+	b = store_bucket(hash);
+	sp->hash = hash;
+	sp->idx = idx;
+	sp->data = NULL;
+	sp->next = *b;
+	*b = sp;
+
+	return sp;
+}
+
+static int store_find(u64 hash, void *page, struct store_page **found)
+{
+	static char buf[PAGE_SIZE];
+	struct store_page *sp;
+
+	for (sp = *store_bucket(hash); sp; sp = sp->next) {
+		void *data = sp->data;
+
+		if (sp->hash != hash)
+			continue;
+
+		if (!data) {
+			if (pread(store_fd, buf, PAGE_SIZE, sp->idx * PAGE_SIZE) != PAGE_SIZE) {
+				pr_perror("Can't read page %"PRIu64" from store", sp->idx);
+				return -1;
+			}
+			data = buf;
+		}
+
+		if (!memcmp(data, page, PAGE_SIZE)) {
+			*found = sp;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int store_hash_pages(u64 from, u64 to)
+{
+	static char buf[PAGE_STORE_BATCH * PAGE_SIZE];
+
+	while (from < to) {
+		unsigned long nr, i;
+
+		nr = min((u64)PAGE_STORE_BATCH, to - from);
+		if (pread(store_fd, buf, nr * PAGE_SIZE, from * PAGE_SIZE) != nr * PAGE_SIZE) {
+			pr_perror("Can't read pages from store");
+			return -1;
+		}
+
+		for (i = 0; i < nr; i++)
+			if (!store_add(page_hash(buf + i * PAGE_SIZE), from + i))
+				return -1;
+
+		from += nr;
+	}
+
+	return 0;
+}
+
+/* Returns the number of pages taken from index */
+static long store_load_index(int dfd, u64 nr)
+{
+	u64 hash[PAGE_STORE_BATCH];
+	long loaded = 0;
+	int fd;
+
+	fd = open_image_at(dfd, CR_FD_PAGES_STORE_INDEX, O_RSTR | O_OPT);
+	if (fd == -ENOENT)
+		return 0;
+	if (fd < 0)
+		return -1;
+
+	while (loaded < nr) {
+		unsigned long want, i;
+		ssize_t ret;
+
+		want = min((u64)PAGE_STORE_BATCH, nr - loaded);
+		ret = read(fd, hash, want * sizeof(hash[0]));
+		if (ret < 0) {
+			pr_perror("Can't read page store index");
+			loaded = -1;
+			break;
+		}
+
+		ret /= sizeof(hash[0]);
+		for (i = 0; i < ret; i++) {
+			if (!store_add(hash[i], loaded + i)) {
+				close(fd);
+				return -1;
+			}
+		}
+
+		loaded += ret;
+		if (ret < want)
+			break;
+	}
+
+	close(fd);
+	return loaded;
+}
+
+static void store_free(void)
+{
+	int b;
+
+	for (b = 0; b < STORE_HASH_SIZE; b++) {
+		while (store_hash[b]) {
+			struct store_page *sp = store_hash[b];
+
+			store_hash[b] = sp->next;
+			xfree(sp);
+		}
+	}
+
+	close_safe(&store_fd);
+}
+
+int page_store_init(void)
+{
+	const char *name = fdset_template[CR_FD_PAGES_STORE].fmt;
+	int dfd = get_service_fd(IMG_FD_OFF), idx_dfd = dfd, pfd;
+	struct stat st;
+	long loaded;
+	u64 nr;
+
+	if (store_fd >= 0)
+		return 0;
+
+	pfd = openat(dfd, CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0 && errno != ENOENT) {
+		pr_perror("Can't open parent images dir");
+		return -1;
+	}
+
+	/*
+	 * Pages of the previous snapshot's store are all valid for
+	 * us too, so share the file with it and take its index.
+	 */
+	if (pfd >= 0) {
+		if (!linkat(pfd, name, dfd, name, 0)) {
+			pr_info("Linked page store from parent\n");
+			idx_dfd = pfd;
+		} else if (errno != ENOENT && errno != EEXIST)
+			pr_warn("Can't link parent page store (errno %d), "
+					"starting a new one\n", errno);
+	}
+
+	store_fd = open_image(CR_FD_PAGES_STORE, O_RDWR | O_CREAT);
+	if (store_fd < 0)
+		goto err;
+
+	if (flock(store_fd, LOCK_EX)) {
+		pr_perror("Can't lock page store");
+		goto err;
+	}
+
+	if (fstat(store_fd, &st)) {
+		pr_perror("Can't stat page store");
+		goto err;
+	}
+
+	nr = st.st_size / PAGE_SIZE;
+	loaded = store_load_index(idx_dfd, nr);
+	if (loaded < 0)
+		goto err;
+
+	/* Pages appended after the index was written */
+	if (store_hash_pages(loaded, nr))
+		goto err;
+
+	flock(store_fd, LOCK_UN);
+	close_safe(&pfd);
+
+	pr_info("Page store has %"PRIu64" pages (%ld indexed)\n", nr, loaded);
+	return 0;
+
+err:
+	close_safe(&pfd);
+	store_free();
+	return -1;
+}
+
+int page_store_write(void *pages, unsigned long nr, u64 *idx)
+{
+	static char buf[PAGE_STORE_BATCH * PAGE_SIZE];
+	struct store_page *added[PAGE_STORE_BATCH];
+	unsigned long i, nr_new = 0;
+	struct stat st;
+	int ret = -1;
+	u64 base;
+
+	BUG_ON(nr > PAGE_STORE_BATCH);
+
+	/* Page server streams append to the same store in parallel */
+	if (flock(store_fd, LOCK_EX)) {
+		pr_perror("Can't lock page store");
+		return -1;
+	}
+
+	if (fstat(store_fd, &st)) {
+		pr_perror("Can't stat page store");
+		goto out;
+	}
+
+	/* A partial page may be left by a failed dump, skip it */
+	base = DIV_ROUND_UP(st.st_size, PAGE_SIZE);
+
+	for (i = 0; i < nr; i++) {
+		void *page = pages + i * PAGE_SIZE;
+		struct store_page *sp;
+		u64 hash;
+
+		hash = page_hash(page);
+		ret = store_find(hash, page, &sp);
+		if (ret < 0)
+			goto out;
+
+		if (ret) {
+			nr_found++;
+			idx[i] = sp->idx;
+			continue;
+		}
+
+		ret = -1;
+		sp = store_add(hash, base + nr_new);
+		if (!sp)
+			goto out;
+
+		/* Same page may come again in this batch */
+		sp->data = buf + nr_new * PAGE_SIZE;
+		memcpy(sp->data, page, PAGE_SIZE);
+		added[nr_new++] = sp;
+		idx[i] = sp->idx;
+	}
+
+	ret = 0;
+	if (nr_new && pwrite(store_fd, buf, nr_new * PAGE_SIZE,
+				base * PAGE_SIZE) != nr_new * PAGE_SIZE) {
+		pr_perror("Can't write %lu pages to store", nr_new);
+		ret = -1;
+	}
+
+	nr_stored += nr_new;
+out:
+	for (i = 0; i < nr_new; i++)
+		added[i]->data = NULL;
+
+	flock(store_fd, LOCK_UN);
+	return ret;
+}
+
+/*
+ * Writes pagemap entries for nr pages at vaddr, which went into
+ * the store at idx-s. Pages stored one after another share one entry.
+ */
+int page_store_write_pagemap(int fd, unsigned long vaddr, u64 *idx, unsigned long nr)
+{
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+	unsigned long i;
+
+	pe.has_store_page = true;
+
+	for (i = 0; i < nr; i++) {
+		if (pe.nr_pages && pe.store_page + pe.nr_pages == idx[i]) {
+			pe.nr_pages++;
+			continue;
+		}
+
+		if (pe.nr_pages && pb_write_one(fd, &pe, PB_PAGEMAP) < 0)
+			return -1;
+
+		pe.vaddr = encode_pointer((void *)(vaddr + i * PAGE_SIZE));
+		pe.nr_pages = 1;
+		pe.store_page = idx[i];
+	}
+
+	if (pe.nr_pages && pb_write_one(fd, &pe, PB_PAGEMAP) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int store_write_index(void)
+{
+	static char buf[PAGE_SIZE];
+	u64 *index = NULL, nr, i;
+	char *known = NULL;
+	struct stat st;
+	int fd, b, ret = -1;
+
+	if (fstat(store_fd, &st)) {
+		pr_perror("Can't stat page store");
+		return -1;
+	}
+
+	nr = st.st_size / PAGE_SIZE;
+	if (nr) {
+		index = xmalloc(nr * sizeof(*index));
+		known = xzalloc(nr);
+		if (!index || !known)
+			goto out;
+	}
+
+	for (b = 0; b < STORE_HASH_SIZE; b++) {
+		struct store_page *sp;
+
+		for (sp = store_hash[b]; sp; sp = sp->next) {
+			if (sp->idx >= nr)
+				continue;
+
+			index[sp->idx] = sp->hash;
+			known[sp->idx] = 1;
+		}
+	}
+
+	/* Others might have appended pages we haven't seen */
+	for (i = 0; i < nr; i++) {
+		if (known[i])
+			continue;
+
+		if (pread(store_fd, buf, PAGE_SIZE, i * PAGE_SIZE) != PAGE_SIZE) {
+			pr_perror("Can't read page %"PRIu64" from store", i);
+			goto out;
+		}
+
+		index[i] = page_hash(buf);
+	}
+
+	fd = open_image(CR_FD_PAGES_STORE_INDEX, O_DUMP);
+	if (fd < 0)
+		goto out;
+
+	if (write(fd, index, nr * sizeof(*index)) != nr * sizeof(*index)) {
+		pr_perror("Can't write page store index");
+		close(fd);
+		goto out;
+	}
+
+	close(fd);
+	ret = 0;
+out:
+	xfree(known);
+	xfree(index);
+	return ret;
+}
+
+int page_store_fini(void)
+{
+	int ret;
+
+	if (store_fd < 0)
+		return 0;
+
+	if (flock(store_fd, LOCK_EX)) {
+		pr_perror("Can't lock page store");
+		ret = -1;
+	} else {
+		ret = store_write_index();
+		flock(store_fd, LOCK_UN);
+	}
+
+	pr_info("Page store: %lu pages written, %lu found\n", nr_stored, nr_found);
+
+	store_free();
+	return ret;
+}
@@ -1,15 +1,19 @@
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <linux/falloc.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "cr_options.h"
 #include "servicefd.h"
 #include "image.h"
 #include "page-xfer.h"
 #include "page-pipe.h"
+#include "page-store.h"
+#include "page-compress.h"
 
 #include "protobuf.h"
 #include "protobuf/pagemap.pb-c.h"
@@ -38,9 +42,13 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id);
 #define PS_IOV_ADD	1
 #define PS_IOV_HOLE	2
 #define PS_IOV_OPEN	3
+#define PS_IOV_ADD_IOVS	4	/* nr_pages PS_IOV_ADD-s, followed by all their pages */
+#define PS_IOV_ADD_COMPRESSED	5	/* followed by u32 size and compressed pages */
 
 #define PS_IOV_FLUSH		0x1023
 
+#define PS_IOV_BATCH	64
+
 #define PS_TYPE_BITS	8
 #define PS_TYPE_MASK	((1 << PS_TYPE_BITS) - 1)
 
@@ -70,10 +78,13 @@ static struct page_xfer_job cxfer = {
 	.dst_id = ~0,
 };
 
-static void page_server_close(void)
+static int page_server_close(void)
 {
-	if (cxfer.dst_id != ~0)
-		cxfer.loc_xfer.close(&cxfer.loc_xfer);
+	if (cxfer.dst_id == ~0)
+		return 0;
+
+	cxfer.dst_id = ~0;
+	return cxfer.loc_xfer.close(&cxfer.loc_xfer);
 }
 
 static int page_server_open(struct page_server_iov *pi)
@@ -85,7 +96,8 @@ static int page_server_open(struct page_server_iov *pi)
 	id = decode_pm_id(pi->dst_id);
 	pr_info("Opening %d/%ld\n", type, id);
 
-	page_server_close();
+	if (page_server_close())
+		return -1;
 
 	if (open_page_local_xfer(&cxfer.loc_xfer, type, id))
 		return -1;
@@ -158,6 +170,81 @@ static int page_server_hole(int sk, struct page_server_iov *pi)
 	return 0;
 }
 
+static int page_server_add_iovs(int sk, struct page_server_iov *pi)
+{
+	struct page_server_iov iovs[PS_IOV_BATCH];
+	int i;
+
+	pr_debug("Adding %u iovs\n", pi->nr_pages);
+
+	if (pi->nr_pages > PS_IOV_BATCH) {
+		pr_err("Too many iovs in batch %u\n", pi->nr_pages);
+		return -1;
+	}
+
+	if (recv(sk, iovs, pi->nr_pages * sizeof(iovs[0]), MSG_WAITALL) !=
+			pi->nr_pages * sizeof(iovs[0])) {
+		pr_perror("Can't read iovs batch from socket");
+		return -1;
+	}
+
+	/*
+	 * Pages for all the iovs follow the batch, thus
+	 * page_server_add() will find them in the socket
+	 * in the proper order.
+	 */
+	for (i = 0; i < pi->nr_pages; i++) {
+		iovs[i].dst_id = pi->dst_id;
+		if (page_server_add(sk, &iovs[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int page_server_add_compressed(int sk, struct page_server_iov *pi)
+{
+	static void *buf;
+	unsigned int bound = page_compress_bound(PAGE_COMPRESS_CHUNK * PAGE_SIZE);
+	struct page_xfer *lxfer = &cxfer.loc_xfer;
+	struct iovec iov;
+	u32 size;
+
+	pr_debug("Adding %"PRIx64"/%u compressed\n", pi->vaddr, pi->nr_pages);
+
+	if (prep_loc_xfer(pi))
+		return -1;
+
+	if (pi->nr_pages > PAGE_COMPRESS_CHUNK) {
+		pr_err("Too many compressed pages %u\n", pi->nr_pages);
+		return -1;
+	}
+
+	if (recv(sk, &size, sizeof(size), MSG_WAITALL) != sizeof(size)) {
+		pr_perror("Can't read compressed size from socket");
+		return -1;
+	}
+
+	if (size > bound) {
+		pr_err("Too big compressed pages %u\n", size);
+		return -1;
+	}
+
+	if (!buf) {
+		buf = xmalloc(bound);
+		if (!buf)
+			return -1;
+	}
+
+	if (recv(sk, buf, size, MSG_WAITALL) != size) {
+		pr_perror("Can't read compressed pages from socket");
+		return -1;
+	}
+
+	psi2iovec(pi, &iov);
+	return lxfer->write_compressed(lxfer, &iov, buf, size);
+}
+
 static int page_server_serve(int sk)
 {
 	int ret = -1;
@@ -197,6 +284,12 @@ static int page_server_serve(int sk)
 		case PS_IOV_HOLE:
 			ret = page_server_hole(sk, &pi);
 			break;
+		case PS_IOV_ADD_IOVS:
+			ret = page_server_add_iovs(sk, &pi);
+			break;
+		case PS_IOV_ADD_COMPRESSED:
+			ret = page_server_add_compressed(sk, &pi);
+			break;
 		case PS_IOV_FLUSH:
 		{
 			int32_t status = 0;
@@ -229,7 +322,10 @@ static int page_server_serve(int sk)
 		ret = -1;
 	}
 
-	page_server_close();
+	if (page_server_close())
+		ret = -1;
+	if (page_store_fini())
+		ret = -1;
 	pr_info("Session over\n");
 
 	close(sk);
@@ -252,6 +348,109 @@ static int get_sockaddr_in(struct sockaddr_in *addr)
 	return 0;
 }
 
+static int page_server_fork(int sk, int ask)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork page server stream");
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(sk);
+		cxfer.dst_id = ~0;
+		exit(page_server_serve(ask) ? 1 : 0);
+	}
+
+	close(ask);
+	return pid;
+}
+
+/*
+ * The first connection is the one from criu dump itself. Page
+ * writers (see --dump-jobs) may connect in parallel to it, each
+ * stream gets served by its own process, pages images ids are
+ * shared by them. Streams finish their sessions before the main
+ * one sends the final PS_IOV_FLUSH, so we serve new connections
+ * till the main one is over.
+ */
+static int page_server_serve_streams(int sk, int ask)
+{
+	int alive[2], status, ret = 0;
+	pid_t pid;
+
+	if (pipe(alive)) {
+		pr_perror("Can't make pipe for page server");
+		close(ask);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		pr_perror("Can't fork page server");
+		close(ask);
+		ret = -1;
+		goto out;
+	}
+
+	if (pid == 0) {
+		close(alive[0]);
+		close(sk);
+		exit(page_server_serve(ask) ? 1 : 0);
+	}
+
+	close(alive[1]);
+	alive[1] = -1;
+	close(ask);
+
+	while (1) {
+		struct pollfd pfd[2] = {
+			{ .fd = sk, .events = POLLIN, },
+			{ .fd = alive[0], .events = POLLIN, },
+		};
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_perror("Can't poll page server sockets");
+			ret = -1;
+			break;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		if (pfd[0].revents & POLLIN) {
+			ask = accept(sk, NULL, NULL);
+			if (ask < 0) {
+				pr_perror("Can't accept stream connection");
+				ret = -1;
+				break;
+			}
+
+			pr_info("Accepted stream connection\n");
+			if (page_server_fork(sk, ask) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	while ((pid = waitpid(-1, &status, 0)) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("Page server stream %d failed (status %#x)\n",
+					pid, status);
+			ret = -1;
+		}
+	}
+out:
+	close_safe(&alive[0]);
+	close_safe(&alive[1]);
+	return ret;
+}
+
 int cr_page_server(bool daemon_mode)
 {
 	int sk, ask = -1, ret;
@@ -276,7 +475,7 @@ int cr_page_server(bool daemon_mode)
 		goto out;
 	}
 
-	if (listen(sk, 1)) {
+	if (listen(sk, 16)) {
 		pr_perror("Can't listen on page server socket");
 		goto out;
 	}
@@ -302,16 +501,16 @@ int cr_page_server(bool daemon_mode)
 	if (ask < 0)
 		pr_perror("Can't accept connection to server");
 
-	close(sk);
-
 	if (ask >= 0) {
 		pr_info("Accepted connection from %s:%u\n",
 				inet_ntoa(caddr.sin_addr),
 				(int)ntohs(caddr.sin_port));
 
-		ret = page_server_serve(ask);
+		ret = page_server_serve_streams(sk, ask);
 	}
 
+	close(sk);
+
 	if (daemon_mode)
 		exit(ret);
 
@@ -324,6 +523,49 @@ out:
 
 static int page_server_sk = -1;
 
+/*
+ * Commands to the page server are queued and sent in one go
+ * right before the pages they describe, or when the xfer is
+ * closed.
+ */
+static struct page_server_iov ps_queue[PS_IOV_BATCH];
+static int ps_queued;
+
+static int ps_flush(int sk)
+{
+	int len = ps_queued * sizeof(ps_queue[0]);
+
+	if (!ps_queued)
+		return 0;
+
+	ps_queued = 0;
+	if (write(sk, ps_queue, len) != len) {
+		pr_perror("Can't write commands to page server");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ps_send(int sk, struct page_server_iov *pi)
+{
+	if (ps_queued == PS_IOV_BATCH && ps_flush(sk))
+		return -1;
+
+	ps_queue[ps_queued++] = *pi;
+	return 0;
+}
+
+/*
+ * Page writers (see --dump-jobs) talk to the page server via
+ * their own connections and send iovs in PS_IOV_ADD_IOVS batches.
+ * This requires the page server of the same version.
+ */
+static bool ps_streams(void)
+{
+	return opts.dump_jobs > 1;
+}
+
 int connect_to_page_server(void)
 {
 	struct sockaddr_in saddr;
@@ -351,6 +593,15 @@ int connect_to_page_server(void)
 	return 0;
 }
 
+int connect_to_page_server_stream(void)
+{
+	/* The main connection is left for the parent */
+	close_safe(&page_server_sk);
+	ps_queued = 0;
+
+	return connect_to_page_server();
+}
+
 int disconnect_from_page_server(void)
 {
 	struct page_server_iov pi = { .cmd = PS_IOV_FLUSH };
@@ -366,8 +617,8 @@ int disconnect_from_page_server(void)
 	pr_info("Disconnect from the page server %s:%u\n",
 			opts.addr, (int)ntohs(opts.ps_port));
 
-	if (write(page_server_sk, &pi, sizeof(pi)) != sizeof(pi)) {
-		pr_perror("Can't write the fini command to server");
+	if (ps_send(page_server_sk, &pi) || ps_flush(page_server_sk)) {
+		pr_err("Can't write the fini command to server\n");
 		goto out;
 	}
 
@@ -391,17 +642,15 @@ static int write_pagemap_to_server(struct page_xfer *xfer,
 	pi.dst_id = xfer->dst_id;
 	iovec2psi(iov, &pi);
 
-	if (write(xfer->fd, &pi, sizeof(pi)) != sizeof(pi)) {
-		pr_perror("Can't write pagemap to server");
-		return -1;
-	}
-
-	return 0;
+	return ps_send(xfer->fd, &pi);
 }
 
 static int write_pages_to_server(struct page_xfer *xfer,
 		int p, unsigned long len)
 {
+	if (ps_flush(xfer->fd))
+		return -1;
+
 	pr_debug("Splicing %lu bytes / %lu pages into socket\n", len, len / PAGE_SIZE);
 
 	if (splice(p, NULL, xfer->fd, NULL, len, SPLICE_F_MOVE) != len) {
@@ -412,6 +661,53 @@ static int write_pages_to_server(struct page_xfer *xfer,
 	return 0;
 }
 
+static int write_iovs_to_server(struct page_xfer *xfer,
+		struct iovec *iov, int nr, int p)
+{
+	while (nr) {
+		struct page_server_iov pi;
+		unsigned long len = 0;
+		int i, n;
+
+		if (!ps_streams()) {
+			if (write_pagemap_to_server(xfer, iov))
+				return -1;
+			if (write_pages_to_server(xfer, p, iov->iov_len))
+				return -1;
+
+			iov++;
+			nr--;
+			continue;
+		}
+
+		n = min(nr, PS_IOV_BATCH);
+
+		pi.cmd = PS_IOV_ADD_IOVS;
+		pi.nr_pages = n;
+		pi.vaddr = 0;
+		pi.dst_id = xfer->dst_id;
+		if (ps_send(xfer->fd, &pi))
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			pi.cmd = PS_IOV_ADD;
+			iovec2psi(&iov[i], &pi);
+			if (ps_send(xfer->fd, &pi))
+				return -1;
+
+			len += iov[i].iov_len;
+		}
+
+		if (write_pages_to_server(xfer, p, len))
+			return -1;
+
+		iov += n;
+		nr -= n;
+	}
+
+	return 0;
+}
+
 static int write_hole_to_server(struct page_xfer *xfer, struct iovec *iov)
 {
 	struct page_server_iov pi;
@@ -420,17 +716,45 @@ static int write_hole_to_server(struct page_xfer *xfer, struct iovec *iov)
 	pi.dst_id = xfer->dst_id;
 	iovec2psi(iov, &pi);
 
-	if (write(xfer->fd, &pi, sizeof(pi)) != sizeof(pi)) {
-		pr_perror("Can't write pagehole to server");
+	return ps_send(xfer->fd, &pi);
+}
+
+static int write_compressed_to_server(struct page_xfer *xfer,
+		struct iovec *iov, void *buf, unsigned int size)
+{
+	struct page_server_iov pi;
+	struct iovec siov[3];
+	u32 sz = size;
+
+	pi.cmd = PS_IOV_ADD_COMPRESSED;
+	pi.dst_id = xfer->dst_id;
+	iovec2psi(iov, &pi);
+
+	if (ps_flush(xfer->fd))
+		return -1;
+
+	siov[0].iov_base = &pi;
+	siov[0].iov_len = sizeof(pi);
+	siov[1].iov_base = &sz;
+	siov[1].iov_len = sizeof(sz);
+	siov[2].iov_base = buf;
+	siov[2].iov_len = size;
+
+	if (writev(xfer->fd, siov, 3) != sizeof(pi) + sizeof(sz) + size) {
+		pr_perror("Can't write compressed pages to socket");
 		return -1;
 	}
 
 	return 0;
 }
 
-static void close_server_xfer(struct page_xfer *xfer)
+static int close_server_xfer(struct page_xfer *xfer)
 {
+	int ret;
+
+	ret = ps_flush(xfer->fd);
 	xfer->fd = -1;
+	return ret;
 }
 
 static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
@@ -440,7 +764,9 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
 	xfer->fd = page_server_sk;
 	xfer->write_pagemap = write_pagemap_to_server;
 	xfer->write_pages = write_pages_to_server;
+	xfer->write_iovs = write_iovs_to_server;
 	xfer->write_hole = write_hole_to_server;
+	xfer->write_compressed = write_compressed_to_server;
 	xfer->close = close_server_xfer;
 	xfer->dst_id = encode_pm_id(fd_type, id);
 
@@ -449,12 +775,7 @@ static int open_page_server_xfer(struct page_xfer *xfer, int fd_type, long id)
 	pi.vaddr = 0;
 	pi.nr_pages = 0;
 
-	if (write(xfer->fd, &pi, sizeof(pi)) != sizeof(pi)) {
-		pr_perror("Can't write to page server");
-		return -1;
-	}
-
-	return 0;
+	return ps_send(xfer->fd, &pi);
 }
 
 static int write_pagemap_loc(struct page_xfer *xfer,
@@ -491,6 +812,51 @@ static int write_pages_loc(struct page_xfer *xfer,
 	return 0;
 }
 
+static int write_iovs_loc(struct page_xfer *xfer,
+		struct iovec *iov, int nr, int p)
+{
+	unsigned long len = 0;
+	int i;
+
+	/* Pagemap and pages go to different files, so send pages in one go */
+	for (i = 0; i < nr; i++) {
+		if (write_pagemap_loc(xfer, &iov[i]))
+			return -1;
+		len += iov[i].iov_len;
+	}
+
+	return write_pages_loc(xfer, p, len);
+}
+
+static int write_compressed_loc(struct page_xfer *xfer,
+		struct iovec *iov, void *buf, unsigned int size)
+{
+	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+	int ret;
+
+	iovec2pagemap(iov, &pe);
+	pe.has_compressed_size = true;
+	pe.compressed_size = size;
+
+	if (opts.auto_dedup && xfer->parent != NULL) {
+		ret = dedup_one_iovec(xfer->parent, iov);
+		if (ret == -1) {
+			pr_perror("Auto-deduplication failed");
+			return ret;
+		}
+	}
+
+	if (pb_write_one(xfer->fd, &pe, PB_PAGEMAP) < 0)
+		return -1;
+
+	if (write(xfer->fd_pg, buf, size) != size) {
+		pr_perror("Can't write compressed pages");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 {
 	int ret;
@@ -558,82 +924,339 @@ static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 	return 0;
 }
 
-static void close_page_xfer(struct page_xfer *xfer)
+/*
+ * With --page-store pages go to the store, and pagemap entries
+ * are written after them, as they refer to the store. Pages may
+ * come from page server socket in pieces of any size, thus the
+ * tail of incomplete page is kept in the buffer till the next call.
+ */
+static char store_buf[PAGE_STORE_BATCH * PAGE_SIZE];
+static unsigned long store_fill;
+
+static int write_pagemap_store(struct page_xfer *xfer, struct iovec *iov)
 {
+	int ret;
+
+	if (opts.auto_dedup && xfer->parent != NULL) {
+		ret = dedup_one_iovec(xfer->parent, iov);
+		if (ret == -1) {
+			pr_perror("Auto-deduplication failed");
+			return ret;
+		}
+	}
+
+	BUG_ON(xfer->store_iov.iov_len || store_fill);
+	xfer->store_iov = *iov;
+	return 0;
+}
+
+static int flush_store_pages(struct page_xfer *xfer)
+{
+	unsigned long nr = store_fill / PAGE_SIZE;
+	u64 idx[PAGE_STORE_BATCH];
+	struct iovec *iov = &xfer->store_iov;
+
+	if (!nr)
+		return 0;
+
+	if (nr * PAGE_SIZE > iov->iov_len) {
+		pr_err("More pages than in pagemap %p/%zu\n",
+				iov->iov_base, iov->iov_len);
+		return -1;
+	}
+
+	if (page_store_write(store_buf, nr, idx))
+		return -1;
+
+	if (page_store_write_pagemap(xfer->fd, (unsigned long)iov->iov_base, idx, nr))
+		return -1;
+
+	iov->iov_base += nr * PAGE_SIZE;
+	iov->iov_len -= nr * PAGE_SIZE;
+
+	store_fill -= nr * PAGE_SIZE;
+	memmove(store_buf, store_buf + nr * PAGE_SIZE, store_fill);
+	return 0;
+}
+
+static int write_pages_store(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	while (len) {
+		ssize_t ret;
+
+		ret = read(p, store_buf + store_fill,
+				min(len, (unsigned long)sizeof(store_buf) - store_fill));
+		if (ret <= 0) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+
+		store_fill += ret;
+		len -= ret;
+
+		if (store_fill == sizeof(store_buf) && flush_store_pages(xfer))
+			return -1;
+	}
+
+	return flush_store_pages(xfer);
+}
+
+static int write_iovs_store(struct page_xfer *xfer,
+		struct iovec *iov, int nr, int p)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (write_pagemap_store(xfer, &iov[i]))
+			return -1;
+		if (write_pages_store(xfer, p, iov[i].iov_len))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Store keeps pages raw, so ones from page server are decompressed */
+static int write_compressed_store(struct page_xfer *xfer,
+		struct iovec *iov, void *buf, unsigned int size)
+{
+	if (write_pagemap_store(xfer, iov))
+		return -1;
+
+	BUG_ON(iov->iov_len > sizeof(store_buf));
+	if (page_decompress(buf, size, store_buf, iov->iov_len))
+		return -1;
+
+	store_fill = iov->iov_len;
+	return flush_store_pages(xfer);
+}
+
+static int close_page_xfer(struct page_xfer *xfer)
+{
+	if (xfer->store_iov.iov_len || store_fill)
+		pr_warn("Pages %p/%zu not written to store\n",
+				xfer->store_iov.iov_base, xfer->store_iov.iov_len);
+	store_fill = 0;
+
 	if (xfer->parent != NULL) {
 		xfer->parent->close(xfer->parent);
 		xfree(xfer->parent);
 		xfer->parent = NULL;
 	}
 	close(xfer->fd_pg);
-	close(xfer->fd);
+	close_image(xfer->fd);
+	return 0;
 }
 
-int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp,
-		unsigned long off)
+/* Store keeps pages raw, so no need to compress them for it */
+static bool compress_pages(void)
 {
-	struct page_pipe_buf *ppb;
-	struct iovec *hole = NULL;
+	return opts.compress && (opts.use_page_server || !opts.page_store);
+}
 
-	pr_debug("Transfering pages:\n");
+static void *zpages, *zdata;
+static struct page_zchunk *zchunks;
+static unsigned long zpages_len;
+static int max_zchunks;
 
-	if (pp->free_hole)
-		hole = &pp->holes[0];
+/*
+ * Reads all pages of ppb out of its pipe and compresses them in
+ * chunks, that don't cross iovs. Returns the number of chunks.
+ */
+static int compress_ppb(struct page_pipe_buf *ppb)
+{
+	unsigned int bound = page_compress_bound(PAGE_COMPRESS_CHUNK * PAGE_SIZE);
+	unsigned long len = ppb->pages_in * PAGE_SIZE, done = 0;
+	int i, nr = 0, max;
 
-	list_for_each_entry(ppb, &pp->bufs, l) {
-		int i;
+	max = ppb->pages_in / PAGE_COMPRESS_CHUNK + ppb->nr_segs;
+	if (max > max_zchunks) {
+		void *c, *d;
 
-		pr_debug("\tbuf %d/%d\n", ppb->pages_in, ppb->nr_segs);
+		c = xrealloc(zchunks, max * sizeof(*zchunks));
+		if (!c)
+			return -1;
+		zchunks = c;
+
+		d = xrealloc(zdata, (unsigned long)max * bound);
+		if (!d)
+			return -1;
+		zdata = d;
 
-		for (i = 0; i < ppb->nr_segs; i++) {
-			struct iovec *iov = &ppb->iov[i];
+		max_zchunks = max;
+	}
 
-			while (hole && (hole->iov_base < iov->iov_base)) {
-				pr_debug("\th %p [%u]\n", hole->iov_base,
-						(unsigned int)(hole->iov_len / PAGE_SIZE));
-				if (xfer->write_hole(xfer, hole))
-					return -1;
+	if (len > zpages_len) {
+		void *p;
 
-				hole++;
-				if (hole >= &pp->holes[pp->free_hole])
-					hole = NULL;
-			}
+		p = xrealloc(zpages, len);
+		if (!p)
+			return -1;
+		zpages = p;
+		zpages_len = len;
+	}
 
-			BUG_ON(iov->iov_base < (void *)off);
-			iov->iov_base -= off;
-			pr_debug("\tp %p [%u]\n", iov->iov_base,
-					(unsigned int)(iov->iov_len / PAGE_SIZE));
+	while (done < len) {
+		ssize_t ret;
 
-			if (xfer->write_pagemap(xfer, iov))
-				return -1;
-			if (xfer->write_pages(xfer, ppb->p[0], iov->iov_len))
+		ret = read(ppb->p[0], zpages + done, len - done);
+		if (ret <= 0) {
+			pr_perror("Can't read pages from pipe");
+			return -1;
+		}
+
+		done += ret;
+	}
+
+	done = 0;
+	for (i = 0; i < ppb->nr_segs; i++) {
+		unsigned long left = ppb->iov[i].iov_len / PAGE_SIZE;
+
+		while (left) {
+			struct page_zchunk *c = &zchunks[nr];
+
+			c->nr_pages = min(left, (unsigned long)PAGE_COMPRESS_CHUNK);
+			c->src = zpages + done;
+			c->dst = zdata + (unsigned long)nr * bound;
+			c->size = 0;
+
+			done += c->nr_pages * PAGE_SIZE;
+			left -= c->nr_pages;
+			nr++;
+		}
+	}
+
+	if (page_compress_chunks(zchunks, nr))
+		return -1;
+
+	return nr;
+}
+
+static int write_compressed_iovs(struct page_xfer *xfer, struct iovec *iov,
+		int nr, struct page_zchunk **c)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		unsigned long done = 0;
+
+		while (done < iov[i].iov_len) {
+			struct iovec ziov;
+
+			ziov.iov_base = iov[i].iov_base + done;
+			ziov.iov_len = (*c)->nr_pages * PAGE_SIZE;
+
+			if (xfer->write_compressed(xfer, &ziov, (*c)->dst, (*c)->size))
 				return -1;
+
+			done += ziov.iov_len;
+			(*c)++;
 		}
 	}
 
-	while (hole) {
-		pr_debug("\th* %p [%u]\n", hole->iov_base,
-				(unsigned int)(hole->iov_len / PAGE_SIZE));
-		if (xfer->write_hole(xfer, hole))
+	return 0;
+}
+
+/* Writes holes below limit, or all the rest of them if it's NULL */
+static int dump_holes(struct page_xfer *xfer, struct page_pipe *pp,
+		struct iovec **hole, void *limit)
+{
+	while (*hole && (!limit || (*hole)->iov_base < limit)) {
+		pr_debug("\th %p [%u]\n", (*hole)->iov_base,
+				(unsigned int)((*hole)->iov_len / PAGE_SIZE));
+		if (xfer->write_hole(xfer, *hole))
 			return -1;
 
-		hole++;
-		if (hole >= &pp->holes[pp->free_hole])
-			hole = NULL;
+		(*hole)++;
+		if (*hole >= &pp->holes[pp->free_hole])
+			*hole = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes pages of one ppb together with the holes preceding them.
+ * The hole cursor starts at page_pipe_first_hole() and is advanced,
+ * so that bufs can be written one by one as they get filled. The
+ * page_xfer_dump_holes() then writes the rest of holes.
+ */
+int page_xfer_dump_ppb(struct page_xfer *xfer, struct page_pipe *pp,
+		struct page_pipe_buf *ppb, struct iovec **hole, unsigned long off)
+{
+	struct page_zchunk *zc = NULL;
+	bool compress = compress_pages();
+	int i, n;
+
+	pr_debug("\tbuf %d/%d\n", ppb->pages_in, ppb->nr_segs);
+
+	if (compress) {
+		if (compress_ppb(ppb) < 0)
+			return -1;
+		zc = zchunks;
+	}
+
+	for (i = 0; i < ppb->nr_segs; i += n) {
+		struct iovec *iov = &ppb->iov[i];
+
+		if (dump_holes(xfer, pp, hole, iov->iov_base))
+			return -1;
+
+		/*
+		 * Collect the run of iovs up to the next hole,
+		 * they can be sent together with their pages.
+		 */
+		for (n = 0; i + n < ppb->nr_segs; n++) {
+			if (n && *hole && (*hole)->iov_base < iov[n].iov_base)
+				break;
+
+			BUG_ON(iov[n].iov_base < (void *)off);
+			iov[n].iov_base -= off;
+			pr_debug("\tp %p [%u]\n", iov[n].iov_base,
+					(unsigned int)(iov[n].iov_len / PAGE_SIZE));
+		}
+
+		if (compress) {
+			if (write_compressed_iovs(xfer, iov, n, &zc))
+				return -1;
+		} else if (xfer->write_iovs(xfer, iov, n, ppb->p[0]))
+			return -1;
 	}
 
 	return 0;
 }
 
+int page_xfer_dump_holes(struct page_xfer *xfer, struct page_pipe *pp,
+		struct iovec **hole)
+{
+	return dump_holes(xfer, pp, hole, NULL);
+}
+
+int page_xfer_dump_pages(struct page_xfer *xfer, struct page_pipe *pp,
+		unsigned long off)
+{
+	struct page_pipe_buf *ppb;
+	struct iovec *hole = page_pipe_first_hole(pp);
+
+	pr_debug("Transfering pages:\n");
+
+	list_for_each_entry(ppb, &pp->bufs, l)
+		if (page_xfer_dump_ppb(xfer, pp, ppb, &hole, off))
+			return -1;
+
+	return page_xfer_dump_holes(xfer, pp, &hole);
+}
+
 static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 {
-	xfer->fd = open_image(fd_type, O_DUMP, id);
+	xfer->fd = open_image(fd_type, O_DUMP | O_BUF, id);
 	if (xfer->fd < 0)
 		return -1;
 
 	xfer->fd_pg = open_pages_image(O_DUMP, xfer->fd);
 	if (xfer->fd_pg < 0) {
-		close(xfer->fd);
+		close_image(xfer->fd);
 		return -1;
 	}
 
@@ -645,7 +1268,7 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 	 *    to exist in parent (either pagemap or hole)
 	 */
 	xfer->parent = NULL;
-	if (fd_type == CR_FD_PAGEMAP) {
+	if (fd_type == CR_FD_PAGEMAP || fd_type == CR_FD_SHMEM_PAGEMAP) {
 		int ret;
 		int pfd;
 
@@ -659,7 +1282,8 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 			return -1;
 		}
 
-		ret = open_page_read_at(pfd, id, xfer->parent, O_RDWR, false);
+		ret = open_page_read_at(pfd, id, xfer->parent, O_RDWR,
+				fd_type == CR_FD_SHMEM_PAGEMAP ? PR_SHMEM : PR_TASK);
 		if (ret) {
 			pr_perror("No parent image found, though parent directory is set");
 			xfree(xfer->parent);
@@ -671,8 +1295,23 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 	}
 
 out:
-	xfer->write_pagemap = write_pagemap_loc;
-	xfer->write_pages = write_pages_loc;
+	xfer->store_iov.iov_len = 0;
+	if (opts.page_store) {
+		if (page_store_init()) {
+			close_page_xfer(xfer);
+			return -1;
+		}
+
+		xfer->write_pagemap = write_pagemap_store;
+		xfer->write_pages = write_pages_store;
+		xfer->write_iovs = write_iovs_store;
+		xfer->write_compressed = write_compressed_store;
+	} else {
+		xfer->write_pagemap = write_pagemap_loc;
+		xfer->write_pages = write_pages_loc;
+		xfer->write_iovs = write_iovs_loc;
+		xfer->write_compressed = write_compressed_loc;
+	}
 	xfer->write_hole = write_pagehole_loc;
 	xfer->close = close_page_xfer;
 	return 0;
@@ -239,28 +239,6 @@ void *parasite_args_s(struct parasite_ctl *ctl, int args_size)
 	return ctl->addr_args;
 }
 
-static int parasite_execute_trap_by_pid(unsigned int cmd,
-					struct parasite_ctl *ctl, pid_t pid,
-					void *stack,
-					struct thread_ctx *octx)
-{
-	user_regs_struct_t regs = octx->regs;
-	int ret;
-
-	*ctl->addr_cmd = cmd;
-
-	ret = parasite_run(pid, PTRACE_CONT, ctl->parasite_ip, stack, &regs, octx);
-	if (ret == 0)
-		ret = parasite_trap(ctl, pid, &regs, octx);
-	if (ret == 0)
-		ret = (int)REG_RES(regs);
-
-	if (ret)
-		pr_err("Parasite exited with %d\n", ret);
-
-	return ret;
-}
-
 static int __parasite_send_cmd(int sockfd, struct ctl_msg *m)
 {
 	int ret;
@@ -535,41 +513,96 @@ err:
 	return -1;
 }
 
-int parasite_dump_thread_seized(struct parasite_ctl *ctl, int id,
-				struct pid *tid, CoreEntry *core)
+/*
+ * Threads of a batch are all started in parasite first and only then
+ * waited for, so they run concurrently instead of taking a full trap
+ * round trip one after another.
+ */
+static int dump_threads_batch(struct parasite_ctl *ctl, struct pstree_item *item,
+		int *ids, int nr)
 {
-	struct parasite_dump_thread *args;
-	pid_t pid = tid->real;
-	ThreadCoreEntry *tc = core->thread_core;
-	int ret;
-	struct thread_ctx octx;
+	struct parasite_dump_threads *args;
+	user_regs_struct_t regs[PARASITE_THREADS_BATCH];
+	struct thread_ctx octx[PARASITE_THREADS_BATCH];
+	int i, nr_run, ret = 0;
+
+	args = parasite_args(ctl, struct parasite_dump_threads);
+	args->stacks = (unsigned long)ctl->r_thread_stacks;
+	*ctl->addr_cmd = PARASITE_CMD_DUMP_THREAD;
+
+	for (nr_run = 0; nr_run < nr; nr_run++) {
+		pid_t pid = item->threads[ids[nr_run]].real;
+		ThreadCoreEntry *tc = item->core[ids[nr_run]]->thread_core;
+		void *stack = ctl->r_thread_stacks + (nr_run + 1) * PARASITE_STACK_SIZE;
+
+		if (get_thread_ctx(pid, &octx[nr_run]))
+			break;
+
+		tc->has_blk_sigset = true;
+		memcpy(&tc->blk_sigset, &octx[nr_run].sigmask, sizeof(k_rtsigset_t));
+
+		regs[nr_run] = octx[nr_run].regs;
+		if (parasite_run(pid, PTRACE_CONT, ctl->parasite_ip, stack,
+					&regs[nr_run], &octx[nr_run]))
+			break;
+	}
+
+	if (nr_run != nr)
+		ret = -1;
 
-	BUG_ON(id == 0); /* Leader is dumped in dump_task_core_all */
+	/* All the started threads should be trapped back anyway */
+	for (i = 0; i < nr_run; i++) {
+		pid_t pid = item->threads[ids[i]].real;
 
-	args = parasite_args(ctl, struct parasite_dump_thread);
+		if (parasite_trap(ctl, pid, &regs[i], &octx[i]) ||
+		    (int)REG_RES(regs[i])) {
+			pr_err("Can't dump thread %d in parasite\n", pid);
+			ret = -1;
+		}
+	}
 
-	ret = get_thread_ctx(pid, &octx);
 	if (ret)
 		return -1;
 
-	tc->has_blk_sigset = true;
-	memcpy(&tc->blk_sigset, &octx.sigmask, sizeof(k_rtsigset_t));
+	for (i = 0; i < nr; i++) {
+		struct pid *tid = &item->threads[ids[i]];
+		CoreEntry *core = item->core[ids[i]];
 
-	ret = parasite_execute_trap_by_pid(PARASITE_CMD_DUMP_THREAD, ctl,
-			pid, ctl->r_thread_stack, &octx);
-	if (ret) {
-		pr_err("Can't init thread in parasite %d\n", pid);
-		return -1;
+		if (get_task_regs(tid->real, octx[i].regs, core)) {
+			pr_err("Can't obtain regs for thread %d\n", tid->real);
+			return -1;
+		}
+
+		tid->virt = args->ti[i].tid;
+		if (dump_thread_core(tid->real, core, &args->ti[i]))
+			return -1;
 	}
 
-	ret = get_task_regs(pid, octx.regs, core);
-	if (ret) {
-		pr_err("Can't obtain regs for thread %d\n", pid);
-		return -1;
+	return 0;
+}
+
+int parasite_dump_threads_seized(struct parasite_ctl *ctl, struct pstree_item *item)
+{
+	int ids[PARASITE_THREADS_BATCH];
+	int i, nr = 0;
+
+	for (i = 0; i < item->nr_threads; i++) {
+		/* Leader is dumped in dump_task_core_all */
+		if (item->pid.real == item->threads[i].real)
+			continue;
+
+		ids[nr++] = i;
+		if (nr == ctl->nr_thread_stacks) {
+			if (dump_threads_batch(ctl, item, ids, nr))
+				return -1;
+			nr = 0;
+		}
 	}
 
-	tid->virt = args->tid;
-	return dump_thread_core(pid, core, args);
+	if (nr && dump_threads_batch(ctl, item, ids, nr))
+		return -1;
+
+	return 0;
 }
 
 int parasite_dump_sigacts_seized(struct parasite_ctl *ctl, struct cr_fdset *cr_fdset)
@@ -1174,8 +1207,8 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 	ctl->args_size = parasite_args_size(vma_area_list, dfds, timer_n);
 	map_exchange_size = parasite_size + ctl->args_size;
 	map_exchange_size += RESTORE_STACK_SIGFRAME + PARASITE_STACK_SIZE;
-	if (item->nr_threads > 1)
-		map_exchange_size += PARASITE_STACK_SIZE;
+	ctl->nr_thread_stacks = min(item->nr_threads - 1, PARASITE_THREADS_BATCH);
+	map_exchange_size += ctl->nr_thread_stacks * PARASITE_STACK_SIZE;
 
 	memcpy(&item->core[0]->tc->blk_sigset, &ctl->orig.sigmask, sizeof(k_rtsigset_t));
 
@@ -1200,10 +1233,8 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 	p += PARASITE_STACK_SIZE;
 	ctl->rstack = ctl->remote_map + p;
 
-	if (item->nr_threads > 1) {
-		p += PARASITE_STACK_SIZE;
-		ctl->r_thread_stack = ctl->remote_map + p;
-	}
+	if (ctl->nr_thread_stacks)
+		ctl->r_thread_stacks = ctl->remote_map + p;
 
 	if (parasite_start_daemon(ctl, item))
 		goto err_restore;
@@ -254,10 +254,20 @@ static int drain_fds(struct parasite_drain_fd *args)
 	return ret;
 }
 
-static int dump_thread(struct parasite_dump_thread *args)
+static int dump_thread(struct parasite_dump_threads *args)
 {
-	args->tid = sys_gettid();
-	return dump_thread_common(args);
+	unsigned long sp = (unsigned long)&args;
+	unsigned long i = (sp - args->stacks) / PARASITE_STACK_SIZE;
+	struct parasite_dump_thread *ti;
+
+	if (sp < args->stacks || i >= PARASITE_THREADS_BATCH) {
+		pr_err("Thread runs on unknown stack %lx\n", sp);
+		return -EINVAL;
+	}
+
+	ti = &args->ti[i];
+	ti->tid = sys_gettid();
+	return dump_thread_common(ti);
 }
 
 static char proc_mountpoint[] = "proc.crtools";
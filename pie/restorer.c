@@ -14,6 +14,8 @@
 #include <sched.h>
 #include <sys/resource.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#include <linux/userfaultfd.h>
 
 #include "compiler.h"
 #include "asm/types.h"
@@ -458,6 +460,39 @@ static void rst_tcp_socks_all(struct task_restore_args *ta)
 		rst_tcp_repair_off(&ta->tcp_socks[i]);
 }
 
+/*
+ * Lazy VMAs were left empty, their pages are fed by
+ * the lazy pages daemon on faults from now on.
+ */
+static int register_lazy_vmas(struct task_restore_args *args)
+{
+	struct uffdio_register reg;
+	VmaEntry *vma_entry;
+	long ret;
+	int i;
+
+	for (i = 0; i < args->nr_vmas; i++) {
+		vma_entry = args->tgt_vmas + i;
+
+		if (!(vma_entry->status & VMA_LAZY_PAGES))
+			continue;
+
+		reg.range.start = vma_entry->start;
+		reg.range.len = vma_entry_len(vma_entry);
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+		ret = sys_ioctl(args->uffd, UFFDIO_REGISTER, (unsigned long)&reg);
+		if (ret) {
+			pr_err("Can't register %"PRIx64" for lazy pages: %ld\n",
+					vma_entry->start, ret);
+			return -1;
+		}
+	}
+
+	sys_close(args->uffd);
+	return 0;
+}
+
 static int vma_remap(unsigned long src, unsigned long dst, unsigned long len)
 {
 	unsigned long guard = 0, tmp;
@@ -794,6 +829,9 @@ long __export_restore_task(struct task_restore_args *args)
 			goto core_restore_end;
 	}
 
+	if (args->uffd >= 0 && register_lazy_vmas(args))
+		goto core_restore_end;
+
 	/*
 	 * OK, lets try to map new one.
 	 */
@@ -267,16 +267,12 @@ static int recv_pipe_fd(struct pipe_info *pi)
 	int tmp, fd;
 
 	fle = file_master(&pi->d);
-	fd = fle->fe->fd;
 
-	pr_info("\tWaiting fd for %d\n", fd);
-
-	tmp = recv_fd(fd);
+	tmp = recv_fd_from_peer(fle);
 	if (tmp < 0) {
-		pr_err("Can't get fd %d\n", tmp);
+		pr_err("Can't get fd %d\n", fle->fe->fd);
 		return -1;
 	}
-	close(fd);
 
 	if (pi->reopen)
 		fd = reopen_pipe(tmp, pi->pe->flags);
@@ -297,7 +293,6 @@ static int open_pipe(struct file_desc *d)
 	struct pipe_info *pi, *p;
 	int ret, tmp;
 	int pfd[2];
-	int sock;
 
 	pi = container_of(d, struct pipe_info, d);
 
@@ -316,12 +311,6 @@ static int open_pipe(struct file_desc *d)
 	if (ret)
 		return -1;
 
-	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		pr_perror("Can't create socket");
-		return -1;
-	}
-
 	list_for_each_entry(p, &pi->pipe_list, pipe_list) {
 		struct fdinfo_list_entry *fle;
 		int fd;
@@ -329,14 +318,12 @@ static int open_pipe(struct file_desc *d)
 		fle = file_master(&p->d);
 		fd = pfd[p->pe->flags & O_WRONLY];
 
-		if (send_fd_to_peer(fd, fle, sock)) {
-			pr_perror("Can't send file descriptor");
+		if (send_fd_to_peer(fd, fle)) {
+			pr_err("Can't send file descriptor\n");
 			return -1;
 		}
 	}
 
-	close(sock);
-
 	close(pfd[!(pi->pe->flags & O_WRONLY)]);
 	tmp = pfd[pi->pe->flags & O_WRONLY];
 
@@ -460,6 +447,10 @@ int dump_one_pipe_data(struct pipe_data_dump *pd, int lfd, const struct fd_parms
 	if (bytes) {
 		int wrote;
 
+		/* The entry is still in the image buffer */
+		if (img_buf_flush(img))
+			goto err_close;
+
 		wrote = splice(steal_pipe[0], NULL, img, NULL, bytes, 0);
 		if (wrote < 0) {
 			pr_perror("Can't push pipe data");
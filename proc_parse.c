@@ -70,29 +70,6 @@ int parse_cpuinfo_features(int (*handler)(char *tok))
 	return 0;
 }
 
-/* check the @line starts with "%lx-%lx" format */
-static bool is_vma_range_fmt(char *line)
-{
-#define ____is_vma_addr_char(__c)		\
-	(((__c) <= '9' && (__c) >= '0') ||	\
-	((__c) <= 'f' && (__c) >= 'a'))
-
-	while (*line && ____is_vma_addr_char(*line))
-		line++;
-
-	if (*line++ != '-')
-		return false;
-
-	while (*line && ____is_vma_addr_char(*line))
-		line++;
-
-	if (*line++ != ' ')
-		return false;
-
-	return true;
-#undef ____is_vma_addr_char
-}
-
 static int parse_vmflags(char *buf, struct vma_area *vma_area)
 {
 	char *tok;
@@ -284,30 +261,169 @@ int parse_self_maps_lite(struct vm_area_list *vms)
 	return 0;
 }
 
-static char smaps_buf[PAGE_SIZE];
+/*
+ * Tasks may have tens of thousands of VMAs and thus megabytes of
+ * smaps, so it's read in big chunks and parsed by hand. Only VMA
+ * header and VmFlags lines matter, the latter are the reason for
+ * using smaps instead of maps -- the kernel reports them nowhere
+ * else.
+ */
+#define SMAPS_BUF_SIZE	(64 * PAGE_SIZE)
+
+struct smaps_buf {
+	int	fd;
+	char	*pos;
+	char	*end;
+	char	buf[SMAPS_BUF_SIZE + 1];
+};
+
+static struct smaps_buf smaps_buf;
+
+/* Returns next line without \n, or NULL on EOF or error */
+static char *smaps_next_line(struct smaps_buf *sb)
+{
+	char *line, *nl;
+	ssize_t ret;
+
+	while (1) {
+		nl = memchr(sb->pos, '\n', sb->end - sb->pos);
+		if (nl) {
+			line = sb->pos;
+			*nl = '\0';
+			sb->pos = nl + 1;
+			return line;
+		}
+
+		/* Move the partial line to the head and read more */
+		memmove(sb->buf, sb->pos, sb->end - sb->pos);
+		sb->end -= sb->pos - sb->buf;
+		sb->pos = sb->buf;
+
+		if (sb->end == sb->buf + SMAPS_BUF_SIZE) {
+			pr_err("Too long line in smaps\n");
+			return NULL;
+		}
+
+		ret = read(sb->fd, sb->end, sb->buf + SMAPS_BUF_SIZE - sb->end);
+		if (ret < 0) {
+			pr_perror("Can't read smaps");
+			return NULL;
+		}
+
+		if (ret == 0) {
+			if (sb->end == sb->buf)
+				return NULL;
+
+			/* Last line without \n */
+			*sb->end = '\0';
+			line = sb->buf;
+			sb->pos = sb->end;
+			return line;
+		}
+
+		sb->end += ret;
+	}
+}
+
+static inline char *parse_hex(char *s, unsigned long *val)
+{
+	unsigned long v = 0;
+
+	for (;; s++) {
+		if (*s >= '0' && *s <= '9')
+			v = (v << 4) | (*s - '0');
+		else if (*s >= 'a' && *s <= 'f')
+			v = (v << 4) | (*s - 'a' + 10);
+		else
+			break;
+	}
+
+	*val = v;
+	return s;
+}
+
+static inline char *parse_dec(char *s, unsigned long *val)
+{
+	unsigned long v = 0;
+
+	for (; *s >= '0' && *s <= '9'; s++)
+		v = v * 10 + (*s - '0');
+
+	*val = v;
+	return s;
+}
+
+static inline bool is_vma_header(char *line)
+{
+	/* Other lines start with capitalized field names */
+	return (line[0] >= '0' && line[0] <= '9') ||
+		(line[0] >= 'a' && line[0] <= 'f');
+}
+
+/*
+ * Parses "start-end rwxp pgoff maj:min ino   path" header,
+ * @path is set to the path, which may be empty.
+ */
+static int parse_vma_header(char *l, unsigned long *start, unsigned long *end,
+		char *perms, unsigned long *pgoff, struct vma_file_info *vfi,
+		char **path)
+{
+	unsigned long maj, min;
+
+	l = parse_hex(l, start);
+	if (*l++ != '-')
+		return -1;
+	l = parse_hex(l, end);
+	if (*l++ != ' ')
+		return -1;
+
+	if (!l[0] || !l[1] || !l[2] || !l[3] || l[4] != ' ')
+		return -1;
+	memcpy(perms, l, 4);
+	l += 5;
+
+	l = parse_hex(l, pgoff);
+	if (*l++ != ' ')
+		return -1;
+
+	l = parse_hex(l, &maj);
+	if (*l++ != ':')
+		return -1;
+	l = parse_hex(l, &min);
+	if (*l++ != ' ')
+		return -1;
+	vfi->dev_maj = maj;
+	vfi->dev_min = min;
+
+	l = parse_dec(l, &vfi->ino);
+	if (*l != ' ' && *l != '\0')
+		return -1;
+
+	while (*l == ' ')
+		l++;
+	*path = l;
+
+	return 0;
+}
 
 int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_files)
 {
 	struct vma_area *vma_area = NULL;
 	unsigned long start, end, pgoff, prev_end = 0;
-	char r, w, x, s;
+	char perms[4];
 	int ret = -1;
 	struct vma_file_info vfi;
 	struct vma_file_info prev_vfi = {};
+	struct smaps_buf *sb = &smaps_buf;
 
 	DIR *map_files_dir = NULL;
-	FILE *smaps = NULL;
 
-	vma_area_list->nr = 0;
-	vma_area_list->longest = 0;
-	vma_area_list->priv_size = 0;
-	INIT_LIST_HEAD(&vma_area_list->h);
+	vm_area_list_init(vma_area_list);
 
-	smaps = fopen_proc(pid, "smaps");
-	if (!smaps)
+	sb->fd = open_proc(pid, "smaps");
+	if (sb->fd < 0)
 		goto err;
-
-	setvbuf(smaps, smaps_buf, _IOFBF, sizeof(smaps_buf));
+	sb->pos = sb->end = sb->buf;
 
 	if (use_map_files) {
 		map_files_dir = opendir_proc(pid, "map_files");
@@ -316,14 +432,14 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 	}
 
 	while (1) {
-		int num;
-		char file_path[6];
+		char *line, *path = NULL;
 		bool eof;
 
-		eof = (fgets(buf, BUF_SIZE, smaps) == NULL);
+		line = smaps_next_line(sb);
+		eof = (line == NULL);
 
-		if (!eof && !is_vma_range_fmt(buf)) {
-			if (!strncmp(buf, "Nonlinear", 9)) {
+		if (!eof && !is_vma_header(line)) {
+			if (!strncmp(line, "Nonlinear", 9)) {
 				BUG_ON(!vma_area);
 				pr_err("Nonlinear mapping found %016"PRIx64"-%016"PRIx64"\n",
 				       vma_area->e->start, vma_area->e->end);
@@ -333,9 +449,9 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 				 */
 				vma_area = NULL;
 				goto err;
-			} else if (!strncmp(buf, "VmFlags: ", 9)) {
+			} else if (!strncmp(line, "VmFlags: ", 9)) {
 				BUG_ON(!vma_area);
-				if (parse_vmflags(&buf[9], vma_area))
+				if (parse_vmflags(&line[9], vma_area))
 					goto err;
 				continue;
 			} else
@@ -372,16 +488,12 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 		if (eof)
 			break;
 
-		vma_area = alloc_vma_area();
+		vma_area = alloc_vma_area_in(vma_area_list);
 		if (!vma_area)
 			goto err;
 
-		memset(file_path, 0, 6);
-		num = sscanf(buf, "%lx-%lx %c%c%c%c %lx %x:%x %lu %5s",
-			     &start, &end, &r, &w, &x, &s, &pgoff,
-			     &vfi.dev_maj, &vfi.dev_min, &vfi.ino, file_path);
-		if (num < 10) {
-			pr_err("Can't parse: %s\n", buf);
+		if (parse_vma_header(line, &start, &end, perms, &pgoff, &vfi, &path)) {
+			pr_err("Can't parse: %s\n", line);
 			goto err;
 		}
 
@@ -390,30 +502,35 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 		vma_area->e->pgoff	= pgoff;
 		vma_area->e->prot	= PROT_NONE;
 
-		if (vma_get_mapfile(vma_area, map_files_dir, &vfi, &prev_vfi))
+		/*
+		 * Private anonymous VMAs have no map_files link, so
+		 * don't waste a syscall on each of them.
+		 */
+		if ((vfi.ino || vfi.dev_maj || vfi.dev_min) &&
+		    vma_get_mapfile(vma_area, map_files_dir, &vfi, &prev_vfi))
 			goto err_bogus_mapfile;
 
-		if (r == 'r')
+		if (perms[0] == 'r')
 			vma_area->e->prot |= PROT_READ;
-		if (w == 'w')
+		if (perms[1] == 'w')
 			vma_area->e->prot |= PROT_WRITE;
-		if (x == 'x')
+		if (perms[2] == 'x')
 			vma_area->e->prot |= PROT_EXEC;
 
-		if (s == 's')
+		if (perms[3] == 's')
 			vma_area->e->flags = MAP_SHARED;
-		else if (s == 'p')
+		else if (perms[3] == 'p')
 			vma_area->e->flags = MAP_PRIVATE;
 		else {
-			pr_err("Unexpected VMA met (%c)\n", s);
+			pr_err("Unexpected VMA met (%c)\n", perms[3]);
 			goto err;
 		}
 
 		if (vma_area->e->status != 0) {
 			continue;
-		} else if (strstr(buf, "[vsyscall]") || strstr(buf, "[vectors]")) {
+		} else if (!strcmp(path, "[vsyscall]") || !strcmp(path, "[vectors]")) {
 			vma_area->e->status |= VMA_AREA_VSYSCALL;
-		} else if (strstr(buf, "[vdso]")) {
+		} else if (!strcmp(path, "[vdso]")) {
 #ifdef CONFIG_VDSO
 			vma_area->e->status |= VMA_AREA_REGULAR;
 			if ((vma_area->e->prot & VDSO_PROT) == VDSO_PROT)
@@ -422,7 +539,7 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 			pr_warn_once("Found vDSO area without support\n");
 			goto err;
 #endif
-		} else if (strstr(buf, "[vvar]")) {
+		} else if (!strcmp(path, "[vvar]")) {
 #ifdef CONFIG_VDSO
 			vma_area->e->status |= VMA_AREA_REGULAR;
 			if ((vma_area->e->prot & VVAR_PROT) == VVAR_PROT)
@@ -431,7 +548,7 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 			pr_warn_once("Found VVAR area without support\n");
 			goto err;
 #endif
-		} else if (strstr(buf, "[heap]")) {
+		} else if (!strcmp(path, "[heap]")) {
 			vma_area->e->status |= VMA_AREA_REGULAR | VMA_AREA_HEAP;
 		} else {
 			vma_area->e->status = VMA_AREA_REGULAR;
@@ -494,8 +611,8 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 				vma_area->e->status |= VMA_ANON_SHARED;
 				vma_area->e->shmid = st_buf->st_ino;
 
-				if (!strcmp(file_path, "/SYSV")) {
-					pr_info("path: %s\n", file_path);
+				if (!strncmp(path, "/SYSV", 5)) {
+					pr_info("path: %s\n", path);
 					vma_area->e->status |= VMA_AREA_SYSVIPC;
 				}
 			} else {
@@ -522,13 +639,11 @@ int parse_smaps(pid_t pid, struct vm_area_list *vma_area_list, bool use_map_file
 	ret = 0;
 
 err:
-	if (smaps)
-		fclose(smaps);
+	close_safe(&sb->fd);
 
 	if (map_files_dir)
 		closedir(map_files_dir);
 
-	xfree(vma_area);
 	return ret;
 
 err_bogus_mapping:
@@ -59,6 +59,7 @@
 #include "protobuf/tun.pb-c.h"
 #include "protobuf/cgroup.pb-c.h"
 #include "protobuf/timerfd.pb-c.h"
+#include "protobuf/tmpfs.pb-c.h"
 
 struct cr_pb_message_desc cr_pb_descs[PB_MAX];
 
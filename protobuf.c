@@ -527,7 +527,7 @@ int do_pb_read_one(int fd, void **pobj, int type, bool eof)
 
 	*pobj = NULL;
 
-	ret = read(fd, &size, sizeof(size));
+	ret = img_read(fd, &size, sizeof(size));
 	if (ret == 0) {
 		if (eof) {
 			return 0;
@@ -550,7 +550,7 @@ int do_pb_read_one(int fd, void **pobj, int type, bool eof)
 			goto err;
 	}
 
-	ret = read(fd, buf, size);
+	ret = img_read(fd, buf, size);
 	if (ret < 0) {
 		pr_perror("Can't read %d bytes from file %s",
 			  size, image_name(fd));
@@ -617,7 +617,7 @@ int pb_write_one(int fd, void *obj, int type)
 	iov[1].iov_base = buf;
 	iov[1].iov_len = size;
 
-	ret = writev(fd, iov, 2);
+	ret = img_writev(fd, iov, 2);
 	if (ret != size + sizeof(size)) {
 		pr_perror("Can't write %d bytes", (int)(size + sizeof(size)));
 		goto err;
@@ -640,7 +640,7 @@ int collect_image(struct collect_image_info *cinfo)
 	pr_info("Collecting %d/%d (flags %x)\n",
 			cinfo->fd_type, cinfo->pb_type, cinfo->flags);
 
-	fd = open_image(cinfo->fd_type, O_RSTR | (optional ? O_OPT : 0));
+	fd = open_image(cinfo->fd_type, O_RSTR | O_BUF | (optional ? O_OPT : 0));
 	if (fd < 0) {
 		if (optional && fd == -ENOENT)
 			return 0;
@@ -683,7 +683,7 @@ int collect_image(struct collect_image_info *cinfo)
 			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
 	}
 
-	close(fd);
+	close_image(fd);
 	pr_debug(" `- ... done\n");
 	return ret;
 }
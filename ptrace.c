@@ -42,58 +42,84 @@ int unseize_task(pid_t pid, int orig_st, int st)
  * interface, and finally we can detach ptrace out of
  * of it so the task would not know if it was saddled
  * up with someone else.
+ *
+ * It's split into two halves. The seize_catch_task() only
+ * attaches to the task and asks it to stop, the seize_wait_task()
+ * waits for it to do so. When the tree is frozen with the freezer
+ * cgroup the former is called for all tasks at once before thawing
+ * and the latter then collects them all already stopped.
  */
 
-int seize_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid)
+int seize_catch_task(pid_t pid)
 {
-	siginfo_t si;
-	int status;
-	int ret, ret2, ptrace_errno;
-	struct proc_pid_stat_small ps;
+	int ret;
 
 	ret = ptrace(PTRACE_SEIZE, pid, NULL, 0);
-	ptrace_errno = errno;
-	if (ret == 0) {
+	if (ret) {
 		/*
-		 * If we SEIZE-d the task stop it before going
-		 * and reading its stat from proc. Otherwise task
-		 * may die _while_ we're doing it and we'll have
-		 * inconsistent seize/state pair.
-		 *
-		 * If task dies after we seize it but before we
-		 * do this interrupt, we'll notice it via proc.
+		 * It's ugly, but the ptrace API doesn't allow to distinguish
+		 * attaching to zombie from other errors. All errors will be
+		 * handled in seize_wait_task().
 		 */
-		ret = ptrace(PTRACE_INTERRUPT, pid, NULL, NULL);
-		if (ret < 0) {
-			pr_perror("SEIZE %d: can't interrupt task", pid);
-			ptrace(PTRACE_DETACH, pid, NULL, NULL);
-			goto err;
-		}
+		return 0;
+	}
+
+	/*
+	 * If we SEIZE-d the task stop it before going
+	 * and reading its stat from proc. Otherwise task
+	 * may die _while_ we're doing it and we'll have
+	 * inconsistent seize/state pair.
+	 *
+	 * If task dies after we seize it but before we
+	 * do this interrupt, we'll notice it via proc.
+	 */
+	ret = ptrace(PTRACE_INTERRUPT, pid, NULL, NULL);
+	if (ret < 0) {
+		pr_perror("SEIZE %d: can't interrupt task", pid);
+		ptrace(PTRACE_DETACH, pid, NULL, NULL);
 	}
 
+	return ret;
+}
+
+int seize_wait_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid)
+{
+	siginfo_t si;
+	int status;
+	int ret, ret2, wait_errno = 0;
+	struct proc_pid_stat_small ps;
+
 	/*
-	 * It's ugly, but the ptrace API doesn't allow to distinguish
-	 * attaching to zombie from other errors. Thus we have to parse
-	 * the target's /proc/pid/stat. Sad, but parse whatever else
-	 * we might nead at that early point.
+	 * The wait4() can only fail here if we didn't manage
+	 * to seize the task, i.e. when it's a zombie (or
+	 * someone else's). Once we get to the try_again label
+	 * we trace the task, so it fails here at most once.
 	 */
+	ret = wait4(pid, &status, __WALL, NULL);
+	if (ret < 0)
+		wait_errno = errno;
 
+	/*
+	 * The stat is parsed after the task is stopped, so we
+	 * get consistent state, and whatever else we might need
+	 * at that early point.
+	 */
 	ret2 = parse_pid_stat_small(pid, &ps);
 	if (ret2 < 0)
-		return -1;
+		goto err;
 
 	if (pgid)
 		*pgid = ps.pgid;
 	if (sid)
 		*sid = ps.sid;
 
-	if (ret < 0) {
+	if (ret < 0 || WIFEXITED(status) || WIFSIGNALED(status)) {
 		if (ps.state != 'Z') {
 			if (pid == getpid())
 				pr_err("The criu itself is within dumped tree.\n");
 			else
 				pr_err("Unseizable non-zombie %d found, state %c, err %d/%d\n",
-						pid, ps.state, ret, ptrace_errno);
+						pid, ps.state, ret, wait_errno);
 			return -1;
 		}
 
@@ -106,6 +132,8 @@ int seize_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid)
 		goto err;
 	}
 
+	goto check_stop;
+
 try_again:
 	ret = wait4(pid, &status, __WALL, NULL);
 	if (ret < 0) {
@@ -113,6 +141,7 @@ try_again:
 		goto err;
 	}
 
+check_stop:
 	if (ret != pid) {
 		pr_err("SEIZE %d: wrong task attached (%d)\n", pid, ret);
 		goto err;
@@ -189,6 +218,14 @@ err:
 	return -1;
 }
 
+int seize_task(pid_t pid, pid_t ppid, pid_t *pgid, pid_t *sid)
+{
+	if (seize_catch_task(pid))
+		return -1;
+
+	return seize_wait_task(pid, ppid, pgid, sid);
+}
+
 int ptrace_peek_area(pid_t pid, void *dst, void *addr, long bytes)
 {
 	unsigned long w;
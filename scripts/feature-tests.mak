@@ -39,6 +39,15 @@ int main(void)
 }
 endef
 
+define LZ4_DEV_TEST
+#include <lz4.h>
+
+int main(void)
+{
+	return LZ4_compressBound(0);
+}
+endef
+
 define STRLCPY_TEST
 
 #include <string.h>
@@ -2,6 +2,7 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "pid.h"
 #include "shmem.h"
@@ -11,6 +12,7 @@
 #include "page-xfer.h"
 #include "rst-malloc.h"
 #include "vma.h"
+#include "servicefd.h"
 
 #include "protobuf.h"
 #include "protobuf/pagemap.pb-c.h"
@@ -111,55 +113,35 @@ static int shmem_wait_and_open(int pid, struct shmem_info *si)
 	return ret;
 }
 
-static int restore_shmem_content(void *addr, struct shmem_info *si)
+static int do_restore_shmem_content(void *addr, unsigned long size,
+		unsigned long shmid, int pr_type)
 {
-	int ret = 0;
+	int ret;
 	struct page_read pr;
-	unsigned long off_real;
 
-	ret = open_page_read(si->shmid, &pr, opts.auto_dedup ? O_RDWR : O_RSTR, true);
+	ret = open_page_read(shmid, &pr, opts.auto_dedup ? O_RDWR : O_RSTR, pr_type);
 	if (ret)
-		goto err_unmap;
-
-	while (1) {
-		unsigned long vaddr;
-		unsigned nr_pages;
-		struct iovec iov;
-
-		ret = pr.get_pagemap(&pr, &iov);
-		if (ret <= 0)
-			break;
-
-		vaddr = (unsigned long)iov.iov_base;
-		nr_pages = iov.iov_len / PAGE_SIZE;
-
-		if (vaddr + nr_pages * PAGE_SIZE > si->size)
-			break;
-
-		off_real = lseek(pr.fd_pg, 0, SEEK_CUR);
+		return -1;
 
-		ret = read(pr.fd_pg, addr + vaddr, nr_pages * PAGE_SIZE);
-		if (ret != nr_pages * PAGE_SIZE) {
-			ret = -1;
-			break;
-		}
+	ret = page_read_all(&pr, addr, size);
+	pr.close(&pr);
+	return ret;
+}
 
-		if (opts.auto_dedup) {
-			ret = punch_hole(&pr, off_real, nr_pages * PAGE_SIZE, false);
-			if (ret == -1) {
-				break;
-			}
-		}
+static int restore_shmem_content(void *addr, struct shmem_info *si)
+{
+	int ret;
 
-		if (pr.put_pagemap)
-			pr.put_pagemap(&pr);
-	}
+	ret = do_restore_shmem_content(addr, si->size, si->shmid, PR_SHMEM);
+	if (ret < 0)
+		munmap(addr, si->size);
 
-	pr.close(&pr);
 	return ret;
-err_unmap:
-	munmap(addr,  si->size);
-	return -1;
+}
+
+int restore_sysv_shmem_content(void *addr, unsigned long size, unsigned long shmid)
+{
+	return do_restore_shmem_content(addr, size, shmid, PR_SYSV_SHMEM);
 }
 
 int get_shmem_fd(int pid, VmaEntry *vi)
@@ -282,33 +264,146 @@ static int dump_pages(struct page_pipe *pp, struct page_xfer *xfer, void *addr)
 	return page_xfer_dump_pages(xfer, pp, (unsigned long)addr);
 }
 
-static int dump_one_shmem(struct shmem_info_dump *si)
+/*
+ * Soft-dirty bits can't tell which shmem pages changed: they live in
+ * the ptes of each task mapping the segment and are lost once a pte
+ * is zapped, while the page itself stays in the page cache. Thus
+ * with --track-mem every dumped page gets its contents hash saved in
+ * the shmem-hashes image, and pages with the same hash and contents
+ * as in parent are written as holes. Zero hash stands for a page not
+ * dumped. Pre-dump writes them too, so iterations start from it.
+ */
+static u64 shmem_page_hash(void *page)
+{
+	u64 *w = page, h = 0;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*w); i++) {
+		h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+
+	return h ? : 1;
+}
+
+#define SHMEM_HASHES_BATCH	(1 << 17)	/* hashes per img read/write */
+
+static u64 *load_parent_hashes(struct shmem_info_dump *si, unsigned long nrpages)
+{
+	unsigned long nr, i, n;
+	struct stat st;
+	int pfd, fd;
+	u64 *h;
+
+	if (!opts.track_mem || !opts.img_parent)
+		return NULL;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0)
+		return NULL;
+
+	fd = open_image_at(pfd, CR_FD_SHMEM_HASHES, O_RSTR | O_OPT, si->shmid);
+	close(pfd);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat shmem hashes");
+		close(fd);
+		return NULL;
+	}
+
+	/* The segment could have grown since parent was dumped */
+	nr = min(nrpages, (unsigned long)st.st_size / sizeof(*h));
+	h = xzalloc(nrpages * sizeof(*h));
+	if (!h) {
+		close(fd);
+		return NULL;
+	}
+
+	for (i = 0; i < nr; i += n) {
+		n = min(nr - i, (unsigned long)SHMEM_HASHES_BATCH);
+		if (read_img_buf(fd, h + i, n * sizeof(*h)) < 0) {
+			xfree(h);
+			h = NULL;
+			break;
+		}
+	}
+
+	close(fd);
+	return h;
+}
+
+static int open_parent_shmem(struct shmem_info_dump *si, struct page_read *ppr)
+{
+	int pfd, ret;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0)
+		return -1;
+
+	ret = open_page_read_at(pfd, si->shmid, ppr, O_RSTR, PR_SHMEM);
+	close(pfd);
+	return ret;
+}
+
+/*
+ * Equal hashes only tell the page is likely not changed, so it's
+ * compared with the parent's one. Pages are just peeked at here,
+ * the parent is opened O_RSTR, so they are not punched out of it
+ * with --auto-dedup.
+ */
+static bool shmem_page_in_parent(struct page_read *ppr, void *page,
+		unsigned long off, void *buf)
+{
+	if (seek_pagemap_page(ppr, off, false) <= 0)
+		return false;
+
+	return ppr->read_pages(ppr, off, 1, buf) > 0 &&
+		!memcmp(page, buf, PAGE_SIZE);
+}
+
+static int dump_hashes(struct shmem_info_dump *si, u64 *h, unsigned long nrpages)
+{
+	unsigned long i, n;
+	int fd, ret = 0;
+
+	fd = open_image(CR_FD_SHMEM_HASHES, O_DUMP, si->shmid);
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < nrpages; i += n) {
+		n = min(nrpages - i, (unsigned long)SHMEM_HASHES_BATCH);
+		ret = write_img_buf(fd, h + i, n * sizeof(*h));
+		if (ret)
+			break;
+	}
+
+	close(fd);
+	return ret;
+}
+
+static int do_dump_one_shmem(void *addr, unsigned long size, int fd_type,
+		unsigned long shmid, u64 *hashes, u64 *phashes,
+		struct page_read *ppr, bool all)
 {
 	struct iovec *iovs;
 	struct page_pipe *pp;
 	struct page_xfer xfer;
-	int err, ret = -1, fd;
+	int err, ret = -1;
 	unsigned char *map = NULL;
-	void *addr = NULL;
-	unsigned long pfn, nrpages;
-
-	pr_info("Dumping shared memory %ld\n", si->shmid);
+	void *pbuf = NULL;
+	unsigned long pfn, nrpages, nr_iovs, nr_holes = 0;
 
-	nrpages = (si->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	nrpages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
 	map = xmalloc(nrpages * sizeof(*map));
 	if (!map)
 		goto err;
 
-	fd = open_proc(si->pid, "map_files/%lx-%lx", si->start, si->end);
-	if (fd < 0)
-		goto err;
-
-	addr = mmap(NULL, si->size, PROT_READ, MAP_SHARED, fd, 0);
-	close(fd);
-	if (addr == MAP_FAILED) {
-		pr_err("Can't map shmem 0x%lx (0x%lx-0x%lx)\n",
-				si->shmid, si->start, si->end);
-		goto err;
+	if (phashes) {
+		pbuf = xmalloc(PAGE_SIZE);
+		if (!pbuf)
+			goto err;
 	}
 
 	/*
@@ -318,25 +413,43 @@ static int dump_one_shmem(struct shmem_info_dump *si)
 	 * this case.
 	 */
 
-	err = mincore(addr, si->size, map);
-	if (err)
-		goto err_unmap;
+	if (all)
+		memset(map, PAGE_RSS, nrpages);
+	else {
+		err = mincore(addr, size, map);
+		if (err)
+			goto err;
+	}
 
-	iovs = xmalloc(((nrpages + 1) / 2) * sizeof(struct iovec));
+	nr_iovs = min((nrpages + 1) / 2, (unsigned long)PAGE_PIPE_MAX_IOVS);
+	iovs = xmalloc(nr_iovs * sizeof(struct iovec));
 	if (!iovs)
-		goto err_unmap;
+		goto err;
 
-	pp = create_page_pipe((nrpages + 1) / 2, iovs, true);
+	pp = create_page_pipe(nr_iovs, iovs, true);
 	if (!pp)
 		goto err_iovs;
 
-	err = open_page_xfer(&xfer, CR_FD_SHMEM_PAGEMAP, si->shmid);
+	err = open_page_xfer(&xfer, fd_type, shmid);
 	if (err)
 		goto err_pp;
 
 	for (pfn = 0; pfn < nrpages; pfn++) {
 		if (!(map[pfn] & PAGE_RSS))
 			continue;
+
+		if (hashes) {
+			hashes[pfn] = shmem_page_hash(addr + pfn * PAGE_SIZE);
+			if (phashes && phashes[pfn] == hashes[pfn] &&
+			    shmem_page_in_parent(ppr, addr + pfn * PAGE_SIZE,
+				    pfn * PAGE_SIZE, pbuf)) {
+				ret = page_pipe_add_hole(pp, (unsigned long)addr + pfn * PAGE_SIZE);
+				if (ret)
+					goto err_xfer;
+				nr_holes++;
+				continue;
+			}
+		}
 again:
 		ret = page_pipe_add_page(pp, (unsigned long)addr + pfn * PAGE_SIZE);
 		if (ret == -EAGAIN) {
@@ -350,20 +463,133 @@ again:
 	}
 
 	ret = dump_pages(pp, &xfer, addr);
+	if (!ret && phashes)
+		pr_info("\t%lu pages of shmem %ld are in parent\n", nr_holes, shmid);
 
 err_xfer:
-	xfer.close(&xfer);
+	if (xfer.close(&xfer))
+		ret = -1;
 err_pp:
 	destroy_page_pipe(pp);
 err_iovs:
 	xfree(iovs);
-err_unmap:
-	munmap(addr,  si->size);
 err:
+	xfree(pbuf);
 	xfree(map);
 	return ret;
 }
 
+static int dump_one_shmem(struct shmem_info_dump *si)
+{
+	int ret = -1, fd;
+	void *addr;
+	u64 *hashes = NULL, *phashes = NULL;
+	struct page_read ppr;
+	unsigned long nrpages;
+
+	pr_info("Dumping shared memory %ld\n", si->shmid);
+
+	nrpages = (si->size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	fd = open_proc(si->pid, "map_files/%lx-%lx", si->start, si->end);
+	if (fd < 0)
+		return -1;
+
+	addr = mmap(NULL, si->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("Can't map shmem 0x%lx (0x%lx-0x%lx)\n",
+				si->shmid, si->start, si->end);
+		return -1;
+	}
+
+	if (opts.track_mem) {
+		hashes = xzalloc(nrpages * sizeof(*hashes));
+		if (!hashes)
+			goto err;
+
+		phashes = load_parent_hashes(si, nrpages);
+		if (phashes && open_parent_shmem(si, &ppr)) {
+			pr_warn("No parent pages for shmem %ld\n", si->shmid);
+			xfree(phashes);
+			phashes = NULL;
+		}
+	}
+
+	ret = do_dump_one_shmem(addr, si->size, CR_FD_SHMEM_PAGEMAP,
+			si->shmid, hashes, phashes, &ppr, false);
+	if (!ret && hashes)
+		ret = dump_hashes(si, hashes, nrpages);
+
+	if (phashes)
+		ppr.close(&ppr);
+err:
+	xfree(phashes);
+	xfree(hashes);
+	munmap(addr, si->size);
+	return ret;
+}
+
+/*
+ * Swapped out pages of a segment are not reported by mincore, so
+ * if there are any (or we can't tell) all the segment is dumped.
+ */
+static bool sysv_shmem_swapped(unsigned long shmid)
+{
+	char buf[512];
+	bool ret = true;
+	FILE *f;
+
+	f = fopen("/proc/sysvipc/shm", "r");
+	if (!f) {
+		pr_perror("Can't open sysvipc shm");
+		return true;
+	}
+
+	/* Skip the header */
+	if (!fgets(buf, sizeof(buf), f))
+		goto out;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		unsigned long swap;
+		int id;
+
+		/*
+		 * key shmid perms size cpid lpid nattch uid gid cuid cgid
+		 * atime dtime ctime rss swap, the last two are not always there
+		 */
+		if (sscanf(buf, "%*d %d %*o %*u %*d %*d %*u %*u %*u %*u %*u "
+					"%*u %*u %*u %*u %lu", &id, &swap) != 2)
+			break;
+
+		if (id == shmid) {
+			ret = (swap != 0);
+			break;
+		}
+	}
+out:
+	fclose(f);
+	return ret;
+}
+
+/*
+ * SysV segments are dumped into pagemaps of their own, as their
+ * ids may clash with the anon shmem ones. Only pages present in
+ * the segment get into images, unless some are swapped out. It's
+ * called from the forked namespaces dumper, the pages images ids
+ * are shared with criu, which dumps anon shmem afterwards.
+ */
+int dump_one_sysv_shmem(void *addr, unsigned long size, unsigned long shmid)
+{
+	bool all = sysv_shmem_swapped(shmid);
+
+	if (all)
+		pr_info("Dumping all pages of swapped out SysV shmem %lu\n", shmid);
+
+	return do_dump_one_shmem(addr, size, CR_FD_SYSV_SHMEM_PAGEMAP,
+			shmid, NULL, NULL, NULL, all);
+}
+
 #define for_each_shmem_dump(_i, _si)				\
 	for (i = 0; i < SHMEM_HASH_SIZE; i++)			\
 		for (si = shmems_hash[i]; si; si = si->next)
@@ -373,10 +373,20 @@ int inet_collect_one(struct nlmsghdr *h, int family, int type)
 static int open_inet_sk(struct file_desc *d);
 static int post_open_inet_sk(struct file_desc *d, int sk);
 
+/* Connections built by tcp helpers come via the transport socket */
+static int inet_want_transport(FdinfoEntry *fe, struct file_desc *d)
+{
+	struct inet_sk_info *ii;
+
+	ii = container_of(d, struct inet_sk_info, d);
+	return ii->prebuilt != NULL;
+}
+
 static struct file_desc_ops inet_desc_ops = {
 	.type = FD_TYPES__INETSK,
 	.open = open_inet_sk,
 	.post_open = post_open_inet_sk,
+	.want_transport = inet_want_transport,
 };
 
 static inline int tcp_connection(InetSkEntry *ie)
@@ -389,8 +399,9 @@ static int collect_one_inetsk(void *o, ProtobufCMessage *base)
 	struct inet_sk_info *ii = o;
 
 	ii->ie = pb_msg(base, InetSkEntry);
-	if (tcp_connection(ii->ie))
-		tcp_locked_conn_add(ii);
+	ii->prebuilt = NULL;
+	if (tcp_connection(ii->ie) && tcp_locked_conn_add(ii))
+		return -1;
 
 	/*
 	 * A socket can reuse addr only if all previous sockets allow that,
@@ -467,17 +478,16 @@ static int post_open_inet_sk(struct file_desc *d, int sk)
 	return 0;
 }
 
-static int open_inet_sk(struct file_desc *d)
+/*
+ * Creates a socket for @ii with SO_REUSEADDR set, because some sockets
+ * can be bound to one addr. The origin value of it will be restored in
+ * post_open. This is also called by tcp helpers.
+ */
+int create_inet_sk(struct inet_sk_info *ii)
 {
-	struct inet_sk_info *ii;
-	InetSkEntry *ie;
+	InetSkEntry *ie = ii->ie;
 	int sk, yes = 1;
 
-	ii = container_of(d, struct inet_sk_info, d);
-	ie = ii->ie;
-
-	show_one_inet_img("Restore", ie);
-
 	if (ie->family != AF_INET && ie->family != AF_INET6) {
 		pr_err("Unsupported socket family: %d\n", ie->family);
 		return -1;
@@ -499,14 +509,40 @@ static int open_inet_sk(struct file_desc *d)
 
 	if (ie->v6only) {
 		if (restore_opt(sk, SOL_IPV6, IPV6_V6ONLY, &yes) == -1)
-			return -1;
+			goto err;
 	}
 
-	/*
-	 * Set SO_REUSEADDR, because some sockets can be bound to one addr.
-	 * The origin value of SO_REUSEADDR will be restored in post_open.
-	 */
 	if (restore_opt(sk, SOL_SOCKET, SO_REUSEADDR, &yes))
+		goto err;
+
+	return sk;
+
+err:
+	close(sk);
+	return -1;
+}
+
+static int open_inet_sk(struct file_desc *d)
+{
+	struct inet_sk_info *ii;
+	InetSkEntry *ie;
+	int sk;
+
+	ii = container_of(d, struct inet_sk_info, d);
+	ie = ii->ie;
+
+	show_one_inet_img("Restore", ie);
+
+	if (ii->prebuilt) {
+		sk = recv_prebuilt_tcp(ii);
+		if (sk < 0)
+			return -1;
+
+		goto done;
+	}
+
+	sk = create_inet_sk(ii);
+	if (sk < 0)
 		return -1;
 
 	if (tcp_connection(ie)) {
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include "cr_options.h"
 #include "util.h"
@@ -21,6 +23,8 @@
 #include "config.h"
 #include "cr-show.h"
 #include "kerndat.h"
+#include "pstree.h"
+#include "net.h"
 
 #include "protobuf.h"
 #include "protobuf/tcp-stream.pb-c.h"
@@ -57,6 +61,38 @@ enum {
 static LIST_HEAD(cpt_tcp_repair_sockets);
 static LIST_HEAD(rst_tcp_repair_sockets);
 
+/*
+ * Queues data of all the sockets goes through this one buffer, both
+ * on dump and on restore, instead of allocating one per socket queue.
+ */
+static char *tcp_queue_buf;
+static unsigned int tcp_queue_buf_size;
+
+static void put_tcp_queue_buf(void)
+{
+	xfree(tcp_queue_buf);
+	tcp_queue_buf = NULL;
+	tcp_queue_buf_size = 0;
+}
+
+static char *get_tcp_queue_buf(unsigned int size)
+{
+	char *buf;
+
+	if (size <= tcp_queue_buf_size)
+		return tcp_queue_buf;
+
+	/* Old contents is not needed, so don't make realloc copy it */
+	put_tcp_queue_buf();
+	buf = xmalloc(size);
+	if (!buf)
+		return NULL;
+
+	tcp_queue_buf = buf;
+	tcp_queue_buf_size = size;
+	return buf;
+}
+
 static int tcp_repair_on(int fd)
 {
 	int ret, aux = 1;
@@ -183,6 +219,8 @@ void cpt_unlock_tcp_connections(void)
 
 	list_for_each_entry_safe(sk, n, &cpt_tcp_repair_sockets, rlist)
 		tcp_unlock_one(sk);
+
+	put_tcp_queue_buf();
 }
 
 /*
@@ -209,12 +247,10 @@ void cpt_unlock_tcp_connections(void)
  *
  */
 
-static int tcp_stream_get_queue(int sk, int queue_id,
-		u32 *seq, u32 len, char **bufp)
+static int tcp_stream_get_queue_seq(int sk, int queue_id, u32 *seq)
 {
 	int ret, aux;
 	socklen_t auxl;
-	char *buf;
 
 	pr_debug("\tSet repair queue %d\n", queue_id);
 	aux = queue_id;
@@ -229,36 +265,43 @@ static int tcp_stream_get_queue(int sk, int queue_id,
 	if (ret < 0)
 		goto err_sopt;
 
-	pr_info("\t`- seq %u len %u\n", *seq, len);
-
-	if (len) {
-		/*
-		 * Try to grab one byte more from the queue to
-		 * make sure there are len bytes for real
-		 */
-		buf = xmalloc(len + 1);
-		if (!buf)
-			goto err_buf;
-
-		pr_debug("\tReading queue (%d bytes)\n", len);
-		ret = recv(sk, buf, len + 1, MSG_PEEK | MSG_DONTWAIT);
-		if (ret != len)
-			goto err_recv;
-	} else
-		buf = NULL;
-
-	*bufp = buf;
 	return 0;
 
 err_sopt:
 	pr_perror("\tsockopt failed");
-err_buf:
 	return -1;
+}
+
+static int tcp_stream_dump_queue(int sk, int queue_id, u32 len, int img_fd)
+{
+	int ret, aux = queue_id;
+	char *buf;
+
+	if (!len)
+		return 0;
+
+	ret = setsockopt(sk, SOL_TCP, TCP_REPAIR_QUEUE, &aux, sizeof(aux));
+	if (ret < 0) {
+		pr_perror("\tCan't set repair queue %d", queue_id);
+		return -1;
+	}
+
+	/*
+	 * Try to grab one byte more from the queue to
+	 * make sure there are len bytes for real
+	 */
+	buf = get_tcp_queue_buf(len + 1);
+	if (!buf)
+		return -1;
 
-err_recv:
-	pr_perror("\trecv failed (%d, want %d, errno %d)", ret, len, errno);
-	xfree(buf);
-	goto err_buf;
+	pr_debug("\tReading queue (%d bytes)\n", len);
+	ret = recv(sk, buf, len + 1, MSG_PEEK | MSG_DONTWAIT);
+	if (ret != len) {
+		pr_perror("\trecv failed (%d, want %d, errno %d)", ret, len, errno);
+		return -1;
+	}
+
+	return write_img_buf(img_fd, buf, len);
 }
 
 static int tcp_stream_get_options(int sk, TcpStreamEntry *tse)
@@ -312,7 +355,6 @@ static int dump_tcp_conn_state(struct inet_sk_desc *sk)
 {
 	int ret, img_fd, aux;
 	TcpStreamEntry tse = TCP_STREAM_ENTRY__INIT;
-	char *in_buf, *out_buf;
 
 	/*
 	 * Read queue
@@ -320,10 +362,11 @@ static int dump_tcp_conn_state(struct inet_sk_desc *sk)
 
 	pr_info("Reading inq for socket\n");
 	tse.inq_len = sk->rqlen;
-	ret = tcp_stream_get_queue(sk->rfd, TCP_RECV_QUEUE,
-			&tse.inq_seq, tse.inq_len, &in_buf);
+	ret = tcp_stream_get_queue_seq(sk->rfd, TCP_RECV_QUEUE, &tse.inq_seq);
 	if (ret < 0)
-		goto err_in;
+		goto err_opt;
+
+	pr_info("\t`- seq %u len %u\n", tse.inq_seq, tse.inq_len);
 
 	/*
 	 * Write queue
@@ -333,10 +376,11 @@ static int dump_tcp_conn_state(struct inet_sk_desc *sk)
 	tse.outq_len = sk->wqlen;
 	tse.unsq_len = sk->uwqlen;
 	tse.has_unsq_len = true;
-	ret = tcp_stream_get_queue(sk->rfd, TCP_SEND_QUEUE,
-			&tse.outq_seq, tse.outq_len, &out_buf);
+	ret = tcp_stream_get_queue_seq(sk->rfd, TCP_SEND_QUEUE, &tse.outq_seq);
 	if (ret < 0)
-		goto err_out;
+		goto err_opt;
+
+	pr_info("\t`- seq %u len %u\n", tse.outq_seq, tse.outq_len);
 
 	/*
 	 * Initial options
@@ -368,7 +412,8 @@ static int dump_tcp_conn_state(struct inet_sk_desc *sk)
 	}
 
 	/*
-	 * Push the stuff to image
+	 * Push the stuff to image. The queues data is peeked right
+	 * into the image one queue after another.
 	 */
 
 	img_fd = open_image(CR_FD_TCP_STREAM, O_DUMP, sk->sd.ino);
@@ -379,27 +424,19 @@ static int dump_tcp_conn_state(struct inet_sk_desc *sk)
 	if (ret < 0)
 		goto err_iw;
 
-	if (in_buf) {
-		ret = write_img_buf(img_fd, in_buf, tse.inq_len);
-		if (ret < 0)
-			goto err_iw;
-	}
+	ret = tcp_stream_dump_queue(sk->rfd, TCP_RECV_QUEUE, tse.inq_len, img_fd);
+	if (ret < 0)
+		goto err_iw;
 
-	if (out_buf) {
-		ret = write_img_buf(img_fd, out_buf, tse.outq_len);
-		if (ret < 0)
-			goto err_iw;
-	}
+	ret = tcp_stream_dump_queue(sk->rfd, TCP_SEND_QUEUE, tse.outq_len, img_fd);
+	if (ret < 0)
+		goto err_iw;
 
 	pr_info("Done\n");
 err_iw:
 	close(img_fd);
 err_img:
 err_opt:
-	xfree(out_buf);
-err_out:
-	xfree(in_buf);
-err_in:
 	return ret;
 }
 
@@ -454,37 +491,34 @@ static int restore_tcp_seqs(int sk, TcpStreamEntry *tse)
 
 static int __send_tcp_queue(int sk, int queue, u32 len, int imgfd)
 {
-	int ret, err = -1;
-	int off, max;
+	int ret, max;
 	char *buf;
 
-	buf = xmalloc(len);
+	/*
+	 * The queue is streamed from image in chunks the kernel
+	 * accepts at once, so we never hold more than one of them.
+	 */
+	max = (queue == TCP_SEND_QUEUE) ? tcp_max_wshare : tcp_max_rshare;
+	buf = get_tcp_queue_buf(min(len, (u32)max));
 	if (!buf)
 		return -1;
 
-	if (read_img_buf(imgfd, buf, len) < 0)
-		goto err;
-
-	max = (queue == TCP_SEND_QUEUE) ? tcp_max_wshare : tcp_max_rshare;
-	off = 0;
 	while (len) {
 		int chunk = (len > max ? max : len);
 
-		ret = send(sk, buf + off, chunk, 0);
+		if (read_img_buf(imgfd, buf, chunk) < 0)
+			return -1;
+
+		ret = send(sk, buf, chunk, 0);
 		if (ret != chunk) {
 			pr_perror("Can't restore %d queue data (%d), want (%d:%d)",
 				  queue, ret, chunk, len);
-			goto err;
+			return -1;
 		}
-		off += chunk;
 		len -= chunk;
 	}
 
-	err = 0;
-err:
-	xfree(buf);
-
-	return err;
+	return 0;
 }
 
 static int send_tcp_queue(int sk, int queue, u32 len, int imgfd)
@@ -675,9 +709,337 @@ int restore_one_tcp(int fd, struct inet_sk_info *ii)
 	return 0;
 }
 
-void tcp_locked_conn_add(struct inet_sk_info *ii)
+/*
+ * With --tcp-jobs established connections are put into repair state by
+ * helper processes forked by criu into the tasks' netns, while the tree
+ * is being restored. Each helper gets a contiguous range of connections
+ * and a ring of requests. When a task gets to such a connection in its
+ * prepare_fds, it publishes itself in the connection's tcp_prebuilt and
+ * posts its index into the ring, the helper sends the socket to its
+ * transport, building it right away if it hasn't yet. Helpers live in
+ * criu's pid namespace, so they are only used when tasks get a new one
+ * and pids can't collide.
+ */
+#define TCP_HELPER_AHEAD	64	/* built sockets nobody asked for yet */
+#define PREBUILT_SENT		-2
+
+/*
+ * Each connection is asked for once, so the ring never wraps. Owners
+ * take slots with tail, fill them with index + 1 and bump posted.
+ */
+struct tcp_helper_ring {
+	futex_t		posted;
+	atomic_t	tail;
+	int		from;
+	int		nr;
+	atomic_t	slots[0];
+};
+
+static int nr_rst_tcp_conns;
+static struct inet_sk_info **tcp_conns;
+static struct tcp_helper_ring **tcp_rings;
+static int nr_tcp_jobs;
+static pid_t *tcp_helpers;
+static int nr_tcp_helpers;
+
+static bool tcp_helpers_wanted(void)
+{
+	return opts.tcp_jobs && opts.tcp_established_ok &&
+		(root_ns_mask & CLONE_NEWPID);
+}
+
+int tcp_locked_conn_add(struct inet_sk_info *ii)
 {
 	list_add_tail(&ii->rlist, &rst_tcp_repair_sockets);
+	nr_rst_tcp_conns++;
+
+	if (!tcp_helpers_wanted())
+		return 0;
+
+	ii->prebuilt = shmalloc(sizeof(*ii->prebuilt));
+	if (!ii->prebuilt)
+		return -1;
+
+	ii->prebuilt->ring = NULL;
+	ii->prebuilt->owner = 0;
+	ii->prebuilt->fle = NULL;
+	return 0;
+}
+
+/*
+ * Called by criu after connections are collected, rings are to be
+ * mapped before tasks are forked.
+ */
+int prepare_tcp_helpers(void)
+{
+	struct inet_sk_info *ii;
+	int i, nr = 0, from = 0, to;
+
+	if (!tcp_helpers_wanted()) {
+		if (opts.tcp_jobs && nr_rst_tcp_conns && !(root_ns_mask & CLONE_NEWPID))
+			pr_warn("TCP connections are restored serially, "
+				"--tcp-jobs needs a new pid namespace\n");
+		return 0;
+	}
+
+	if (!nr_rst_tcp_conns)
+		return 0;
+
+	nr_tcp_jobs = min(opts.tcp_jobs, nr_rst_tcp_conns);
+	tcp_conns = xmalloc(nr_rst_tcp_conns * sizeof(*tcp_conns));
+	tcp_rings = xmalloc(nr_tcp_jobs * sizeof(*tcp_rings));
+	if (!tcp_conns || !tcp_rings)
+		return -1;
+
+	list_for_each_entry(ii, &rst_tcp_repair_sockets, rlist)
+		tcp_conns[nr++] = ii;
+
+	for (i = 0; i < nr_tcp_jobs; i++) {
+		struct tcp_helper_ring *r;
+		int j;
+
+		to = (long)nr * (i + 1) / nr_tcp_jobs;
+
+		r = shmalloc(sizeof(*r) + (to - from) * sizeof(r->slots[0]));
+		if (!r)
+			return -1;
+
+		futex_init(&r->posted);
+		atomic_set(&r->tail, 0);
+		r->from = from;
+		r->nr = to - from;
+
+		for (j = 0; j < r->nr; j++) {
+			struct tcp_prebuilt *pb = tcp_conns[from + j]->prebuilt;
+
+			atomic_set(&r->slots[j], 0);
+			pb->ring = r;
+			pb->idx = j;
+		}
+
+		tcp_rings[i] = r;
+		from = to;
+	}
+
+	return 0;
+}
+
+int recv_prebuilt_tcp(struct inet_sk_info *ii)
+{
+	struct fdinfo_list_entry *fle = file_master(&ii->d);
+	struct tcp_prebuilt *pb = ii->prebuilt;
+	struct tcp_helper_ring *r = pb->ring;
+	int pos;
+
+	pr_info("Asking for TCP connection id %x ino %x\n", ii->ie->id, ii->ie->ino);
+
+	pb->fle = fle;
+	pb->owner = getpid();
+
+	pos = atomic_add_return(1, &r->tail) - 1;
+	BUG_ON(pos >= r->nr);
+	atomic_set(&r->slots[pos], pb->idx + 1);
+	futex_inc_and_wake(&r->posted);
+
+	return recv_fd_from_peer(fle);
+}
+
+static int prebuild_one_tcp(struct inet_sk_info *ii)
+{
+	int sk;
+
+	sk = create_inet_sk(ii);
+	if (sk < 0)
+		return -1;
+
+	if (restore_one_tcp(sk, ii)) {
+		close(sk);
+		return -1;
+	}
+
+	return sk;
+}
+
+static int tcp_helper(struct tcp_helper_ring *r)
+{
+	struct inet_sk_info **conns = tcp_conns + r->from;
+	int *fds, sock, i, head = 0, next = 0, nr_built = 0, ret = -1;
+	u32 posted;
+
+	if ((root_ns_mask & CLONE_NEWNET) &&
+	    switch_ns(root_item->pid.real, &net_ns_desc, NULL))
+		return -1;
+
+	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		pr_perror("Can't create transport socket");
+		return -1;
+	}
+
+	fds = xmalloc(r->nr * sizeof(*fds));
+	if (!fds)
+		goto out;
+
+	for (i = 0; i < r->nr; i++)
+		fds[i] = -1;
+
+	while (head < r->nr) {
+		struct tcp_prebuilt *pb;
+
+		/* Read before the slot, not to miss its post */
+		posted = futex_get(&r->posted);
+
+		i = atomic_read(&r->slots[head]);
+		if (i) {
+			i--;
+			pb = conns[i]->prebuilt;
+
+			if (fds[i] < 0) {
+				fds[i] = prebuild_one_tcp(conns[i]);
+				if (fds[i] < 0)
+					goto out;
+				nr_built++;
+			}
+
+			if (send_fds_to_peer(sock, pb->owner, &pb->fle, &fds[i], 1))
+				goto out;
+
+			close(fds[i]);
+			fds[i] = PREBUILT_SENT;
+			nr_built--;
+			head++;
+			continue;
+		}
+
+		/* Nobody waits for us, so build the next ones ahead */
+		while (next < r->nr && fds[next] != -1)
+			next++;
+
+		if (next < r->nr && nr_built < TCP_HELPER_AHEAD) {
+			fds[next] = prebuild_one_tcp(conns[next]);
+			if (fds[next] < 0)
+				goto out;
+			nr_built++;
+			continue;
+		}
+
+		futex_wait_while(&r->posted, posted);
+	}
+
+	ret = 0;
+out:
+	xfree(fds);
+	close(sock);
+	return ret;
+}
+
+/* Called by criu after the tree is forked, so that the netns is populated */
+int rst_tcp_helpers_start(void)
+{
+	sigset_t blockmask, oldmask;
+	pid_t pid;
+	int i;
+
+	if (!nr_tcp_jobs)
+		return 0;
+
+	tcp_helpers = xmalloc(nr_tcp_jobs * sizeof(*tcp_helpers));
+	if (!tcp_helpers)
+		return -1;
+
+	/* Don't let SIGCHLD come before the helper is in the list */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask)) {
+		pr_perror("Can't block SIGCHLD");
+		return -1;
+	}
+
+	for (i = 0; i < nr_tcp_jobs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			pr_perror("Can't fork tcp helper");
+			goto err;
+		}
+
+		if (pid == 0) {
+			int ret;
+
+			sigprocmask(SIG_SETMASK, &oldmask, NULL);
+			ret = tcp_helper(tcp_rings[i]);
+			if (ret)
+				futex_abort_and_wake(&task_entries->nr_in_progress);
+
+			exit(ret ? 1 : 0);
+		}
+
+		pr_info("Started tcp helper %d for %d connections\n", pid, tcp_rings[i]->nr);
+		tcp_helpers[nr_tcp_helpers++] = pid;
+	}
+
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	return 0;
+
+err:
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	return -1;
+}
+
+/*
+ * Called from criu's SIGCHLD handler. Owners would wait for sockets
+ * of a helper killed by a signal forever, so the restore is aborted.
+ * Helpers are not reaped here, rst_tcp_helpers_stop() does it.
+ */
+bool rst_tcp_helpers_failed(void)
+{
+	siginfo_t si;
+	int i;
+
+	for (i = 0; i < nr_tcp_helpers; i++) {
+		si.si_pid = 0;
+		if (waitid(P_PID, tcp_helpers[i], &si, WEXITED | WNOHANG | WNOWAIT))
+			continue;
+
+		if (si.si_pid && (si.si_code != CLD_EXITED || si.si_status))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * All the helpers are done once tasks have their files restored,
+ * on failure they are killed.
+ */
+int rst_tcp_helpers_stop(bool kill_them)
+{
+	int i, nr = nr_tcp_helpers, status, ret = 0;
+
+	/* The SIGCHLD handler doesn't need to look at them any longer */
+	nr_tcp_helpers = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (kill_them)
+			kill(tcp_helpers[i], SIGKILL);
+
+		if (waitpid(tcp_helpers[i], &status, 0) != tcp_helpers[i]) {
+			pr_perror("Can't wait tcp helper %d", tcp_helpers[i]);
+			ret = -1;
+		} else if (!kill_them && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+			pr_err("TCP helper %d failed (%d)\n", tcp_helpers[i], status);
+			ret = -1;
+		}
+	}
+
+	xfree(tcp_helpers);
+	tcp_helpers = NULL;
+	xfree(tcp_rings);
+	tcp_rings = NULL;
+	xfree(tcp_conns);
+	tcp_conns = NULL;
+	nr_tcp_jobs = 0;
+
+	return ret;
 }
 
 void rst_unlock_tcp_connections(void)
@@ -60,24 +60,21 @@ struct unix_sk_desc {
 static LIST_HEAD(unix_sockets);
 
 struct unix_sk_listen_icon {
-	unsigned int			peer_ino;
+	struct sk_hash_node		hash;	/* by peer ino */
 	struct unix_sk_desc		*sk_desc;
-	struct unix_sk_listen_icon	*next;
 };
 
-#define SK_HASH_SIZE		32
-
-static struct unix_sk_listen_icon *unix_listen_icons[SK_HASH_SIZE];
+static struct sk_hash unix_listen_icons;
 
 static struct unix_sk_listen_icon *lookup_unix_listen_icons(int peer_ino)
 {
-	struct unix_sk_listen_icon *ic;
+	struct sk_hash_node *n;
+
+	n = sk_hash_lookup(&unix_listen_icons, peer_ino);
+	if (!n)
+		return NULL;
 
-	for (ic = unix_listen_icons[peer_ino % SK_HASH_SIZE];
-			ic; ic = ic->next)
-		if (ic->peer_ino == peer_ino)
-			return ic;
-	return NULL;
+	return container_of(n, struct unix_sk_listen_icon, hash);
 }
 
 static void show_one_unix(char *act, const struct unix_sk_desc *sk)
@@ -489,22 +486,19 @@ static int unix_collect_one(const struct unix_diag_msg *m,
 		 * to fix up in-flight sockets peers.
 		 */
 		for (i = 0; i < d->nr_icons; i++) {
-			struct unix_sk_listen_icon *e, **chain;
-			int n;
+			struct unix_sk_listen_icon *e;
 
 			e = xzalloc(sizeof(*e));
 			if (!e)
 				goto err;
 
-			n = d->icons[i];
-			chain = &unix_listen_icons[n % SK_HASH_SIZE];
-			e->next = *chain;
-			*chain = e;
+			e->sk_desc = d;
+			if (sk_hash_add(&unix_listen_icons, &e->hash, d->icons[i])) {
+				xfree(e);
+				goto err;
+			}
 
 			pr_debug("\t\tCollected icon %d\n", d->icons[i]);
-
-			e->peer_ino	= n;
-			e->sk_desc	= d;
 		}
 
 
@@ -621,6 +615,7 @@ err:
 struct unix_sk_info {
 	UnixSkEntry *ue;
 	struct list_head list;
+	struct sk_hash_node hash;
 	char *name;
 	unsigned flags;
 	struct unix_sk_info *peer;
@@ -631,16 +626,17 @@ struct unix_sk_info {
 #define USK_PAIR_MASTER		0x1
 #define USK_PAIR_SLAVE		0x2
 
+static struct sk_hash unix_sk_hash;
+
 static struct unix_sk_info *find_unix_sk_by_ino(int ino)
 {
-	struct unix_sk_info *ui;
+	struct sk_hash_node *n;
 
-	list_for_each_entry(ui, &unix_sockets, list) {
-		if (ui->ue->ino == ino)
-			return ui;
-	}
+	n = sk_hash_lookup(&unix_sk_hash, ino);
+	if (!n)
+		return NULL;
 
-	return NULL;
+	return container_of(n, struct unix_sk_info, hash);
 }
 
 static int shutdown_unix_sk(int sk, struct unix_sk_info *ui)
@@ -774,7 +770,7 @@ static int unixsk_should_open_transport(FdinfoEntry *fe,
 
 static int open_unixsk_pair_master(struct unix_sk_info *ui)
 {
-	int sk[2], tsk;
+	int sk[2];
 	struct unix_sk_info *peer = ui->peer;
 	struct fdinfo_list_entry *fle;
 
@@ -803,19 +799,12 @@ static int open_unixsk_pair_master(struct unix_sk_info *ui)
 	if (shutdown_unix_sk(sk[0], ui))
 		return -1;
 
-	tsk = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (tsk < 0) {
-		pr_perror("Can't make transport socket");
-		return -1;
-	}
-
 	fle = file_master(&peer->d);
-	if (send_fd_to_peer(sk[1], fle, tsk)) {
+	if (send_fd_to_peer(sk[1], fle)) {
 		pr_err("Can't send pair slave\n");
 		return -1;
 	}
 
-	close(tsk);
 	close(sk[1]);
 
 	return sk[0];
@@ -831,12 +820,11 @@ static int open_unixsk_pair_slave(struct unix_sk_info *ui)
 	pr_info("Opening pair slave (id %#x ino %#x peer %#x) on %d\n",
 			ui->ue->id, ui->ue->ino, ui->ue->peer, fle->fe->fd);
 
-	sk = recv_fd(fle->fe->fd);
+	sk = recv_fd_from_peer(fle);
 	if (sk < 0) {
 		pr_err("Can't recv pair slave");
 		return -1;
 	}
-	close(fle->fe->fd);
 
 	if (bind_unix_sk(sk, ui))
 		return -1;
@@ -1013,6 +1001,9 @@ static int collect_one_unixsk(void *o, ProtobufCMessage *base)
 		ui->ue->ino, ui->ue->peer,
 		ui->name ? (ui->name[0] ? ui->name : &ui->name[1]) : "-");
 	list_add_tail(&ui->list, &unix_sockets);
+	if (sk_hash_add(&unix_sk_hash, &ui->hash, ui->ue->ino))
+		return -1;
+
 	return file_desc_add(&ui->d, ui->ue->id, &unix_desc_ops);
 }
 
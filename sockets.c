@@ -29,8 +29,6 @@
 #define SOCK_DIAG_BY_FAMILY 20
 #endif
 
-#define SK_HASH_SIZE		32
-
 #ifndef SO_GET_FILTER
 #define SO_GET_FILTER	SO_ATTACH_FILTER
 #endif
@@ -226,10 +224,90 @@ static int restore_socket_filter(int sk, SkOptsEntry *soe)
 	return ret;
 }
 
-static struct socket_desc *sockets[SK_HASH_SIZE];
+#define SK_HASH_MIN_BITS	6
+#define SK_HASH_MAX_BITS	20
+
+static unsigned long sk_hash_lookups, sk_hash_steps;
+
+static inline unsigned int sk_hash_chain(unsigned int ino, unsigned int bits)
+{
+	/* Inodes come in sequences, multiplicative hash spreads them */
+	return (ino * 0x9e370001U) >> (32 - bits);
+}
+
+static int sk_hash_grow(struct sk_hash *h)
+{
+	unsigned int bits = h->bits ? h->bits + 1 : SK_HASH_MIN_BITS, i;
+	struct sk_hash_node **chains;
+
+	chains = xzalloc(sizeof(*chains) << bits);
+	if (!chains)
+		return -1;
+
+	for (i = 0; h->bits && i < (1U << h->bits); i++) {
+		struct sk_hash_node *n, *next;
+
+		for (n = h->chains[i]; n; n = next) {
+			unsigned int c = sk_hash_chain(n->ino, bits);
+
+			next = n->next;
+			n->next = chains[c];
+			chains[c] = n;
+		}
+	}
+
+	xfree(h->chains);
+	h->chains = chains;
+	h->bits = bits;
+	return 0;
+}
+
+int sk_hash_add(struct sk_hash *h, struct sk_hash_node *n, unsigned int ino)
+{
+	unsigned int c;
+
+	/* Keep chains 2 entries long on average */
+	if (!h->bits || (h->nr >> h->bits >= 2 && h->bits < SK_HASH_MAX_BITS))
+		if (sk_hash_grow(h))
+			return -1;
+
+	c = sk_hash_chain(ino, h->bits);
+	n->ino = ino;
+	n->next = h->chains[c];
+	h->chains[c] = n;
+	h->nr++;
+
+	return 0;
+}
+
+struct sk_hash_node *sk_hash_lookup(struct sk_hash *h, unsigned int ino)
+{
+	struct sk_hash_node *n;
+
+	sk_hash_lookups++;
+	if (!h->bits)
+		return NULL;
+
+	for (n = h->chains[sk_hash_chain(ino, h->bits)]; n; n = n->next) {
+		sk_hash_steps++;
+		if (n->ino == ino)
+			return n;
+	}
+
+	return NULL;
+}
+
+void sk_hash_get_stats(unsigned long *lookups, unsigned long *steps)
+{
+	*lookups = sk_hash_lookups;
+	*steps = sk_hash_steps;
+}
+
+static struct sk_hash sockets;
 
 struct socket_desc *lookup_socket(int ino, int family, int proto)
 {
+	struct sk_hash_node *n;
 	struct socket_desc *sd;
 
 	if (!socket_test_collect_bit(family, proto)) {
@@ -239,28 +317,22 @@ struct socket_desc *lookup_socket(int ino, int family, int proto)
 	}
 
 	pr_debug("\tSearching for socket %x (family %d)\n", ino, family);
-	for (sd = sockets[ino % SK_HASH_SIZE]; sd; sd = sd->next)
-		if (sd->ino == ino) {
-			BUG_ON(sd->family != family);
-			return sd;
-		}
+	n = sk_hash_lookup(&sockets, ino);
+	if (!n)
+		return NULL;
 
-	return NULL;
+	sd = container_of(n, struct socket_desc, hash);
+	BUG_ON(sd->family != family);
+	return sd;
 }
 
 int sk_collect_one(int ino, int family, struct socket_desc *d)
 {
-	struct socket_desc **chain;
-
 	d->ino		= ino;
 	d->family	= family;
 	d->already_dumped = 0;
 
-	chain = &sockets[ino % SK_HASH_SIZE];
-	d->next = *chain;
-	*chain = d;
-
-	return 0;
+	return sk_hash_add(&sockets, &d->hash, ino);
 }
 
 int do_restore_opt(int sk, int level, int name, void *val, int len)
@@ -1,30 +1,72 @@
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "asm/atomic.h"
 #include "protobuf.h"
 #include "stats.h"
 #include "image.h"
+#include "sockets.h"
+#include "cr_options.h"
 #include "protobuf/stats.pb-c.h"
 
 struct timing {
-	struct timeval start;
-	struct timeval total;
+	struct timespec start;
+	unsigned long long total;	/* ns */
+};
+
+struct trace_span {
+	int			phase;
+	int			pid;
+	unsigned long long	start;
+	unsigned long long	dur;
+};
+
+/* Shared between restoring tasks, thus the atomic index */
+struct trace {
+	unsigned long long	base;
+	atomic_t		nr;
+	struct trace_span	spans[TRACE_MAX_SPANS];
 };
 
 struct dump_stats {
 	struct timing	timings[DUMP_TIME_NR_STATS];
 	unsigned long	counts[DUMP_CNT_NR_STATS];
+	struct trace	trace;
 };
 
 struct restore_stats {
 	struct timing	timings[RESTORE_TIME_NS_STATS];
 	atomic_t	counts[RESTORE_CNT_NR_STATS];
+	struct trace	trace;
 };
 
 struct dump_stats *dstats;
 struct restore_stats *rstats;
 
+static const char *phase_names[TRACE_NR_PHASES] = {
+	[PHASE_SEIZE]		= "seize",
+	[PHASE_INFECT]		= "infect",
+	[PHASE_VMAS]		= "vmas",
+	[PHASE_PAGEMAP_SCAN]	= "pagemap_scan",
+	[PHASE_PAGE_SPLICE]	= "page_splice",
+	[PHASE_FILES_DUMP]	= "files_dump",
+	[PHASE_SOCKETS_DUMP]	= "sockets_dump",
+	[PHASE_FORK]		= "fork",
+	[PHASE_FILES_RESTORE]	= "files_restore",
+	[PHASE_MEM_RESTORE]	= "mem_restore",
+	[PHASE_RESTORER_JUMP]	= "restorer_jump",
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
 void cnt_add(int c, unsigned long val)
 {
 	if (dstats != NULL) {
@@ -37,24 +79,6 @@ void cnt_add(int c, unsigned long val)
 		BUG();
 }
 
-static void timeval_accumulate(const struct timeval *from, const struct timeval *to,
-		struct timeval *res)
-{
-	suseconds_t usec;
-
-	res->tv_sec += to->tv_sec - from->tv_sec;
-	usec = to->tv_usec;
-	if (usec < from->tv_usec) {
-		usec += USEC_PER_SEC;
-		res->tv_sec -= 1;
-	}
-	res->tv_usec += usec - from->tv_usec;
-	if (res->tv_usec > USEC_PER_SEC) {
-		res->tv_usec -= USEC_PER_SEC;
-		res->tv_sec += 1;
-	}
-}
-
 static struct timing *get_timing(int t)
 {
 	if (dstats != NULL) {
@@ -63,7 +87,7 @@ static struct timing *get_timing(int t)
 	} else if (rstats != NULL) {
 		/*
 		 * FIXME -- this does _NOT_ work when called
-		 * from different tasks.
+		 * from different tasks, use trace spans for that.
 		 */
 		BUG_ON(t >= RESTORE_TIME_NS_STATS);
 		return &rstats->timings[t];
@@ -78,17 +102,18 @@ void timing_start(int t)
 	struct timing *tm;
 
 	tm = get_timing(t);
-	gettimeofday(&tm->start, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &tm->start);
 }
 
 void timing_stop(int t)
 {
 	struct timing *tm;
-	struct timeval now;
+	struct timespec now;
 
 	tm = get_timing(t);
-	gettimeofday(&now, NULL);
-	timeval_accumulate(&tm->start, &now, &tm->total);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tm->total += (now.tv_sec - tm->start.tv_sec) * NSEC_PER_SEC +
+		now.tv_nsec - tm->start.tv_nsec;
 }
 
 static void encode_time(int t, u_int32_t *to)
@@ -96,31 +121,197 @@ static void encode_time(int t, u_int32_t *to)
 	struct timing *tm;
 
 	tm = get_timing(t);
-	*to = tm->total.tv_sec * USEC_PER_SEC + tm->total.tv_usec;
+	*to = tm->total / 1000;
+}
+
+static struct trace *get_trace(void)
+{
+	if (dstats != NULL)
+		return &dstats->trace;
+	if (rstats != NULL)
+		return &rstats->trace;
+
+	/* E.g. page server, it has no stats */
+	return NULL;
+}
+
+unsigned long long trace_start(void)
+{
+	return now_ns();
+}
+
+void trace_stop(int phase, int pid, unsigned long long start)
+{
+	struct trace *tr;
+	struct trace_span *sp;
+	int i;
+
+	tr = get_trace();
+	if (!tr)
+		return;
+
+	BUG_ON(phase >= TRACE_NR_PHASES);
+
+	i = atomic_add_return(1, &tr->nr) - 1;
+	if (i >= TRACE_MAX_SPANS)
+		return;
+
+	sp = &tr->spans[i];
+	sp->phase = phase;
+	sp->pid = pid;
+	sp->start = start - tr->base;
+	sp->dur = now_ns() - start;
+}
+
+static int trace_nr_spans(struct trace *tr)
+{
+	int nr = atomic_read(&tr->nr);
+
+	if (nr > TRACE_MAX_SPANS) {
+		pr_warn("%d trace spans lost\n", nr - TRACE_MAX_SPANS);
+		nr = TRACE_MAX_SPANS;
+	}
+
+	return nr;
+}
+
+static StatsSpanEntry **encode_spans(struct trace *tr, size_t *n)
+{
+	StatsSpanEntry **spans, *se;
+	int i, nr;
+
+	*n = 0;
+	nr = trace_nr_spans(tr);
+	if (!nr)
+		return NULL;
+
+	spans = xmalloc(nr * (sizeof(*spans) + sizeof(*se)));
+	if (!spans)
+		return NULL;
+
+	se = (StatsSpanEntry *)(spans + nr);
+	for (i = 0; i < nr; i++) {
+		struct trace_span *sp = &tr->spans[i];
+
+		stats_span_entry__init(&se[i]);
+		se[i].phase = (char *)phase_names[sp->phase];
+		se[i].pid = sp->pid;
+		se[i].start = sp->start;
+		se[i].duration = sp->dur;
+		spans[i] = &se[i];
+	}
+
+	*n = nr;
+	return spans;
+}
+
+static bool get_io_stats(StatsIoEntry *io)
+{
+	char line[64];
+	bool ret = false;
+	FILE *f;
+
+	f = fopen("/proc/self/io", "r");
+	if (!f)
+		return false; /* no CONFIG_TASK_IO_ACCOUNTING */
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long val;
+		char name[16];
+
+		if (sscanf(line, "%15[^:]: %llu", name, &val) != 2)
+			continue;
+
+		if (!strcmp(name, "rchar"))
+			io->rchar = val;
+		else if (!strcmp(name, "wchar"))
+			io->wchar = val;
+		else if (!strcmp(name, "syscr"))
+			io->syscr = val;
+		else if (!strcmp(name, "syscw")) {
+			io->syscw = val;
+			ret = true;
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Spans in Chrome trace event format, which chrome://tracing and
+ * perfetto load as is. Times there are in usec.
+ */
+static void write_trace_file(struct trace *tr)
+{
+	FILE *f;
+	int i, nr;
+
+	f = fopen(opts.trace_file, "w");
+	if (!f) {
+		pr_perror("Can't create trace file %s", opts.trace_file);
+		return;
+	}
+
+	nr = trace_nr_spans(tr);
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i = 0; i < nr; i++) {
+		struct trace_span *sp = &tr->spans[i];
+
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"criu\",\"ph\":\"X\","
+				"\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}%s\n",
+				phase_names[sp->phase], sp->pid, sp->pid,
+				sp->start / 1000, sp->start % 1000,
+				sp->dur / 1000, sp->dur % 1000,
+				i == nr - 1 ? "" : ",");
+	}
+	fprintf(f, "]}\n");
+	fclose(f);
+}
+
+void get_dump_stats(DumpStatsEntry *ds_entry)
+{
+	unsigned long lookups, steps;
+
+	encode_time(TIME_FREEZING, &ds_entry->freezing_time);
+	encode_time(TIME_FROZEN, &ds_entry->frozen_time);
+	encode_time(TIME_MEMDUMP, &ds_entry->memdump_time);
+	encode_time(TIME_MEMWRITE, &ds_entry->memwrite_time);
+	ds_entry->has_irmap_resolve = true;
+	encode_time(TIME_IRMAP_RESOLVE, &ds_entry->irmap_resolve);
+
+	ds_entry->pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
+	ds_entry->pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
+	ds_entry->pages_written = dstats->counts[CNT_PAGES_WRITTEN];
+
+	sk_hash_get_stats(&lookups, &steps);
+	ds_entry->has_sk_lookups = true;
+	ds_entry->sk_lookups = lookups;
+	ds_entry->has_sk_lookup_steps = true;
+	ds_entry->sk_lookup_steps = steps;
 }
 
 void write_stats(int what)
 {
 	StatsEntry stats = STATS_ENTRY__INIT;
+	unsigned long lookups, steps;
 	DumpStatsEntry ds_entry = DUMP_STATS_ENTRY__INIT;
 	RestoreStatsEntry rs_entry = RESTORE_STATS_ENTRY__INIT;
+	StatsIoEntry io = STATS_IO_ENTRY__INIT;
+	StatsSpanEntry **spans;
+	struct trace *tr;
 	char *name;
 	int fd;
 
 	pr_info("Writing stats\n");
 	if (what == DUMP_STATS) {
 		stats.dump = &ds_entry;
+		get_dump_stats(&ds_entry);
 
-		encode_time(TIME_FREEZING, &ds_entry.freezing_time);
-		encode_time(TIME_FROZEN, &ds_entry.frozen_time);
-		encode_time(TIME_MEMDUMP, &ds_entry.memdump_time);
-		encode_time(TIME_MEMWRITE, &ds_entry.memwrite_time);
-		ds_entry.has_irmap_resolve = true;
-		encode_time(TIME_IRMAP_RESOLVE, &ds_entry.irmap_resolve);
-
-		ds_entry.pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
-		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
-		ds_entry.pages_written = dstats->counts[CNT_PAGES_WRITTEN];
+		tr = &dstats->trace;
+		ds_entry.spans = spans = encode_spans(tr, &ds_entry.n_spans);
+		if (get_io_stats(&io))
+			ds_entry.io = &io;
 
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
@@ -131,9 +322,20 @@ void write_stats(int what)
 		rs_entry.has_pages_restored = true;
 		rs_entry.pages_restored = atomic_read(&rstats->counts[CNT_PAGES_RESTORED]);
 
+		sk_hash_get_stats(&lookups, &steps);
+		rs_entry.has_sk_lookups = true;
+		rs_entry.sk_lookups = lookups;
+		rs_entry.has_sk_lookup_steps = true;
+		rs_entry.sk_lookup_steps = steps;
+
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
 
+		tr = &rstats->trace;
+		rs_entry.spans = spans = encode_spans(tr, &rs_entry.n_spans);
+		if (get_io_stats(&io))
+			rs_entry.io = &io;
+
 		name = "restore";
 	} else
 		return;
@@ -143,15 +345,29 @@ void write_stats(int what)
 		pb_write_one(fd, &stats, PB_STATS);
 		close(fd);
 	}
+
+	xfree(spans);
+
+	if (opts.trace_file)
+		write_trace_file(tr);
 }
 
 int init_stats(int what)
 {
 	if (what == DUMP_STATS) {
 		dstats = xzalloc(sizeof(*dstats));
-		return dstats ? 0 : -1;
+		if (!dstats)
+			return -1;
+
+		dstats->trace.base = now_ns();
+		return 0;
 	}
 
 	rstats = shmalloc(sizeof(struct restore_stats));
-	return rstats ? 0 : -1;
+	if (!rstats)
+		return -1;
+
+	memzero(rstats, sizeof(*rstats));
+	rstats->trace.base = now_ns();
+	return 0;
 }
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+[ "$CRTOOLS_SCRIPT_ACTION" == post-dump ] || exit 0
+[ -n "$ZDTM_FREEZE_BYSTANDER" ] || exit 0
+
+#
+# The task shares the freezer cgroup with the dumped
+# tree but isn't in it, criu must have let it go.
+if grep -q ') t ' /proc/$ZDTM_FREEZE_BYSTANDER/stat; then
+	echo "Task $ZDTM_FREEZE_BYSTANDER out of the tree is left traced"
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,8 @@
+# Compress dumped pages, into local images, via page server and in snapshots
+
+source `dirname $0`/criu-lib.sh &&
+prep &&
+make -C test -j 4 ZDTM_ARGS="-C --dump-args '--compress'" &&
+make -C test -j 4 ZDTM_ARGS="-C -p --dump-args '--compress'" &&
+make -C test -j 4 ZDTM_ARGS="-s -i 3 -C --dump-args '--compress-jobs 2' -x '\(unlink\|socket-tcp\)'" &&
+true || fail
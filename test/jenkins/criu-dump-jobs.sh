@@ -0,0 +1,7 @@
+# Dump pages with parallel writers, into local images and via page server
+
+source `dirname $0`/criu-lib.sh &&
+prep &&
+make -C test -j 4 ZDTM_ARGS="-C --dump-args '--dump-jobs 4'" &&
+make -C test -j 4 ZDTM_ARGS="-C -p --dump-args '--dump-jobs 4'" &&
+true || fail
@@ -0,0 +1,8 @@
+# Freeze tests with the freezer cgroup on dump
+
+source `dirname $0`/criu-lib.sh &&
+prep &&
+mkdir -p /sys/fs/cgroup/freezer &&
+{ mountpoint -q /sys/fs/cgroup/freezer || mount -t cgroup -o freezer freezer /sys/fs/cgroup/freezer; } &&
+make -C test -j 4 ZDTM_ARGS="-C --freeze-cgroup /sys/fs/cgroup/freezer" &&
+true || fail
@@ -0,0 +1,7 @@
+# Restore with the lazy-pages daemon, tests check their memory themselves
+
+source `dirname $0`/criu-lib.sh &&
+prep &&
+make -C test -j 4 ZDTM_ARGS="-C --lazy-pages" &&
+make -C test -j 4 ZDTM_ARGS="-C -i 3 --lazy-pages" &&
+true || fail
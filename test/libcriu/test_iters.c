@@ -32,7 +32,8 @@ static int next_iter(criu_predump_info pi)
 {
 	char p[10];
 
-	printf("   `- %d iter over\n", cur_iter);
+	printf("   `- %d iter over (%lu pages written)\n", cur_iter,
+			criu_predump_pages_written(pi));
 
 	close(cur_imgdir);
 	sprintf(p, "../%d", cur_iter);
@@ -0,0 +1,115 @@
+#!/bin/bash
+
+source ../env.sh || exit 1
+
+USEPS=0
+
+if [ "$1" = "-s" ]; then
+	echo "Will test via page-server"
+	USEPS=1
+	shift
+fi
+
+NRSNAP=${1:-3}
+SPAUSE=${2:-4}
+PORT=12345
+
+function fail {
+	echo "$@"
+	exit 1
+}
+
+function wait_test {
+	while kill -0 $PID > /dev/null 2>&1; do
+		sleep 0.1
+	done
+}
+
+set -x
+
+IMGDIR="dump/"
+TSTDIR="../zdtm/live/static/"
+
+[ $NRSNAP -ge 2 ] || fail "Need at least 2 snapshots"
+
+rm -rf "$IMGDIR"
+mkdir "$IMGDIR"
+
+echo "Launching test"
+cd $TSTDIR
+make cleanout
+make mem-touch
+make mem-touch.pid || fail "Can't start test"
+PID=$(cat mem-touch.pid)
+kill -0 $PID || fail "Test didn't start"
+cd -
+
+echo "Making $NRSNAP snapshots"
+
+for SNAP in $(seq 1 $NRSNAP); do
+	sleep $SPAUSE
+	mkdir "$IMGDIR/$SNAP/"
+	args="--track-mem"
+	[ $SNAP -ne 1 ] && args="$args --prev-images-dir=../$((SNAP - 1))/"
+	if [ $SNAP -eq $NRSNAP ]; then
+		# Last snapshot -- kill afterwards, pages go
+		# to the store later with dedup
+		true
+	elif [ $SNAP -eq $((NRSNAP - 1)) ]; then
+		# Parent of the last one -- is restored too, stop the
+		# test to save its output file of the right size
+		args="$args -s --page-store"
+	else
+		# Other snapshots -- keep running
+		args="$args -R --page-store"
+	fi
+
+	if [ $USEPS -eq 1 ]; then
+		store_arg=""
+		[ $SNAP -ne $NRSNAP ] && store_arg="--page-store"
+		${CRIU} page-server -D "${IMGDIR}/$SNAP/" -o ps.log --port ${PORT} -v4 $store_arg &
+		PS_PID=$!
+		ps_args="--page-server --address 127.0.0.1 --port=${PORT}"
+	else
+		ps_args=""
+	fi
+
+	${CRIU} dump -D "${IMGDIR}/$SNAP/" -o dump.log -t ${PID} -v4 $args $ps_args || fail "Fail to dump"
+	if [ $USEPS -eq 1 ]; then
+		wait $PS_PID
+	fi
+
+	if [ $SNAP -eq $((NRSNAP - 1)) ]; then
+		cp $TSTDIR/mem-touch.out.inprogress "$IMGDIR/mem-touch.out.parent" || fail "Can't save output"
+		kill -CONT $PID
+	fi
+done
+
+echo "Dedup into page store"
+
+${CRIU} dedup --page-store -D "${IMGDIR}/$NRSNAP/" -o dedup.log -v4 || fail "Fail to dedup"
+
+for img in ${IMGDIR}/$NRSNAP/pages-*.img; do
+	[ -s "$img" ] && fail "Pages left in $img"
+done
+
+echo "Restoring the last snapshot"
+${CRIU} restore -D "${IMGDIR}/$NRSNAP/" -o restore.log -d -v4 || fail "Fail to restore last"
+
+cd $TSTDIR
+make mem-touch.out
+wait_test
+cat mem-touch.out | fgrep PASS || fail "Test failed"
+cd -
+
+echo "Restoring the parent snapshot"
+mv $TSTDIR/mem-touch.out $TSTDIR/mem-touch.out.last
+cp "$IMGDIR/mem-touch.out.parent" $TSTDIR/mem-touch.out.inprogress
+${CRIU} restore -D "${IMGDIR}/$((NRSNAP - 1))/" -o restore.log -d -v4 || fail "Fail to restore parent"
+
+cd $TSTDIR
+make mem-touch.out
+wait_test
+cat mem-touch.out | fgrep PASS || fail "Test failed"
+
+echo "Test PASSED"
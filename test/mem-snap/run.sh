@@ -9,5 +9,7 @@ set -e
 ./run-snap-auto-dedup.sh
 ./run-snap-dedup-on-restore.sh
 ./run-snap-dedup.sh
+./run-snap-page-store.sh
+./run-snap-page-store.sh -s
 #./run-snap-maps04.sh
 ./run-snap.sh
@@ -165,6 +165,7 @@ ns/static/bind-mount
 static/utsname
 static/ipc_namespace
 static/shm
+static/shm-sparse
 static/msgque
 static/sem
 transition/ipc
@@ -244,6 +245,9 @@ EXCLUDE_PATTERN=""
 CLEANUP=0
 PAGE_SERVER=0
 PS_PORT=12345
+DUMP_ARGS=""
+RESTORE_ARGS=""
+PS_ARGS=""
 COMPILE_ONLY=0
 START_ONLY=0
 BATCH_TEST=0
@@ -501,7 +505,23 @@ run_test()
 
 	echo "Execute $test"
 
-	start_test $tdir $tname || return 1
+	local freeze_cg=""
+	if [ -n "$FREEZE_CGROUP" ]; then
+		freeze_cg=$FREEZE_CGROUP/zdtm.`basename $tdir`.$tname
+		mkdir -p $freeze_cg/nested || return 1
+		echo $$ > $freeze_cg/tasks || return 1
+		# A task out of the tree, it must be let go on dump
+		sleep 1000 &
+		export ZDTM_FREEZE_BYSTANDER=$!
+		# The test inherits the cgroup, so does its whole tree,
+		# a nested one to check child cgroups are frozen too
+		echo $$ > $freeze_cg/nested/tasks || return 1
+	fi
+
+	start_test $tdir $tname
+	retcode=$?
+	[ -n "$freeze_cg" ] && echo $$ > $FREEZE_CGROUP/tasks
+	[ $retcode -eq 0 ] || return 1
 
 	if [ $START_ONLY -eq 1 ]; then
 		echo "Test is started"
@@ -531,9 +551,10 @@ EOF
 		gen_args="$gen_args -L `pwd`/$tdir/lib"
 	fi
 
+	ps_args="$PS_ARGS"
 	if [ -n "$AUTO_DEDUP" ]; then
 		gen_args="$gen_args --auto-dedup"
-		ps_args="--auto-dedup"
+		ps_args="$ps_args --auto-dedup"
 	fi
 
 	if echo $tname | fgrep -q 'irmap'; then
@@ -541,7 +562,8 @@ EOF
 	fi
 
 	for i in `seq $ITERATIONS`; do
-		local cpt_args=
+		local cpt_args="$DUMP_ARGS"
+		[ -n "$freeze_cg" ] && cpt_args="$cpt_args --freeze-cgroup $freeze_cg --action-script $SCRIPTDIR/freeze-check.sh"
 		local dump_only=
 		local dump_cmd="dump"
 		ddump=`readlink -fm dump/$(basename $tdir)/$tname/$PID/$i`
@@ -634,8 +656,20 @@ EOF
 				"${test}.hook" --pre-restore || return 2
 			fi
 
+			local rst_args="$RESTORE_ARGS"
+			if [ -n "$LAZY_PAGES" ]; then
+				$CRIU lazy-pages -D $ddump -o lazy-pages.log -v4 --pidfile $ddump/lazy-pages.pid --daemon || return 2
+				# The pidfile is written by the daemon itself
+				for j in `seq 50`; do
+					[ -s $ddump/lazy-pages.pid ] && break
+					sleep 0.1
+				done
+				lp_pid=`cat $ddump/lazy-pages.pid` || return 2
+				rst_args="$rst_args --lazy-pages"
+			fi
+
 			echo Restore
-			setsid $CRIU restore -D $ddump -o restore.log -v4 -d $gen_args || return 2
+			setsid $CRIU restore -D $ddump -o restore.log -v4 -d $gen_args $rst_args || return 2
 
 			[ -n "$PIDNS" ] && PID=`cat $TPID`
 			for i in `seq 5`; do
@@ -667,6 +701,23 @@ EOF
 		[ $sltime -lt 9 ] && sltime=$((sltime+1))
 	done
 
+	if [ -n "$freeze_cg" ]; then
+		kill -9 $ZDTM_FREEZE_BYSTANDER
+		wait $ZDTM_FREEZE_BYSTANDER
+		unset ZDTM_FREEZE_BYSTANDER
+		rmdir $freeze_cg/nested $freeze_cg
+	fi
+
+	if [ -n "$lp_pid" ]; then
+		# The daemon exits once the restored tasks are gone
+		while :; do
+			kill -0 $lp_pid > /dev/null 2>&1 || break
+			echo Waiting the lazy-pages daemon $lp_pid
+			sleep 0.1
+		done
+		lp_pid=""
+	fi
+
 	if [ -x "${test}.hook" ]; then
 		echo "Executing cleanup hook"
 		"${test}.hook" --clean
@@ -781,6 +832,12 @@ Options:
 	-P : Make pre-dump instead of dump on all iterations except the last one
 	-s : Make iterative snapshots. Only the last one will be checked.
 	--auto-dedup : Make auto-dedup on restore. Check sizes of pages imges, it must be zero.
+	--dump-args "<ARGS>" : Pass extra arguments to criu dump
+	--restore-args "<ARGS>" : Pass extra arguments to criu restore
+	--ps-args "<ARGS>" : Pass extra arguments to criu page-server
+	--lazy-pages : Restore with the lazy-pages daemon feeding anonymous memory
+	--freeze-cgroup <DIR> : Start tests in sub-cgroups of the freezer hierarchy
+	                        mounted at DIR and dump them with --freeze-cgroup
 	--ct : re-execute $0 in a container
 EOF
 }
@@ -860,6 +917,30 @@ while :; do
 		AUTO_DEDUP=1
 		shift
 		;;
+	  --lazy-pages)
+		LAZY_PAGES=1
+		shift
+		;;
+	  --freeze-cgroup)
+		shift
+		FREEZE_CGROUP=$1
+		shift
+		;;
+	  --dump-args)
+		shift
+		DUMP_ARGS="$DUMP_ARGS $1"
+		shift
+		;;
+	  --restore-args)
+		shift
+		RESTORE_ARGS="$RESTORE_ARGS $1"
+		shift
+		;;
+	  --ps-args)
+		shift
+		PS_ARGS="$PS_ARGS $1"
+		shift
+		;;
 	  -g)
 		COMPILE_ONLY=1
 		shift
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc="Tests sparse and partially swapped out shmems migrate fine "
+		      "along with anonymous shared memory";
+const char *test_author="agent <agent@local>";
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT	21
+#endif
+
+#define NR_PAGES	256
+#define INIT_CRC	(~0)
+
+static inline int page_filled(int i)
+{
+	return i % 3 == 0;
+}
+
+static int check_shm(uint8_t *mem, size_t psize)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < NR_PAGES; i++) {
+		uint8_t *page = mem + i * psize;
+
+		if (page_filled(i)) {
+			crc = INIT_CRC;
+			if (datachk(page, psize, &crc)) {
+				fail("Page %d data are corrupted", i);
+				return -1;
+			}
+			continue;
+		}
+
+		for (j = 0; j < psize; j++)
+			if (page[j]) {
+				fail("Page %d is not empty", i);
+				return -1;
+			}
+	}
+
+	return 0;
+}
+
+static int test_fn(int argc, char **argv)
+{
+	size_t psize = sysconf(_SC_PAGESIZE);
+	uint32_t crc;
+	uint8_t *mem, *anon;
+	int shm, i, ret = -1;
+
+	/*
+	 * Anonymous shared memory is dumped by criu itself and SysV
+	 * one by the namespaces dumper, their images must not clash.
+	 */
+	anon = mmap(NULL, NR_PAGES * psize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (anon == MAP_FAILED) {
+		err("Can't map shared memory: %d\n", -errno);
+		return -1;
+	}
+
+	crc = INIT_CRC;
+	datagen(anon, NR_PAGES * psize, &crc);
+
+	shm = shmget(IPC_PRIVATE, NR_PAGES * psize, 0777 | IPC_CREAT);
+	if (shm == -1) {
+		err("Can't get shm: %d\n", -errno);
+		return -1;
+	}
+
+	mem = shmat(shm, NULL, 0);
+	if (mem == (void *)-1) {
+		err("Can't attach shm: %d\n", -errno);
+		goto out_shm;
+	}
+
+	for (i = 0; i < NR_PAGES; i++) {
+		if (!page_filled(i))
+			continue;
+
+		crc = INIT_CRC;
+		datagen(mem + i * psize, psize, &crc);
+	}
+
+	/*
+	 * Try to push the second half out to swap, swapped out pages
+	 * are not seen by mincore. It's OK if there's no swap at all.
+	 */
+	if (madvise(mem + NR_PAGES / 2 * psize, NR_PAGES / 2 * psize, MADV_PAGEOUT))
+		test_msg("Can't page shmem out: %d\n", -errno);
+
+	test_daemon();
+	test_waitsig();
+
+	if (check_shm(mem, psize) == 0)
+		ret = 0;
+
+	crc = INIT_CRC;
+	if (datachk(anon, NR_PAGES * psize, &crc)) {
+		fail("Anonymous shared memory data are corrupted");
+		ret = -1;
+	}
+
+	if (shmdt(mem) < 0) {
+		err("Can't detach shm: %d\n", -errno);
+		ret = -1;
+	}
+out_shm:
+	if (shmctl(shm, IPC_RMID, NULL) < 0) {
+		fail("Failed to destroy segment: %d\n", -errno);
+		ret = -1;
+	}
+	if (ret == 0)
+		pass();
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef NEW_IPC_NS
+	test_init_ns(argc, argv, CLONE_NEWIPC, test_fn);
+#else
+	test_init(argc, argv);
+	test_fn(argc, argv);
+#endif
+	return 0;
+}
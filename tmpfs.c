@@ -0,0 +1,728 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "asm/types.h"
+#include "util.h"
+#include "servicefd.h"
+#include "image.h"
+#include "tmpfs.h"
+
+#include "protobuf.h"
+#include "protobuf/tmpfs.pb-c.h"
+
+/*
+ * Tmpfs contents are dumped into two images -- tmpfs-entries with
+ * metadata of files in the order the tree is walked, i.e. parents
+ * go before children, and tmpfs-data with regular files data, holes
+ * skipped. Regular files, that have the same ino, size, mtime and
+ * ctime as in the parent images, refer to data there instead of
+ * having it copied again, like pagemaps do with in_parent.
+ */
+
+#define TMPFS_HASH_BITS		12
+#define TMPFS_HASH_SIZE		(1 << TMPFS_HASH_BITS)
+
+struct tmpfs_link {
+	u64			ino;
+	char			*path;
+	struct tmpfs_link	*next;
+};
+
+struct tmpfs_parent {
+	TmpfsEntry		*pe;
+	struct tmpfs_parent	*next;
+};
+
+struct tmpfs_dump_ctx {
+	unsigned int		s_dev;
+	dev_t			st_dev;
+	int			fd_ent;
+	int			fd_data;
+	u64			data_off;
+
+	/* first paths of hard-linked files */
+	struct tmpfs_link	*links[TMPFS_HASH_SIZE];
+	/* regular files from the parent images by path */
+	struct tmpfs_parent	*parent[TMPFS_HASH_SIZE];
+};
+
+static unsigned int path_hash(const char *path)
+{
+	unsigned int h = 5381;
+
+	while (*path)
+		h = h * 33 + *path++;
+
+	return h & (TMPFS_HASH_SIZE - 1);
+}
+
+static inline u64 ts_to_ns(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline void ns_to_ts(u64 ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static char *link_lookup(struct tmpfs_dump_ctx *c, u64 ino)
+{
+	struct tmpfs_link *l;
+
+	for (l = c->links[ino & (TMPFS_HASH_SIZE - 1)]; l; l = l->next)
+		if (l->ino == ino)
+			return l->path;
+
+	return NULL;
+}
+
+static int link_add(struct tmpfs_dump_ctx *c, u64 ino, char *path)
+{
+	struct tmpfs_link *l, **chain;
+
+	l = xmalloc(sizeof(*l));
+	if (!l)
+		return -1;
+
+	l->path = xstrdup(path);
+	if (!l->path) {
+		xfree(l);
+		return -1;
+	}
+
+	chain = &c->links[ino & (TMPFS_HASH_SIZE - 1)];
+	l->ino = ino;
+	l->next = *chain;
+	*chain = l;
+	return 0;
+}
+
+static TmpfsEntry *parent_lookup(struct tmpfs_dump_ctx *c, char *path)
+{
+	struct tmpfs_parent *p;
+
+	for (p = c->parent[path_hash(path)]; p; p = p->next)
+		if (!strcmp(p->pe->path, path))
+			return p->pe;
+
+	return NULL;
+}
+
+static int load_parent(struct tmpfs_dump_ctx *c)
+{
+	int pfd, fd, ret;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		pr_perror("Can't open parent images dir");
+		return -1;
+	}
+
+	fd = open_image_at(pfd, CR_FD_TMPFS_ENTRIES, O_RSTR | O_OPT | O_BUF, c->s_dev);
+	close(pfd);
+	if (fd == -ENOENT)
+		return 0;
+	if (fd < 0)
+		return -1;
+
+	while (1) {
+		struct tmpfs_parent *p, **chain;
+		TmpfsEntry *pe;
+
+		ret = pb_read_one_eof(fd, &pe, PB_TMPFS);
+		if (ret <= 0)
+			break;
+
+		if (!S_ISREG(pe->mode) || pe->link) {
+			tmpfs_entry__free_unpacked(pe, NULL);
+			continue;
+		}
+
+		p = xmalloc(sizeof(*p));
+		if (!p) {
+			tmpfs_entry__free_unpacked(pe, NULL);
+			ret = -1;
+			break;
+		}
+
+		chain = &c->parent[path_hash(pe->path)];
+		p->pe = pe;
+		p->next = *chain;
+		*chain = p;
+	}
+
+	close_image(fd);
+	return ret;
+}
+
+static void free_dump_ctx(struct tmpfs_dump_ctx *c)
+{
+	int i;
+
+	for (i = 0; i < TMPFS_HASH_SIZE; i++) {
+		while (c->links[i]) {
+			struct tmpfs_link *l = c->links[i];
+
+			c->links[i] = l->next;
+			xfree(l->path);
+			xfree(l);
+		}
+
+		while (c->parent[i]) {
+			struct tmpfs_parent *p = c->parent[i];
+
+			c->parent[i] = p->next;
+			tmpfs_entry__free_unpacked(p->pe, NULL);
+			xfree(p);
+		}
+	}
+}
+
+static int copy_data(int to, int from, u64 off, u64 len)
+{
+	off_t pos = off;
+
+	while (len) {
+		ssize_t ret;
+
+		ret = sendfile(to, from, &pos, min(len, (u64)INT_MAX & ~(PAGE_SIZE - 1)));
+		if (ret <= 0) {
+			if (ret == 0)
+				pr_err("Unexpected end of file at %"PRIu64"\n", (u64)pos);
+			else
+				pr_perror("Can't copy file data");
+			return -1;
+		}
+
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int add_extent(TmpfsEntry *te, u64 off, u64 len)
+{
+	TmpfsExtent **e, *ext;
+
+	ext = xmalloc(sizeof(*ext));
+	if (!ext)
+		return -1;
+
+	e = xrealloc(te->extents, (te->n_extents + 1) * sizeof(*e));
+	if (!e) {
+		xfree(ext);
+		return -1;
+	}
+
+	tmpfs_extent__init(ext);
+	ext->off = off;
+	ext->len = len;
+
+	te->extents = e;
+	te->extents[te->n_extents++] = ext;
+	return 0;
+}
+
+static int dump_reg_data(struct tmpfs_dump_ctx *c, int dfd, char *name,
+		TmpfsEntry *te)
+{
+	TmpfsEntry *pe;
+	off_t off = 0;
+	int fd, ret = -1;
+
+	pe = parent_lookup(c, te->path);
+	if (pe && pe->ino == te->ino && pe->size == te->size &&
+	    pe->mtime == te->mtime && pe->ctime == te->ctime) {
+		/* Extents are borrowed, see dump_entry() */
+		te->n_extents = pe->n_extents;
+		te->extents = pe->extents;
+		te->has_data_off = true;
+		te->data_off = pe->data_off;
+		te->has_in_parent = true;
+		te->in_parent = pe->in_parent + 1;
+		return 0;
+	}
+
+	fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		pr_perror("Can't open %s", te->path);
+		return -1;
+	}
+
+	te->has_data_off = true;
+	te->data_off = c->data_off;
+
+	while (off < te->size) {
+		off_t start, end;
+
+		start = lseek(fd, off, SEEK_DATA);
+		if (start < 0) {
+			if (errno == ENXIO)
+				break; /* only a hole up to the end */
+			pr_perror("Can't find data in %s", te->path);
+			goto out;
+		}
+
+		end = lseek(fd, start, SEEK_HOLE);
+		if (end < 0) {
+			pr_perror("Can't find hole in %s", te->path);
+			goto out;
+		}
+
+		if (end > te->size)
+			end = te->size;
+		if (start >= end)
+			break;
+
+		if (add_extent(te, start, end - start))
+			goto out;
+
+		if (copy_data(c->fd_data, fd, start, end - start))
+			goto out;
+
+		c->data_off += end - start;
+		off = end;
+	}
+
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int dump_entry(struct tmpfs_dump_ctx *c, int dfd, char *name,
+		char *path, struct stat *st)
+{
+	TmpfsEntry te = TMPFS_ENTRY__INIT;
+	char target[PATH_MAX];
+	int ret = -1, i;
+
+	te.path		= path;
+	te.mode		= st->st_mode;
+	te.uid		= st->st_uid;
+	te.gid		= st->st_gid;
+	te.mtime	= ts_to_ns(&st->st_mtim);
+	te.has_ctime	= true;
+	te.ctime	= ts_to_ns(&st->st_ctim);
+	te.has_ino	= true;
+	te.ino		= st->st_ino;
+
+	if (!S_ISDIR(st->st_mode) && st->st_nlink > 1) {
+		te.link = link_lookup(c, st->st_ino);
+		if (te.link)
+			goto write;
+		if (link_add(c, st->st_ino, path))
+			return -1;
+	}
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFREG:
+		te.has_size = true;
+		te.size = st->st_size;
+		if (dump_reg_data(c, dfd, name, &te))
+			goto out;
+		break;
+	case S_IFLNK:
+		ret = readlinkat(dfd, name, target, sizeof(target) - 1);
+		if (ret < 0) {
+			pr_perror("Can't read link %s", path);
+			return -1;
+		}
+		target[ret] = '\0';
+		te.target = target;
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		te.has_rdev = true;
+		te.rdev = st->st_rdev;
+		break;
+	}
+
+write:
+	ret = pb_write_one(c->fd_ent, &te, PB_TMPFS);
+out:
+	if (!te.in_parent) {
+		for (i = 0; i < te.n_extents; i++)
+			xfree(te.extents[i]);
+		xfree(te.extents);
+	}
+	return ret;
+}
+
+/*
+ * Something else is mounted here. Like tar's --one-file-system we
+ * keep the entry itself, mounts need it on restore, but neither
+ * data nor contents of what is mounted.
+ */
+static int dump_mountpoint(struct tmpfs_dump_ctx *c, char *path, struct stat *st)
+{
+	TmpfsEntry te = TMPFS_ENTRY__INIT;
+
+	te.path		= path;
+	te.mode		= st->st_mode;
+	te.uid		= st->st_uid;
+	te.gid		= st->st_gid;
+	te.mtime	= ts_to_ns(&st->st_mtim);
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFREG:
+		te.has_size = true;
+		te.size = 0;
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		te.has_rdev = true;
+		te.rdev = st->st_rdev;
+		break;
+	}
+
+	pr_debug("Dumping mountpoint %s only\n", path);
+	return pb_write_one(c->fd_ent, &te, PB_TMPFS);
+}
+
+/* Takes dfd over */
+static int dump_dir(struct tmpfs_dump_ctx *c, int dfd, char *path)
+{
+	struct dirent *de;
+	DIR *d;
+	int ret = -1;
+
+	d = fdopendir(dfd);
+	if (!d) {
+		pr_perror("Can't open dir %s", path);
+		close(dfd);
+		return -1;
+	}
+
+	while ((de = readdir(d))) {
+		char p[PATH_MAX];
+		struct stat st;
+
+		if (dir_dots(de))
+			continue;
+
+		snprintf(p, sizeof(p), "%s/%s", path, de->d_name);
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			pr_perror("Can't stat %s", p);
+			goto out;
+		}
+
+		if (st.st_dev != c->st_dev) {
+			if (dump_mountpoint(c, p, &st))
+				goto out;
+			continue;
+		}
+
+		if (dump_entry(c, dirfd(d), de->d_name, p, &st))
+			goto out;
+
+		if (S_ISDIR(st.st_mode)) {
+			int sfd;
+
+			sfd = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (sfd < 0) {
+				pr_perror("Can't open dir %s", p);
+				goto out;
+			}
+
+			if (dump_dir(c, sfd, p))
+				goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	closedir(d);
+	return ret;
+}
+
+int tmpfs_dump_tree(int mnt_fd, unsigned int s_dev)
+{
+	struct tmpfs_dump_ctx *c;
+	struct stat st;
+	int fd, ret = -1;
+
+	c = xzalloc(sizeof(*c));
+	if (!c)
+		return -1;
+
+	c->s_dev = s_dev;
+	c->fd_ent = c->fd_data = -1;
+
+	if (fstat(mnt_fd, &st)) {
+		pr_perror("Can't stat tmpfs root");
+		goto out;
+	}
+	c->st_dev = st.st_dev;
+
+	if (load_parent(c))
+		goto out;
+
+	c->fd_ent = open_image(CR_FD_TMPFS_ENTRIES, O_DUMP | O_BUF, s_dev);
+	if (c->fd_ent < 0)
+		goto out;
+
+	c->fd_data = open_image(CR_FD_TMPFS_DATA, O_DUMP, s_dev);
+	if (c->fd_data < 0)
+		goto out;
+
+	if (dump_entry(c, mnt_fd, ".", ".", &st))
+		goto out;
+
+	fd = dup(mnt_fd);
+	if (fd < 0) {
+		pr_perror("Can't dup tmpfs root");
+		goto out;
+	}
+
+	ret = dump_dir(c, fd, ".");
+	if (!ret)
+		pr_info("Dumped %"PRIu64" bytes of tmpfs %#x data\n", c->data_off, s_dev);
+out:
+	if (c->fd_ent >= 0 && close_image(c->fd_ent))
+		ret = -1;
+	close_safe(&c->fd_data);
+	free_dump_ctx(c);
+	xfree(c);
+	return ret;
+}
+
+struct tmpfs_dir_time {
+	char			*path;
+	u64			mtime;
+};
+
+struct tmpfs_rst_ctx {
+	unsigned int		s_dev;
+	int			*data_fds;	/* by in_parent depth */
+	unsigned int		nr_data_fds;
+
+	/* set after the dirs are filled */
+	struct tmpfs_dir_time	*dirs;
+	unsigned int		nr_dirs;
+};
+
+static int data_fd(struct tmpfs_rst_ctx *r, unsigned int depth)
+{
+	int dfd = get_service_fd(IMG_FD_OFF), pfd = -1;
+	char path[PATH_MAX] = ".";
+	unsigned int i;
+
+	if (depth >= r->nr_data_fds) {
+		int *fds;
+
+		fds = xrealloc(r->data_fds, (depth + 1) * sizeof(*fds));
+		if (!fds)
+			return -1;
+
+		for (i = r->nr_data_fds; i <= depth; i++)
+			fds[i] = -1;
+		r->data_fds = fds;
+		r->nr_data_fds = depth + 1;
+	}
+
+	if (r->data_fds[depth] >= 0)
+		return r->data_fds[depth];
+
+	for (i = 0; i < depth; i++) {
+		int len = strlen(path);
+
+		snprintf(path + len, sizeof(path) - len, "/%s", CR_PARENT_LINK);
+	}
+
+	pfd = openat(dfd, path, O_RDONLY | O_DIRECTORY);
+	if (pfd < 0) {
+		pr_perror("Can't open images dir %s", path);
+		return -1;
+	}
+
+	r->data_fds[depth] = open_image_at(pfd, CR_FD_TMPFS_DATA, O_RSTR, r->s_dev);
+	close(pfd);
+
+	return r->data_fds[depth];
+}
+
+static int restore_reg(struct tmpfs_rst_ctx *r, int dfd, TmpfsEntry *te)
+{
+	int fd, data = -1, i, ret = -1;
+	u64 off = te->data_off;
+
+	fd = openat(dfd, te->path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		pr_perror("Can't create %s", te->path);
+		return -1;
+	}
+
+	if (te->n_extents) {
+		data = data_fd(r, te->in_parent);
+		if (data < 0)
+			goto out;
+	}
+
+	for (i = 0; i < te->n_extents; i++) {
+		TmpfsExtent *ext = te->extents[i];
+
+		if (lseek(fd, ext->off, SEEK_SET) < 0) {
+			pr_perror("Can't seek %s", te->path);
+			goto out;
+		}
+
+		if (copy_data(fd, data, off, ext->len))
+			goto out;
+
+		off += ext->len;
+	}
+
+	if (ftruncate(fd, te->size)) {
+		pr_perror("Can't truncate %s", te->path);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int restore_entry(struct tmpfs_rst_ctx *r, int dfd, TmpfsEntry *te)
+{
+	char *path = te->path;
+	struct timespec ts[2];
+
+	if (te->link) {
+		if (linkat(dfd, te->link, dfd, path, 0)) {
+			pr_perror("Can't link %s to %s", path, te->link);
+			return -1;
+		}
+		return 0;
+	}
+
+	switch (te->mode & S_IFMT) {
+	case S_IFDIR:
+		if (strcmp(path, ".") && mkdirat(dfd, path, 0700) && errno != EEXIST) {
+			pr_perror("Can't create dir %s", path);
+			return -1;
+		}
+		break;
+	case S_IFREG:
+		if (restore_reg(r, dfd, te))
+			return -1;
+		break;
+	case S_IFLNK:
+		if (!te->target || symlinkat(te->target, dfd, path)) {
+			pr_perror("Can't create symlink %s", path);
+			return -1;
+		}
+		break;
+	default:
+		if (mknodat(dfd, path, te->mode, te->rdev)) {
+			pr_perror("Can't create node %s", path);
+			return -1;
+		}
+		break;
+	}
+
+	if (fchownat(dfd, path, te->uid, te->gid, AT_SYMLINK_NOFOLLOW)) {
+		pr_perror("Can't chown %s", path);
+		return -1;
+	}
+
+	/* After chown, as it drops suid bits */
+	if (!S_ISLNK(te->mode) && fchmodat(dfd, path, te->mode & 07777, 0)) {
+		pr_perror("Can't chmod %s", path);
+		return -1;
+	}
+
+	if (S_ISDIR(te->mode)) {
+		struct tmpfs_dir_time *d;
+
+		d = xrealloc(r->dirs, (r->nr_dirs + 1) * sizeof(*d));
+		if (!d)
+			return -1;
+
+		r->dirs = d;
+		d = &r->dirs[r->nr_dirs];
+		d->path = xstrdup(path);
+		if (!d->path)
+			return -1;
+		d->mtime = te->mtime;
+		r->nr_dirs++;
+		return 0;
+	}
+
+	ts[0].tv_nsec = UTIME_OMIT;
+	ns_to_ts(te->mtime, &ts[1]);
+	if (utimensat(dfd, path, ts, AT_SYMLINK_NOFOLLOW)) {
+		pr_perror("Can't set times on %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int tmpfs_restore_tree(const char *mountpoint, unsigned int s_dev)
+{
+	struct tmpfs_rst_ctx r = { .s_dev = s_dev, };
+	int fd, dfd, ret;
+	unsigned int i;
+
+	fd = open_image(CR_FD_TMPFS_ENTRIES, O_RSTR | O_OPT | O_BUF, s_dev);
+	if (fd < 0)
+		return fd;
+
+	dfd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		pr_perror("Can't open %s", mountpoint);
+		close_image(fd);
+		return -1;
+	}
+
+	while (1) {
+		TmpfsEntry *te;
+
+		ret = pb_read_one_eof(fd, &te, PB_TMPFS);
+		if (ret <= 0)
+			break;
+
+		ret = restore_entry(&r, dfd, te);
+		tmpfs_entry__free_unpacked(te, NULL);
+		if (ret)
+			break;
+	}
+
+	/* Children are after parents, so go backwards */
+	for (i = r.nr_dirs; i > 0; i--) {
+		struct tmpfs_dir_time *d = &r.dirs[i - 1];
+		struct timespec ts[2];
+
+		ts[0].tv_nsec = UTIME_OMIT;
+		ns_to_ts(d->mtime, &ts[1]);
+		if (!ret && utimensat(dfd, d->path, ts, 0)) {
+			pr_perror("Can't set times on %s", d->path);
+			ret = -1;
+		}
+
+		xfree(d->path);
+	}
+	xfree(r.dirs);
+
+	for (i = 0; i < r.nr_data_fds; i++)
+		close_safe(&r.data_fds[i]);
+	xfree(r.data_fds);
+
+	close(dfd);
+	close_image(fd);
+
+	if (ret)
+		pr_err("Can't restore tmpfs %#x contents\n", s_dev);
+	return ret;
+}
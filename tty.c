@@ -459,19 +459,13 @@ err:
 
 static int pty_open_slaves(struct tty_info *info)
 {
-	int sock = -1, fd = -1, ret = -1;
+	int fd = -1, ret = -1;
 	struct fdinfo_list_entry *fle;
 	struct tty_info *slave;
 	char pts_name[64];
 
 	snprintf(pts_name, sizeof(pts_name), PTS_FMT, info->tie->pty->index);
 
-	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		pr_perror("Can't create socket");
-		goto err;
-	}
-
 	list_for_each_entry(slave, &info->sibling, sibling) {
 		BUG_ON(pty_is_master(slave));
 
@@ -489,8 +483,8 @@ static int pty_open_slaves(struct tty_info *info)
 		pr_debug("send slave %#x fd %d connected on %s (pid %d)\n",
 			 slave->tfe->id, fd, pts_name, fle->pid);
 
-		if (send_fd_to_peer(fd, fle, sock)) {
-			pr_perror("Can't send file descriptor");
+		if (send_fd_to_peer(fd, fle)) {
+			pr_err("Can't send file descriptor\n");
 			goto err;
 		}
 
@@ -501,7 +495,6 @@ static int pty_open_slaves(struct tty_info *info)
 
 err:
 	close_safe(&fd);
-	close_safe(&sock);
 	return ret;
 }
 
@@ -513,8 +506,7 @@ static int receive_tty(struct tty_info *info)
 	fle = file_master(&info->d);
 	pr_info("\tWaiting tty fd %d (pid %d)\n", fle->fe->fd, fle->pid);
 
-	fd = recv_fd(fle->fe->fd);
-	close(fle->fe->fd);
+	fd = recv_fd_from_peer(fle);
 	if (fd < 0) {
 		pr_err("Can't get fd %d\n", fd);
 		return -1;
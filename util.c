@@ -686,6 +686,64 @@ struct vma_area *alloc_vma_area(void)
 	return p;
 }
 
+/*
+ * Tasks may have tens of thousands of VMAs, so on dump they are
+ * allocated in arrays of VMA_BATCH_NR, hanging off the vm_area_list.
+ */
+#define VMA_BATCH_NR	512
+
+struct vma_area_batch {
+	struct vma_area_batch	*next;
+	unsigned int		nr;
+	struct {
+		struct vma_area	a;
+		VmaEntry	e;
+	} s[VMA_BATCH_NR];
+};
+
+struct vma_area *alloc_vma_area_in(struct vm_area_list *vml)
+{
+	struct vma_area_batch *b = vml->batch;
+	struct vma_area *p;
+
+	if (!b || b->nr == VMA_BATCH_NR) {
+		b = xzalloc(sizeof(*b));
+		if (!b)
+			return NULL;
+
+		b->next = vml->batch;
+		vml->batch = b;
+	}
+
+	p = &b->s[b->nr].a;
+	p->e = &b->s[b->nr].e;
+	b->nr++;
+
+	vma_entry__init(p->e);
+	p->vm_file_fd = -1;
+	p->e->fd = -1;
+	p->in_batch = true;
+
+	return p;
+}
+
+void free_vma_area(struct vma_area *vma)
+{
+	if (!vma->in_batch)
+		xfree(vma);
+}
+
+void free_vma_batches(struct vm_area_list *vml)
+{
+	struct vma_area_batch *b;
+
+	while (vml->batch) {
+		b = vml->batch;
+		vml->batch = b->next;
+		xfree(b);
+	}
+}
+
 int mkdirp(const char *path)
 {
 	size_t i;